@@ -1,29 +1,154 @@
 #include "FingerPrint.h"
+#include "FingerPrintIndex.h"
+#include "FingerPrintMatcher.h"
+#include "FingerPrintRemote.h"
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
+#include <vector>
+
+// Link settings walked by auto-tune, fastest first
+static const struct {
+  uint32_t baudrate;
+  uint16_t packetSize;
+} LINK_LADDER[] = {
+  {115200, 256}, {115200, 128}, {57600, 128}, {57600, 64},
+  {38400, 64}, {19200, 32}, {9600, 32},
+};
+static const uint8_t LINK_LEVELS = sizeof(LINK_LADDER) / sizeof(LINK_LADDER[0]);
+static const uint8_t LINK_WINDOW = 8;            // transfers per error-rate window
+static const uint8_t LINK_STEP_DOWN_ERRORS = 2;  // errors in a window that force a slower setting
+static const uint16_t LINK_STEP_UP_CLEAN = 32;   // clean transfers before trying a faster setting
+static const uint16_t LINK_STEP_UP_MAX = 1024;   // cap for the step-up backoff
+static const uint8_t LINK_MAX_ATTEMPTS = 3;      // download attempts per template
+static const uint32_t CAPTURE_TIMEOUT_MS = 10000; // give up on a capture with no usable frame
+static const uint8_t ADAPT_MIN_SAMPLES = 4;      // genuine scores before a user's own threshold applies
+static const uint8_t RACE_CONFIRM = 3;           // host candidates confirmed on the sensor after an undecided race
+static const uint32_t RACE_SEARCH_TIMEOUT_MS = 5000; // give up on a raced Search reply
+static const uint32_t RACE_TASK_STACK = 6144;    // host scan task: prepared probe lives with the caller
+
+static uint8_t packetSizeCode(uint16_t packetSize) {
+  switch (packetSize) {
+    case 32:  return FINGERPRINT_PACKET_SIZE_32;
+    case 64:  return FINGERPRINT_PACKET_SIZE_64;
+    case 256: return FINGERPRINT_PACKET_SIZE_256;
+    default:  return FINGERPRINT_PACKET_SIZE_128;
+  }
+}
+
+// Slowest ladder entry that is not faster than the given setting
+static uint8_t linkLevelFor(uint32_t baudrate, uint16_t packetSize) {
+  for (uint8_t i = 0; i < LINK_LEVELS; i++) {
+    if (LINK_LADDER[i].baudrate <= baudrate && LINK_LADDER[i].packetSize <= packetSize) {
+      return i;
+    }
+  }
+  return LINK_LEVELS - 1;
+}
 
 FingerPrint::FingerPrint(Adafruit_Fingerprint* sensor) {
   _sensor = sensor;
   _serial = nullptr;
+  _baudrate = 57600;
+  _packetSize = 128;
+  _autoTune = false;
+  _lastTransferClean = true;
+  _linkLevel = linkLevelFor(_baudrate, _packetSize);
+  _windowTransfers = 0;
+  _windowErrors = 0;
+  _cleanRun = 0;
+  _stepUpAfter = LINK_STEP_UP_CLEAN;
+  memset(&_link, 0, sizeof(_link));
+  // Starting estimates for a 57600 baud link until real timings come in
+  _costs.uploadUs = 280000;
+  _costs.matchUs = 30000;
+  _costs.searchPerSlotUs = 1000;
+  _costs.searchHitRate = 128;
+  _costs.downloadUs = 250000;
+  _costs.hostSearchUs = 20000;
+  _costs.hostCompareUs = 1500;
+  _acceptScore = 0;
+  _adaptiveFloor = 0;
+  _adaptiveDeviations = 2;
+  _index = nullptr;
+  _shortlist = 8;
+  _ambiguityMargin = 20;
+  _burstWindowMs = 0;
+  _burstMinQuality = 0;
+  memset(&_capture, 0, sizeof(_capture));
+  memset(&_startup, 0, sizeof(_startup));
+  _log = nullptr;
+  _racing = false;
+  memset(&_race, 0, sizeof(_race));
+  _searchPending = false;
+  _searchSentMs = 0;
+  _liftPending = false;
+  _remote = nullptr;
+  _probeHeld = false;
 }
 
 void FingerPrint::setSerial(Stream* serial) {
   _serial = serial;
 }
 
+void FingerPrint::setLog(FingerPrintLog* log) {
+  _log = log;
+}
+
+// Transfer diagnostics go to the deferred log when one is set, so the byte
+// loops are not held up by the console; otherwise they print as before
+template <typename... Args>
+void FingerPrint::_trace(FingerPrintLog::Level level, const char* format, Args... args) {
+  if (_log) {
+    _log->write(level, format, args...);
+  } else {
+    Serial.printf(format, args...);
+  }
+}
+
 void FingerPrint::begin(uint32_t baudrate) {
+  uint32_t started = micros();
+  _startup.stageUs[STAGE_BOOT] = started;
+  _baudrate = baudrate;
   _sensor->begin(baudrate);
+  noteStartupStage(STAGE_BEGIN, started);
 }
 
 bool FingerPrint::init(){
   Serial.println("\nFingerprint sensor checking...");
-  if(_sensor->verifyPassword()) {
+  _settleSensor(false);
+  uint32_t started = micros();
+  bool found = _sensor->verifyPassword();
+  noteStartupStage(STAGE_VERIFY_PASSWORD, started);
+  // A previous auto-tune session may have left the sensor at another rate
+  if (!found && _autoTune) {
+    started = micros();
+    found = _probeBaudrate();
+    noteStartupStage(STAGE_BAUD_PROBE, started);
+  }
+  if(found) {
     Serial.println("Fingerprint sensor detected!");
 
+    started = micros();
     _sensor->getParameters();
+    noteStartupStage(STAGE_GET_PARAMETERS, started);
     Serial.print(F("Sys ID: 0x")); Serial.println(_sensor->system_id, HEX);
     Serial.print(F("Capacity: ")); Serial.println(_sensor->capacity);
+    if (_sensor->packet_len) {
+      _packetSize = _sensor->packet_len;
+    }
+    // The rate begin() or the probe talked at is the link rate. The driver
+    // keeps the reported one in a uint16_t, wrapped above 57600 (115200
+    // reads as 49664), so it is only a fallback when no rate was set.
+    if (_baudrate == 0 && _sensor->baud_rate && _sensor->baud_rate <= 57600) {
+      _baudrate = _sensor->baud_rate;
+    }
+    _linkLevel = linkLevelFor(_baudrate, _packetSize);
+    Serial.printf("Link: %lu baud, %u-byte packets\n", (unsigned long)_baudrate, _packetSize);
 
+    started = micros();
     _sensor->getTemplateCount();
+    noteStartupStage(STAGE_TEMPLATE_COUNT, started);
     Serial.print(F("Template count: ")); Serial.println(_sensor->templateCount);
     return true;
   } else {
@@ -49,13 +174,243 @@ int16_t FingerPrint::_readByte(uint32_t timeout_ms) {
   return _serial->read();
 }
 
+void FingerPrint::setAutoTune(bool enabled) {
+  _autoTune = enabled;
+  _windowTransfers = 0;
+  _windowErrors = 0;
+  _cleanRun = 0;
+  _stepUpAfter = LINK_STEP_UP_CLEAN;
+}
+
+FingerPrint::LinkStats FingerPrint::getLinkStats() const {
+  LinkStats stats = _link;
+  stats.baudrate = _baudrate;
+  stats.packetSize = _packetSize;
+  return stats;
+}
+
+// windowMs 0: use the first frame the sensor converts (or, with a quality
+// floor, the first one that reaches it). Otherwise keep capturing for
+// windowMs after the first usable frame and use the best one. Rating a frame
+// costs a template download, so keep the window short on slow links.
+void FingerPrint::setBurstCapture(uint16_t windowMs, uint16_t minQuality) {
+  _burstWindowMs = windowMs;
+  _burstMinQuality = minQuality;
+}
+
+FingerPrint::CaptureStats FingerPrint::getCaptureStats() const {
+  return _capture;
+}
+
+// Record a startup stage that began at micros() == startedUs and ends now.
+// begin(), init() and warmCaches() record their own stages; the application
+// reports the rest, e.g. STAGE_GALLERY_LOAD around loading its templates.
+void FingerPrint::noteStartupStage(StartupStage stage, uint32_t startedUs) {
+  if (stage >= STAGE_COUNT) {
+    return;
+  }
+  uint32_t now = micros();
+  if (stage != STAGE_BOOT) {
+    _startup.stageUs[stage] = now - startedUs;
+  }
+  _startup.readyUs = now;
+}
+
+FingerPrint::StartupReport FingerPrint::getStartupReport() const {
+  return _startup;
+}
+
+void FingerPrint::printStartupReport() const {
+  static const char* const names[STAGE_COUNT] = {
+    "boot", "begin", "verifyPassword", "baud probe",
+    "getParameters", "getTemplateCount", "gallery load", "cache warmup",
+  };
+  Serial.println("\n---- Startup ----");
+  uint8_t slowest = 0;
+  for (uint8_t i = 0; i < STAGE_COUNT; i++) {
+    if (_startup.stageUs[i] > _startup.stageUs[slowest]) {
+      slowest = i;
+    }
+  }
+  for (uint8_t i = 0; i < STAGE_COUNT; i++) {
+    if (_startup.stageUs[i] == 0) {
+      continue;
+    }
+    Serial.printf("%-18s %8lu us%s\n", names[i], (unsigned long)_startup.stageUs[i],
+                  i == slowest ? "  <- slowest" : "");
+  }
+  Serial.printf("Ready to scan at %lu ms after power-on\n", (unsigned long)(_startup.readyUs / 1000));
+}
+
+// Discard whatever is left of a broken transfer so the next packet starts clean
+void FingerPrint::_drainSerial() {
+  if (!_serial) {
+    return;
+  }
+  delay(50);
+  while (_serial->available()) {
+    _serial->read();
+  }
+}
+
+// Finish what a host-won race left running on the sensor before sending it
+// anything else: read and drop the Search reply, and before a new capture,
+// wait for the identified finger to lift
+void FingerPrint::_settleSensor(bool capture) {
+  if (_searchPending) {
+    _searchPending = false;
+    while (!_serial->available() && millis() - _searchSentMs <= RACE_SEARCH_TIMEOUT_MS) {
+      delay(1);
+    }
+    uint16_t page = 0;
+    uint16_t score = 0;
+    if (!_serial->available() || _readSearchReply(&page, &score) == FINGERPRINT_TIMEOUT) {
+      _drainSerial();
+    }
+  }
+  if (capture && _liftPending) {
+    _liftPending = false;
+    while (_sensor->getImage() != FINGERPRINT_NOFINGER) {
+      delay(100);
+    }
+  }
+}
+
+// Feed one transfer outcome into the error-rate window and step the link
+// setting down when errors pile up, or back up after a long clean run
+void FingerPrint::_recordTransfer(bool ok) {
+  _link.transfers++;
+  if (!ok) {
+    _link.errors++;
+  }
+  if (!_autoTune) {
+    return;
+  }
+
+  _windowTransfers++;
+  if (ok) {
+    if (_cleanRun < 0xFFFF) _cleanRun++;
+  } else {
+    _windowErrors++;
+    _cleanRun = 0;
+  }
+
+  if (_windowErrors >= LINK_STEP_DOWN_ERRORS && _linkLevel + 1 < LINK_LEVELS) {
+    if (_applyLinkLevel(_linkLevel + 1)) {
+      _link.stepDowns++;
+      // Back off further before retrying the faster setting that just failed
+      _stepUpAfter = min((uint16_t)(_stepUpAfter * 2), LINK_STEP_UP_MAX);
+    }
+    _windowTransfers = 0;
+    _windowErrors = 0;
+    _cleanRun = 0;
+  } else if (_cleanRun >= _stepUpAfter && _linkLevel > 0) {
+    if (_applyLinkLevel(_linkLevel - 1)) {
+      _link.stepUps++;
+    }
+    _cleanRun = 0;
+  }
+
+  if (_windowTransfers >= LINK_WINDOW) {
+    _windowTransfers = 0;
+    _windowErrors = 0;
+  }
+}
+
+// Move both ends of the link to a ladder entry. The sensor acknowledges
+// SetSysPara at the old rate and switches right after, so the host follows
+// and confirms with a password handshake before committing.
+bool FingerPrint::_applyLinkLevel(uint8_t level) {
+  const uint32_t oldBaudrate = _baudrate;
+  const uint32_t newBaudrate = LINK_LADDER[level].baudrate;
+  const uint16_t newPacketSize = LINK_LADDER[level].packetSize;
+
+  Serial.printf("Link auto-tune: %lu baud/%u bytes -> %lu baud/%u bytes\n",
+                (unsigned long)oldBaudrate, _packetSize,
+                (unsigned long)newBaudrate, newPacketSize);
+
+  if (newPacketSize != _packetSize) {
+    uint8_t p = _sensor->setPacketSize(packetSizeCode(newPacketSize));
+    if (p != FINGERPRINT_OK) {
+      Serial.printf("Packet size change failed: 0x%02X\n", p);
+      return false;
+    }
+    _packetSize = newPacketSize;
+  }
+
+  if (newBaudrate != oldBaudrate) {
+    uint8_t p = _sensor->setBaudRate(newBaudrate / 9600);
+    if (p != FINGERPRINT_OK) {
+      Serial.printf("Baud rate change failed: 0x%02X\n", p);
+      _linkLevel = linkLevelFor(_baudrate, _packetSize);  // the packet size may have changed already
+      return false;
+    }
+    delay(50);
+    _sensor->begin(newBaudrate);
+    if (!_sensor->verifyPassword()) {
+      Serial.println("Sensor silent at new rate, reverting");
+      _sensor->begin(oldBaudrate);
+      if (!_sensor->verifyPassword()) {
+        _probeBaudrate();
+      }
+      _linkLevel = linkLevelFor(_baudrate, _packetSize);
+      return false;
+    }
+    _baudrate = newBaudrate;
+  }
+
+  _linkLevel = level;
+  return true;
+}
+
+// Find the rate the sensor is currently answering at
+bool FingerPrint::_probeBaudrate() {
+  uint32_t tried = 0;
+  for (uint8_t i = 0; i < LINK_LEVELS; i++) {
+    uint32_t baudrate = LINK_LADDER[i].baudrate;
+    if (baudrate == tried) {
+      continue;
+    }
+    tried = baudrate;
+    _sensor->begin(baudrate);
+    if (_sensor->verifyPassword()) {
+      Serial.printf("Sensor answering at %lu baud\n", (unsigned long)baudrate);
+      _baudrate = baudrate;
+      return true;
+    }
+  }
+  _sensor->begin(_baudrate);
+  return false;
+}
+
+// Download CharBuffer1, repeating the UpChar transfer while the data arrives
+// damaged. The buffer stays on the sensor, so a retry costs one transfer.
+uint8_t FingerPrint::_downloadTemplate(uint8_t* buffer) {
+  uint8_t result = FINGERPRINT_TIMEOUT;
+  for (uint8_t attempt = 0; attempt < LINK_MAX_ATTEMPTS; attempt++) {
+    if (attempt > 0) {
+      _trace(FingerPrintLog::LEVEL_INFO, "Retrying template download (%d/%d)...\n", attempt + 1, LINK_MAX_ATTEMPTS);
+      _link.retries++;
+      _drainSerial();
+    }
+    result = _readRawTemplate(buffer);
+    bool ok = (result == FINGERPRINT_OK && _lastTransferClean);
+    _recordTransfer(ok);
+    if (ok) {
+      return FINGERPRINT_OK;
+    }
+  }
+  return result; // Partial data is still handed back as before
+}
+
 uint8_t FingerPrint::_readRawTemplate(uint8_t* buffer) {
-  Serial.println("Reading template using manual packet parsing...");
+  _trace(FingerPrintLog::LEVEL_DEBUG, "Reading template using manual packet parsing...\n");
+  _lastTransferClean = true;
   
   // Send UpChar command (0x08, buffer 1)
   uint8_t packet[] = {FINGERPRINT_UPLOAD, 0x01};
   
-  Serial.println("Sending UpChar command...");
+  _trace(FingerPrintLog::LEVEL_DEBUG, "Sending UpChar command...\n");
   Adafruit_Fingerprint_Packet uploadCmd(FINGERPRINT_COMMANDPACKET, sizeof(packet), packet);
   _sensor->writeStructuredPacket(uploadCmd);
   
@@ -65,16 +420,16 @@ uint8_t FingerPrint::_readRawTemplate(uint8_t* buffer) {
   
   uint8_t result = _sensor->getStructuredPacket(&ackPacket);
   if (result != FINGERPRINT_OK) {
-    Serial.printf("Failed to receive ACK: 0x%02X\n", result);
+    _trace(FingerPrintLog::LEVEL_ERROR, "Failed to receive ACK: 0x%02X\n", result);
     return result;
   }
   
   if (ackPacket.data[0] != FINGERPRINT_OK) {
-    Serial.printf("UpChar command failed: 0x%02X\n", ackPacket.data[0]);
+    _trace(FingerPrintLog::LEVEL_ERROR, "UpChar command failed: 0x%02X\n", ackPacket.data[0]);
     return ackPacket.data[0];
   }
   
-  Serial.println("UpChar acknowledged, reading data packets manually...");
+  _trace(FingerPrintLog::LEVEL_DEBUG, "UpChar acknowledged, reading data packets manually...\n");
   
   uint16_t bytesRead = 0;
   bool endReceived = false;
@@ -89,9 +444,10 @@ uint8_t FingerPrint::_readRawTemplate(uint8_t* buffer) {
     int16_t b2 = _readByte(100);
     
     if (b1 < 0 || b2 < 0) {
-      Serial.printf("Timeout reading packet header #%d\n", packetCount);
+      _trace(FingerPrintLog::LEVEL_ERROR, "Timeout reading packet header #%d\n", packetCount);
       if (bytesRead > 0) {
-        Serial.printf("Using partial data: %d bytes\n", bytesRead);
+        _trace(FingerPrintLog::LEVEL_INFO, "Using partial data: %d bytes\n", bytesRead);
+        _lastTransferClean = false;
         memset(buffer + bytesRead, 0, TEMPLATE_SIZE - bytesRead);
         return FINGERPRINT_OK;
       }
@@ -99,14 +455,14 @@ uint8_t FingerPrint::_readRawTemplate(uint8_t* buffer) {
     }
     
     if (b1 != 0xEF || b2 != 0x01) {
-      Serial.printf("Invalid packet header: %02X %02X\n", b1, b2);
+      _trace(FingerPrintLog::LEVEL_ERROR, "Invalid packet header: %02X %02X\n", b1, b2);
       return FINGERPRINT_PACKETRECIEVEERR;
     }
     
     // Read address (4 bytes) - usually 0xFFFFFFFF
     for (int i = 0; i < 4; i++) {
       if (_readByte(100) < 0) {
-        Serial.println("Timeout reading address");
+        _trace(FingerPrintLog::LEVEL_ERROR, "Timeout reading address\n");
         return FINGERPRINT_TIMEOUT;
       }
     }
@@ -114,7 +470,7 @@ uint8_t FingerPrint::_readRawTemplate(uint8_t* buffer) {
     // Read packet identifier (1 byte)
     int16_t packetType = _readByte(100);
     if (packetType < 0) {
-      Serial.println("Timeout reading packet type");
+      _trace(FingerPrintLog::LEVEL_ERROR, "Timeout reading packet type\n");
       return FINGERPRINT_TIMEOUT;
     }
     
@@ -122,76 +478,85 @@ uint8_t FingerPrint::_readRawTemplate(uint8_t* buffer) {
     int16_t len_high = _readByte(100);
     int16_t len_low = _readByte(100);
     if (len_high < 0 || len_low < 0) {
-      Serial.println("Timeout reading length");
+      _trace(FingerPrintLog::LEVEL_ERROR, "Timeout reading length\n");
       return FINGERPRINT_TIMEOUT;
     }
     
     uint16_t packetLen = (len_high << 8) | len_low;
     
-    Serial.printf("Packet #%d - Type: 0x%02X, Length: %d\n", 
-                  packetCount, packetType, packetLen);
+    _trace(FingerPrintLog::LEVEL_DEBUG, "Packet #%d - Type: 0x%02X, Length: %d\n",
+           packetCount, packetType, packetLen);
     
     if (packetType == FINGERPRINT_DATAPACKET || 
         packetType == FINGERPRINT_ENDDATAPACKET) {
       
       // Length includes checksum (2 bytes)
       uint16_t dataLen = packetLen - 2;
+      uint16_t sum = packetType + len_high + len_low;
       
       // Read data bytes
       for (uint16_t i = 0; i < dataLen && bytesRead < TEMPLATE_SIZE; i++) {
         int16_t dataByte = _readByte(100);
         if (dataByte < 0) {
-          Serial.printf("Timeout reading data byte %d\n", i);
+          _trace(FingerPrintLog::LEVEL_ERROR, "Timeout reading data byte %d\n", i);
           return FINGERPRINT_TIMEOUT;
         }
         buffer[bytesRead++] = (uint8_t)dataByte;
+        sum += dataByte;
       }
       
-      // Read checksum (2 bytes) and discard
-      _readByte(100);
-      _readByte(100);
+      // Read checksum (2 bytes) and verify
+      int16_t sum_high = _readByte(100);
+      int16_t sum_low = _readByte(100);
+      if (sum_high < 0 || sum_low < 0 || (uint16_t)((sum_high << 8) | sum_low) != sum) {
+        _trace(FingerPrintLog::LEVEL_ERROR, "Checksum mismatch on packet #%d\n", packetCount);
+        _lastTransferClean = false;
+      }
       
-      Serial.printf("Read %d bytes, total: %d/%d\n", dataLen, bytesRead, TEMPLATE_SIZE);
+      _trace(FingerPrintLog::LEVEL_DEBUG, "Read %d bytes, total: %d/%d\n", dataLen, bytesRead, TEMPLATE_SIZE);
       
       if (packetType == FINGERPRINT_ENDDATAPACKET) {
-        Serial.println("End packet received");
+        _trace(FingerPrintLog::LEVEL_DEBUG, "End packet received\n");
         endReceived = true;
       }
     } else if (packetType == FINGERPRINT_ACKPACKET) {
-      Serial.println("Received ACK packet instead of data");
+      _trace(FingerPrintLog::LEVEL_ERROR, "Received ACK packet instead of data\n");
       // Read and discard ACK data
       for (uint16_t i = 0; i < packetLen; i++) {
         _readByte(100);
       }
       return FINGERPRINT_PACKETRECIEVEERR;
     } else {
-      Serial.printf("Unexpected packet type: 0x%02X\n", packetType);
+      _trace(FingerPrintLog::LEVEL_ERROR, "Unexpected packet type: 0x%02X\n", packetType);
       return FINGERPRINT_PACKETRECIEVEERR;
     }
   }
   
   if (bytesRead < TEMPLATE_SIZE) {
-    Serial.printf("Padding %d bytes with zeros\n", TEMPLATE_SIZE - bytesRead);
+    _trace(FingerPrintLog::LEVEL_INFO, "Padding %d bytes with zeros\n", TEMPLATE_SIZE - bytesRead);
+    _lastTransferClean = false;
     memset(buffer + bytesRead, 0, TEMPLATE_SIZE - bytesRead);
   }
   
-  Serial.printf("Download complete: %d bytes\n", bytesRead);
-  
-  // Print first 32 bytes
-  Serial.print("First 32 bytes: ");
-  for(int i = 0; i < 32 && i < bytesRead; i++) {
-    if(buffer[i] < 0x10) Serial.print("0");
-    Serial.print(buffer[i], HEX);
-    if(i % 16 == 15) Serial.print("\n                ");
-    else Serial.print(" ");
+  _trace(FingerPrintLog::LEVEL_INFO, "Download complete: %d bytes\n", bytesRead);
+  
+  // First 32 bytes, passed by value since a deferred entry is formatted
+  // after the buffer has moved on
+  for (int row = 0; row < 32; row += 16) {
+    const uint8_t* b = buffer + row;
+    _trace(FingerPrintLog::LEVEL_DEBUG, "Bytes %2d-%2d: %08lX %08lX %08lX %08lX\n", row, row + 15,
+           (unsigned long)((uint32_t)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3]),
+           (unsigned long)((uint32_t)b[4] << 24 | b[5] << 16 | b[6] << 8 | b[7]),
+           (unsigned long)((uint32_t)b[8] << 24 | b[9] << 16 | b[10] << 8 | b[11]),
+           (unsigned long)((uint32_t)b[12] << 24 | b[13] << 16 | b[14] << 8 | b[15]));
   }
-  Serial.println();
   
   return FINGERPRINT_OK;
 }
 
 uint8_t FingerPrint::_getTemplateBytes(uint8_t templateBuffer[TEMPLATE_SIZE]) {
   uint8_t p = 0;
+  _settleSensor(true);
 
   Serial.println("Place finger on sensor...");
   while (_sensor->getImage() != FINGERPRINT_OK) {
@@ -216,7 +581,7 @@ uint8_t FingerPrint::_getTemplateBytes(uint8_t templateBuffer[TEMPLATE_SIZE]) {
   delay(200); // Give sensor time to prepare
 
   Serial.println("Downloading template...");
-  uint8_t result = _readRawTemplate(templateBuffer);
+  uint8_t result = _downloadTemplate(templateBuffer);
   if (result != FINGERPRINT_OK) {
     Serial.printf("Error downloading template: 0x%02X\n", result);
     while (_sensor->getImage() != FINGERPRINT_NOFINGER) {
@@ -510,12 +875,13 @@ void FingerPrint::_printHex(const uint8_t *buffer, size_t size) {
 /* } */
 
 uint8_t FingerPrint::uploadTemplateToBuffer(const uint8_t* templateData, uint8_t bufferID) {
-  Serial.printf("Uploading template to CharBuffer%d...\n", bufferID);
+  _trace(FingerPrintLog::LEVEL_DEBUG, "Uploading template to CharBuffer%d...\n", bufferID);
   
   if (!_serial) {
-    Serial.println("Error: Serial not initialized");
+    _trace(FingerPrintLog::LEVEL_ERROR, "Error: Serial not initialized\n");
     return FINGERPRINT_PACKETRECIEVEERR;
   }
+  _settleSensor(false);
   
   // Manual packet construction for DownChar command
   // Packet format: Header(2) + Address(4) + PacketID(1) + Length(2) + Data + Checksum(2)
@@ -544,7 +910,7 @@ uint8_t FingerPrint::uploadTemplateToBuffer(const uint8_t* templateData, uint8_t
   _serial->write(sum & 0xFF);
   _serial->flush();
   
-  Serial.println("Command sent, waiting for ACK...");
+  _trace(FingerPrintLog::LEVEL_DEBUG, "Command sent, waiting for ACK...\n");
   delay(100);
   
   // Read ACK
@@ -553,14 +919,15 @@ uint8_t FingerPrint::uploadTemplateToBuffer(const uint8_t* templateData, uint8_t
   uint8_t result = _sensor->getStructuredPacket(&ackPacket);
   
   if (result != FINGERPRINT_OK || ackPacket.data[0] != FINGERPRINT_OK) {
-    Serial.printf("DownChar ACK failed: 0x%02X\n", ackPacket.data[0]);
+    _trace(FingerPrintLog::LEVEL_ERROR, "DownChar ACK failed: 0x%02X\n", ackPacket.data[0]);
+    _recordTransfer(false);
     return ackPacket.data[0];
   }
   
-  Serial.println("ACK received, sending data packets...");
+  _trace(FingerPrintLog::LEVEL_DEBUG, "ACK received, sending data packets...\n");
   
-  // Send template data in packets
-  const uint16_t PACKET_SIZE = 128;
+  // Send template data in packets sized to the sensor's current setting
+  const uint16_t PACKET_SIZE = _packetSize;
   uint16_t bytesSent = 0;
   
   while (bytesSent < TEMPLATE_SIZE) {
@@ -588,55 +955,193 @@ uint8_t FingerPrint::uploadTemplateToBuffer(const uint8_t* templateData, uint8_t
     _serial->flush();
     
     bytesSent += chunkSize;
-    Serial.printf("Sent %d/%d bytes\n", bytesSent, TEMPLATE_SIZE);
+    _trace(FingerPrintLog::LEVEL_DEBUG, "Sent %d/%d bytes\n", bytesSent, TEMPLATE_SIZE);
     
     delay(20); // Small delay between packets
   }
   
-  Serial.println("All data packets sent");
+  _trace(FingerPrintLog::LEVEL_DEBUG, "All data packets sent\n");
+  _recordTransfer(true);
   return FINGERPRINT_OK;
 }
 
-// Match current fingerprint against a stored template
-uint8_t FingerPrint::matchWithTemplate(const uint8_t* storedTemplate, uint16_t* score) {
-  Serial.println("\n---- Matching Fingerprint ----");
-  
-  // Step 1: Capture current fingerprint with better guidance
+// Capture a live finger into CharBuffer1. Frames are taken back to back
+// while the finger is down: with no burst window the first frame the sensor
+// converts is used; with a window, every converted frame in it is rated on
+// the host and the best one is put back into CharBuffer1.
+// Returns 0 on success, 1 on timeout.
+uint8_t FingerPrint::_captureProbe() {
   Serial.println("Place finger firmly on sensor...");
   Serial.println("(Press down evenly, avoid sliding)");
-  
-  uint8_t p = 0;
-  uint8_t timeout = 0;
-  uint8_t imageQuality = 0;
-  
-  // Try to get a good quality image
+
+  _settleSensor(true);
+  memset(&_capture, 0, sizeof(_capture));
+  _probeHeld = false;
+  uint8_t* best = _probe;  // rated frames are downloaded anyway, so the best is kept
+  uint8_t frame[TEMPLATE_SIZE];
+  bool haveBest = false;
+  bool bestInBuffer = false;
+  uint32_t start = millis();
+  uint32_t firstFrame = 0;
+  uint32_t firstGood = 0;
+
   while (true) {
-    p = _sensor->getImage();
-    if (p == FINGERPRINT_OK) {
-      // Check image quality by attempting conversion
-      uint8_t tempResult = _sensor->image2Tz(1);
-      if (tempResult == FINGERPRINT_OK) {
-        Serial.println("✓ Good quality image captured");
-        break;
-      } else if (tempResult == FINGERPRINT_IMAGEMESS) {
-        Serial.println("Image too messy, try again...");
-        delay(500);
-        timeout++;
-      } else if (tempResult == FINGERPRINT_FEATUREFAIL) {
-        Serial.println("Could not find features, reposition finger...");
-        delay(500);
-        timeout++;
-      } else {
-        // Image converted successfully
+    uint32_t now = millis();
+    if (haveBest && now - firstGood >= _burstWindowMs) {
+      break;
+    }
+    if (now - start > CAPTURE_TIMEOUT_MS) {
+      if (haveBest) {
         break;
       }
-    }
-    
-    if (timeout++ > 200) {
       Serial.println("Timeout waiting for good fingerprint");
       return 1;
     }
-    delay(50);
+
+    uint8_t p = _sensor->getImage();
+    if (p != FINGERPRINT_OK) {
+      if (haveBest && p == FINGERPRINT_NOFINGER) {
+        break; // Finger lifted: settle for the best frame so far
+      }
+      delay(50);
+      continue;
+    }
+    if (_capture.frames++ == 0) {
+      firstFrame = now;
+    }
+
+    // Convert straight away; a messy frame is simply followed by the next one.
+    // Any conversion replaces CharBuffer1, so the best frame is no longer there.
+    p = _sensor->image2Tz(1);
+    bestInBuffer = false;
+    if (p != FINGERPRINT_OK) {
+      _capture.rejected++;
+      if (p == FINGERPRINT_IMAGEMESS) {
+        Serial.println("Image too messy, keep finger on sensor...");
+      } else if (p == FINGERPRINT_FEATUREFAIL) {
+        Serial.println("Could not find features, press a little harder...");
+      }
+      continue;
+    }
+    if (_burstWindowMs == 0 && _burstMinQuality == 0) {
+      haveBest = true;
+      bestInBuffer = true;
+      break;
+    }
+
+    uint16_t quality = _probeQuality(frame);
+    if (quality < _burstMinQuality || quality == 0) {
+      _capture.rejected++;
+      continue;
+    }
+    if (!haveBest || quality > _capture.quality) {
+      memcpy(best, frame, TEMPLATE_SIZE);
+      _capture.quality = quality;
+      bestInBuffer = true;
+      if (!haveBest) {
+        firstGood = now;
+      }
+      haveBest = true;
+    }
+    if (_burstWindowMs == 0) {
+      break; // First frame over the quality floor
+    }
+  }
+
+  // A later, worse frame overwrote CharBuffer1: restore the best one
+  if (!bestInBuffer && uploadTemplateToBuffer(best, 1) != FINGERPRINT_OK) {
+    Serial.println("Failed to restore best frame");
+    return 1;
+  }
+  _probeHeld = _capture.quality != 0;
+  _capture.elapsedMs = millis() - firstFrame;
+  Serial.printf("✓ Good quality image captured (%d frames, %d rejected, %lu ms)\n",
+                _capture.frames, _capture.rejected, (unsigned long)_capture.elapsedMs);
+  return 0;
+}
+
+// Download CharBuffer1 and rate it on the host: the sum of minutia
+// qualities, so both the number and the clarity of minutiae count.
+// Returns 0 when the download or decoding fails.
+uint16_t FingerPrint::_probeQuality(uint8_t* probe) {
+  if (_downloadTemplate(probe) != FINGERPRINT_OK) {
+    return 0;
+  }
+  FingerPrintFeatures features;
+  if (!FingerPrintMatcher::decode(probe, &features)) {
+    return 0;
+  }
+  uint16_t quality = 0;
+  for (uint8_t i = 0; i < features.count; i++) {
+    quality += features.minutiae[i].quality;
+  }
+  return quality;
+}
+
+// Host copy of the probe in CharBuffer1, downloaded at most once per capture
+uint8_t FingerPrint::_downloadProbe() {
+  if (_probeHeld) {
+    return FINGERPRINT_OK;
+  }
+  uint32_t start = micros();
+  uint8_t p = _downloadTemplate(_probe);
+  _noteCost(&_costs.downloadUs, micros() - start);
+  _probeHeld = p == FINGERPRINT_OK;
+  return p;
+}
+
+// Compare CharBuffer1 with CharBuffer2 (Match, 0x03).
+// Returns the sensor's confirmation code, or FINGERPRINT_TIMEOUT when no reply arrived.
+uint8_t FingerPrint::_matchBuffers(uint16_t* score) {
+  uint8_t matchCmd[] = {0x03};
+  Adafruit_Fingerprint_Packet matchPacket(FINGERPRINT_COMMANDPACKET, sizeof(matchCmd), matchCmd);
+  _sensor->writeStructuredPacket(matchPacket);
+
+  uint8_t matchAckData[64];
+  Adafruit_Fingerprint_Packet matchAck(FINGERPRINT_ACKPACKET, 0, matchAckData);
+  if (_sensor->getStructuredPacket(&matchAck) != FINGERPRINT_OK) {
+    return FINGERPRINT_TIMEOUT;
+  }
+  *score = ((uint16_t)matchAck.data[1] << 8) | matchAck.data[2];
+  return matchAck.data[0];
+}
+
+// Search the sensor library pages [start, start + count) for CharBuffer1
+// (Search, 0x04). Returns the sensor's confirmation code.
+uint8_t FingerPrint::_searchSlots(uint16_t start, uint16_t count, uint16_t* page, uint16_t* score) {
+  _sendSearch(start, count);
+  return _readSearchReply(page, score);
+}
+
+// The two halves of _searchSlots(), for callers that do other work while
+// the sensor searches
+void FingerPrint::_sendSearch(uint16_t start, uint16_t count) {
+  uint8_t searchCmd[] = {FINGERPRINT_SEARCH, 0x01,
+                         (uint8_t)(start >> 8), (uint8_t)(start & 0xFF),
+                         (uint8_t)(count >> 8), (uint8_t)(count & 0xFF)};
+  Adafruit_Fingerprint_Packet searchPacket(FINGERPRINT_COMMANDPACKET, sizeof(searchCmd), searchCmd);
+  _sensor->writeStructuredPacket(searchPacket);
+}
+
+uint8_t FingerPrint::_readSearchReply(uint16_t* page, uint16_t* score) {
+  uint8_t searchAckData[64];
+  Adafruit_Fingerprint_Packet searchAck(FINGERPRINT_ACKPACKET, 0, searchAckData);
+  if (_sensor->getStructuredPacket(&searchAck) != FINGERPRINT_OK) {
+    return FINGERPRINT_TIMEOUT;
+  }
+  *page = ((uint16_t)searchAck.data[1] << 8) | searchAck.data[2];
+  *score = ((uint16_t)searchAck.data[3] << 8) | searchAck.data[4];
+  return searchAck.data[0];
+}
+
+// Match current fingerprint against a stored template
+uint8_t FingerPrint::matchWithTemplate(const uint8_t* storedTemplate, uint16_t* score) {
+  Serial.println("\n---- Matching Fingerprint ----");
+  
+  // Step 1: Capture current fingerprint into CharBuffer1
+  uint8_t p = _captureProbe();
+  if (p != 0) {
+    return p;
   }
   
   Serial.println("Finger detected, converting to template...");
@@ -682,25 +1187,10 @@ uint8_t FingerPrint::matchWithTemplate(const uint8_t* storedTemplate, uint16_t*
     Serial.println("Finger removed");
     return 0; // Success
   } else if (matchResult == FINGERPRINT_ENROLLMISMATCH) {
-    // Try one more time with a fresh scan
+    // Try one more time with a fresh scan while the finger is still down
     Serial.println("First attempt failed, trying once more...");
-    
-    // Wait a moment
-    delay(500);
-    
-    // Get another image
     Serial.println("Keep finger on sensor...");
-    timeout = 0;
-    while (_sensor->getImage() != FINGERPRINT_OK) {
-      if (timeout++ > 100) {
-        Serial.println("✗ Verification failed - no match");
-        return 4;
-      }
-      delay(50);
-    }
-    
-    p = _sensor->image2Tz(1);
-    if (p != FINGERPRINT_OK) {
+    if (_captureProbe() != 0) {
       Serial.println("✗ Could not process second scan");
       return 4;
     }
@@ -741,6 +1231,7 @@ uint8_t FingerPrint::matchWithTemplate(const uint8_t* storedTemplate, uint16_t*
 // Enhanced enrollment that returns the template
 uint8_t FingerPrint::enrollAndGetTemplate(uint8_t templateOutput[TEMPLATE_SIZE]) {
   Serial.println("\n---- Enrolling New Fingerprint ----");
+  _settleSensor(true);
   
   // Get first scan
   Serial.println("Place finger on sensor (scan 1/2)...");
@@ -800,7 +1291,7 @@ uint8_t FingerPrint::enrollAndGetTemplate(uint8_t templateOutput[TEMPLATE_SIZE])
   
   // Download the created model
   Serial.println("Downloading template...");
-  p = _readRawTemplate(templateOutput);
+  p = _downloadTemplate(templateOutput);
   if (p != FINGERPRINT_OK) {
     Serial.println("Failed to download template");
     return 4;
@@ -816,3 +1307,927 @@ uint8_t FingerPrint::enrollAndGetTemplate(uint8_t templateOutput[TEMPLATE_SIZE])
   
   return 0; // Success
 }
+
+
+void FingerPrint::setAcceptScore(uint16_t score) {
+  _acceptScore = score;
+}
+
+// Per-user early accept. Accepted identifications that also clear the fixed
+// setAcceptScore() value teach the library that user's genuine score level;
+// scores accepted only under a lower per-user threshold are not learned
+// from, so it cannot drift down on its own. Once a user has ADAPT_MIN_SAMPLES scores,
+// a candidate of theirs is decisive at mean - deviations * spread, but never
+// below floorScore. Users who always score high then need a high score to
+// stop a scan early, and users who score low stop at a lower one. Until
+// then the global setAcceptScore() value applies. floorScore 0 turns it off.
+void FingerPrint::setAdaptiveAccept(uint16_t floorScore, uint8_t deviations) {
+  _adaptiveFloor = floorScore;
+  _adaptiveDeviations = deviations;
+}
+
+// Score at which a candidate of this user ends a scan, 0 for never
+uint16_t FingerPrint::acceptScoreFor(uint32_t userId) const {
+  if (!_adaptiveFloor) {
+    return _acceptScore;
+  }
+  std::vector<UserScores>::const_iterator it = std::lower_bound(
+    _userScores.begin(), _userScores.end(), userId,
+    [](const UserScores& entry, uint32_t id) { return entry.userId < id; });
+  if (it == _userScores.end() || it->userId != userId || it->samples < ADAPT_MIN_SAMPLES) {
+    return _acceptScore;
+  }
+  int32_t threshold = ((int32_t)it->mean - (int32_t)_adaptiveDeviations * it->deviation) / 16;
+  return threshold > _adaptiveFloor ? (uint16_t)threshold : _adaptiveFloor;
+}
+
+// Record a score known to be genuine. identify() and identifyMultiFinger()
+// call this for accepted matches at or above the global accept score; call
+// it yourself for matches confirmed another way (e.g. a PIN).
+void FingerPrint::noteGenuineScore(uint32_t userId, uint16_t score) {
+  std::vector<UserScores>::iterator it = std::lower_bound(
+    _userScores.begin(), _userScores.end(), userId,
+    [](const UserScores& entry, uint32_t id) { return entry.userId < id; });
+  int32_t sample = (int32_t)(score > 4000 ? 4000 : score) * 16;
+  if (it == _userScores.end() || it->userId != userId) {
+    UserScores entry = {userId, (uint16_t)sample, (uint16_t)(sample / 4), 1};
+    _userScores.insert(it, entry);
+    return;
+  }
+  // Same 1/8 EWMA as the cost model, for the level and its spread
+  int32_t error = sample - it->mean;
+  it->mean += error / 8;
+  it->deviation += ((error < 0 ? -error : error) - (int32_t)it->deviation) / 8;
+  if (it->samples < 255) {
+    it->samples++;
+  }
+}
+
+// Let identify() shortlist candidates on a host-side index before confirming
+// them on the sensor. The index must have been built from the same gallery.
+void FingerPrint::setIndex(const FingerPrintIndex* index, size_t shortlist) {
+  _index = index;
+  _shortlist = shortlist ? shortlist : 1;
+}
+
+// Let planIdentify() pick STRATEGY_RACE. A decisive host score is accepted
+// without a sensor Match, so set accept scores with the host matcher in mind.
+void FingerPrint::setRacing(bool enabled) {
+  _racing = enabled;
+}
+
+FingerPrint::RaceStats FingerPrint::getRaceStats() const {
+  return _race;
+}
+
+FingerPrint::IdentifyCosts FingerPrint::getIdentifyCosts() const {
+  return _costs;
+}
+
+// Exponential moving average, 1/8 weight on the new sample
+void FingerPrint::_noteCost(uint32_t* average, uint32_t sampleUs) {
+  int32_t delta = (int32_t)(sampleUs - *average) / 8;
+  *average += delta;
+}
+
+// Gallery records in scan order: those warmCaches() expects soon come first,
+// so an accept score can end the scan early for the likely users
+void FingerPrint::_scanOrder(const FingerPrintGallery& gallery, bool uncachedOnly,
+                             std::vector<size_t>* candidates) const {
+  std::vector<bool> listed(gallery.size(), false);
+  for (size_t w = 0; w < _warmRecords.size(); w++) {
+    size_t i = _warmRecords[w];
+    if (i < gallery.size() && !listed[i]) {
+      listed[i] = true;
+      if (!uncachedOnly || gallery.at(i).slot == FingerPrintGallery::NO_SLOT) {
+        candidates->push_back(i);
+      }
+    }
+  }
+  for (size_t i = 0; i < gallery.size(); i++) {
+    if (!listed[i] && (!uncachedOnly || gallery.at(i).slot == FingerPrintGallery::NO_SLOT)) {
+      candidates->push_back(i);
+    }
+  }
+}
+
+// Prepare for the users expected next (see FingerPrintWarmup::predict()):
+// their templates move to the front of the scan order, and as many as fit
+// are copied into the sensor library pages [firstSlot, firstSlot + slotCount)
+// so Search covers them. Pages in that range held by other records are
+// reused. Returns the number of templates newly written to the sensor.
+size_t FingerPrint::warmCaches(FingerPrintGallery& gallery, const std::vector<uint32_t>& expectedUsers,
+                               uint16_t firstSlot, uint16_t slotCount) {
+  uint32_t started = micros();
+  _warmRecords.clear();
+  for (size_t u = 0; u < expectedUsers.size(); u++) {
+    for (size_t i = 0; i < gallery.size(); i++) {
+      if (gallery.at(i).active && gallery.at(i).userId == expectedUsers[u]) {
+        _warmRecords.push_back(i);
+      }
+    }
+  }
+
+  const uint16_t lastSlot = firstSlot + slotCount;
+  std::vector<bool> wanted(gallery.size(), false);
+  std::vector<bool> slotBusy(slotCount, false);
+  size_t placed = 0;
+  for (size_t w = 0; w < _warmRecords.size() && placed < slotCount; w++, placed++) {
+    size_t i = _warmRecords[w];
+    wanted[i] = true;
+    uint16_t slot = gallery.at(i).slot;
+    if (slot >= firstSlot && slot < lastSlot) {
+      slotBusy[slot - firstSlot] = true;
+    }
+  }
+
+  size_t written = 0;
+  uint16_t nextSlot = 0;
+  for (size_t i = 0; i < gallery.size(); i++) {
+    if (!wanted[i] || gallery.at(i).slot != FingerPrintGallery::NO_SLOT) {
+      continue; // Not expected, or already on the sensor
+    }
+    while (nextSlot < slotCount && slotBusy[nextSlot]) nextSlot++;
+    if (nextSlot == slotCount) {
+      break;
+    }
+    uint16_t slot = firstSlot + nextSlot;
+    size_t previous = gallery.findBySlot(slot);
+    if (cacheInSlot(gallery, i, slot) == FINGERPRINT_OK) {
+      if (previous != FingerPrintGallery::NOT_FOUND) {
+        gallery.setSlot(previous, FingerPrintGallery::NO_SLOT);
+      }
+      written++;
+    }
+    slotBusy[nextSlot] = true;
+  }
+
+  Serial.printf("Warmup: %u templates expected, %u written to sensor\n",
+                (unsigned)_warmRecords.size(), (unsigned)written);
+  // Only the first warmup is part of startup; later ones are scheduled refreshes
+  if (_startup.stageUs[STAGE_CACHE_WARMUP] == 0) {
+    noteStartupStage(STAGE_CACHE_WARMUP, started);
+  }
+  return written;
+}
+
+// Copy a gallery template into a sensor library page so Search can cover it
+uint8_t FingerPrint::cacheInSlot(FingerPrintGallery& gallery, size_t index, uint16_t slot) {
+  if (index >= gallery.size() || !gallery.at(index).active) {
+    return FINGERPRINT_BADLOCATION;
+  }
+  uint8_t p = uploadTemplateToBuffer(gallery.at(index).data, 2);
+  if (p != FINGERPRINT_OK) {
+    return p;
+  }
+  p = _sensor->storeModel(slot, 2);
+  if (p != FINGERPRINT_OK) {
+    Serial.printf("Error storing template in slot %d: 0x%02X\n", slot, p);
+    return p;
+  }
+  gallery.setSlot(index, slot);
+  return FINGERPRINT_OK;
+}
+
+uint8_t FingerPrint::evictSlot(FingerPrintGallery& gallery, size_t index) {
+  if (index >= gallery.size() || gallery.at(index).slot == FingerPrintGallery::NO_SLOT) {
+    return FINGERPRINT_BADLOCATION;
+  }
+  _settleSensor(false);
+  uint8_t p = _sensor->deleteModel(gallery.at(index).slot);
+  if (p == FINGERPRINT_OK) {
+    gallery.setSlot(index, FingerPrintGallery::NO_SLOT);
+  }
+  return p;
+}
+
+// Upload a template to CharBuffer2 and Match it against the probe in
+// CharBuffer1, feeding both timings into the cost model. Returns the Match
+// confirmation code, FINGERPRINT_UPLOADFAIL or FINGERPRINT_TIMEOUT.
+uint8_t FingerPrint::_compareWithProbe(const uint8_t* templateData, uint16_t* score) {
+  *score = 0;
+  uint32_t start = micros();
+  uint8_t p = uploadTemplateToBuffer(templateData, 2);
+  if (p != FINGERPRINT_OK) {
+    return FINGERPRINT_UPLOADFAIL;
+  }
+  _noteCost(&_costs.uploadUs, micros() - start);
+
+  start = micros();
+  p = _matchBuffers(score);
+  if (p != FINGERPRINT_TIMEOUT) {
+    _noteCost(&_costs.matchUs, micros() - start);
+  }
+  return p;
+}
+
+// Download the probe from CharBuffer1 and ask the attached index for the
+// closest records. Records added since the index was built are appended.
+bool FingerPrint::_shortlistFromIndex(const FingerPrintGallery& gallery, size_t shortlist,
+                                      std::vector<size_t>* candidates) {
+  FingerPrintFeatures probe;
+  if (_downloadProbe() != FINGERPRINT_OK || !FingerPrintMatcher::decode(_probe, &probe)) {
+    return false;
+  }
+
+  std::vector<FingerPrintIndex::Result> results;
+  uint32_t start = micros();
+  _index->search(probe, shortlist, 1.0f, &results);
+  _noteCost(&_costs.hostSearchUs, micros() - start);
+  Serial.printf("Index shortlist: %u candidates, %u distance evaluations\n",
+                (unsigned)results.size(), (unsigned)_index->lastDistanceCount());
+  for (size_t i = 0; i < results.size(); i++) {
+    candidates->push_back(results[i].index);
+  }
+  for (size_t i = _index->coveredRecords(); i < gallery.size(); i++) {
+    candidates->push_back(i);
+  }
+  return true;
+}
+
+// State shared by the two sides of a race. best packs score << 32 | gallery
+// index so either side can raise it with one compare-and-swap; winner is
+// claimed once, by the first side to reach an accept score.
+struct RaceScan {
+  const FingerPrintGallery* gallery;
+  const std::vector<size_t>* candidates;
+  const FingerPrintPreparedProbe* probe;
+  const FingerPrint* owner;
+  std::atomic<uint64_t> best;
+  std::atomic<uint8_t> winner;
+  std::atomic<bool> done;
+  uint32_t startedUs;
+  uint32_t decidedUs;
+  uint32_t hostUs;
+  uint32_t scored;
+  size_t top[RACE_CONFIRM];      // host's best candidates, strongest first
+  uint16_t topScore[RACE_CONFIRM];
+};
+
+static void raiseBest(RaceScan* scan, uint16_t score, size_t index) {
+  uint64_t packed = ((uint64_t)score << 32) | (uint32_t)index;
+  uint64_t current = scan->best.load();
+  while ((current >> 32) < score && !scan->best.compare_exchange_weak(current, packed)) {
+  }
+}
+
+static bool claimWin(RaceScan* scan, FingerPrint::RaceWinner side) {
+  uint8_t expected = FingerPrint::RACE_NONE;
+  if (!scan->winner.compare_exchange_strong(expected, side)) {
+    return false;
+  }
+  scan->decidedUs = micros() - scan->startedUs;
+  return true;
+}
+
+// Host side: score the templates Search does not cover until one is decisive
+// or the sensor side wins
+static void raceHostScan(RaceScan* scan) {
+  uint32_t start = micros();
+  FingerPrintFeatures features;
+  for (size_t c = 0; c < scan->candidates->size(); c++) {
+    if (scan->winner.load() != FingerPrint::RACE_NONE) {
+      break;
+    }
+    size_t i = (*scan->candidates)[c];
+    const FingerPrintGallery::Record& record = scan->gallery->at(i);
+    if (!record.active || !FingerPrintMatcher::decode(record.data, &features)) {
+      continue;
+    }
+    uint16_t score = FingerPrintMatcher::compare(*scan->probe, features);
+    scan->scored++;
+
+    for (uint8_t k = 0; k < RACE_CONFIRM; k++) {
+      if (score > scan->topScore[k]) {
+        for (uint8_t m = RACE_CONFIRM - 1; m > k; m--) {
+          scan->top[m] = scan->top[m - 1];
+          scan->topScore[m] = scan->topScore[m - 1];
+        }
+        scan->top[k] = i;
+        scan->topScore[k] = score;
+        break;
+      }
+    }
+    raiseBest(scan, score, i);
+    uint16_t accept = scan->owner->acceptScoreFor(record.userId);
+    if (accept && score >= accept && claimWin(scan, FingerPrint::RACE_HOST)) {
+      break;
+    }
+  }
+  scan->hostUs = micros() - start;
+  scan->done.store(true);
+}
+
+// Download the probe, then run Search over the cached pages and a host scan
+// of the uncached records at the same time: the host side in its own task
+// while this one waits for the sensor's reply. The first decisive match ends
+// both. The sensor cannot abort a Search, so when the host wins its reply is
+// read and dropped before the next command; the decision itself does not
+// wait for it. Without a decisive match the Search hit and the host's best
+// few, confirmed with Match, compete on sensor scores. Returns false when
+// the probe is unusable on the host.
+bool FingerPrint::_raceIdentify(const FingerPrintGallery& gallery, const IdentifyPlan& plan, size_t* best,
+                                uint16_t* bestScore, uint8_t* status) {
+  memset(&_race, 0, sizeof(_race));
+  FingerPrintFeatures features;
+  uint8_t p = _downloadProbe();
+  if (p != FINGERPRINT_OK || !FingerPrintMatcher::decode(_probe, &features)) {
+    return false;
+  }
+  FingerPrintPreparedProbe prepared;
+  FingerPrintMatcher::prepareProbe(features, &prepared);
+
+  std::vector<size_t> candidates;
+  _scanOrder(gallery, true, &candidates);
+  RaceScan scan;
+  scan.gallery = &gallery;
+  scan.candidates = &candidates;
+  scan.probe = &prepared;
+  scan.owner = this;
+  scan.best.store(0);
+  scan.winner.store(RACE_NONE);
+  scan.done.store(false);
+  scan.decidedUs = 0;
+  scan.hostUs = 0;
+  scan.scored = 0;
+  for (uint8_t k = 0; k < RACE_CONFIRM; k++) {
+    scan.top[k] = FingerPrintGallery::NOT_FOUND;
+    scan.topScore[k] = 0;
+  }
+  scan.startedUs = micros();
+
+  bool threaded = false;
+#if defined(ESP_PLATFORM)
+  // Same priority as the caller, which spends the race blocked in delay()
+  TaskHandle_t handle = nullptr;
+  threaded = xTaskCreatePinnedToCore([](void* arg) {
+      raceHostScan((RaceScan*)arg);
+      vTaskDelete(nullptr);
+    }, "fp_race", RACE_TASK_STACK, &scan, uxTaskPriorityGet(nullptr), &handle, tskNO_AFFINITY) == pdPASS;
+#endif
+
+  // Sensor side
+  uint16_t page = 0;
+  uint16_t searchScore = 0;
+  bool replied = false;
+  auto noteReply = [&](uint8_t result) {
+    replied = true;
+    _race.searchUs = micros() - scan.startedUs;
+    size_t found = (result == FINGERPRINT_OK) ? gallery.findBySlot(page) : FingerPrintGallery::NOT_FOUND;
+    _costs.searchHitRate += ((found != FingerPrintGallery::NOT_FOUND ? 256 : 0) - (int)_costs.searchHitRate) / 8;
+    if (_race.searchUs > _costs.matchUs) {
+      _noteCost(&_costs.searchPerSlotUs, (_race.searchUs - _costs.matchUs) / plan.searchCount);
+    }
+    if (found != FingerPrintGallery::NOT_FOUND) {
+      Serial.printf("Search hit: slot %d, score %d\n", page, searchScore);
+      raiseBest(&scan, searchScore, found);
+      uint16_t accept = acceptScoreFor(gallery.at(found).userId);
+      if (accept && searchScore >= accept) {
+        claimWin(&scan, RACE_SENSOR);
+      }
+    } else if (result == FINGERPRINT_TIMEOUT) {
+      Serial.println("No response to Search");
+      *status = 5;
+    }
+  };
+
+  uint32_t waitStart = millis();
+  if (_serial) {
+    _sendSearch(plan.searchStart, plan.searchCount);
+    while (scan.winner.load() == RACE_NONE && !(replied && (!threaded || scan.done.load()))) {
+      if (!replied && _serial->available()) {
+        p = _readSearchReply(&page, &searchScore);
+        noteReply(p);
+      } else if (!replied && millis() - waitStart > RACE_SEARCH_TIMEOUT_MS) {
+        p = FINGERPRINT_TIMEOUT;
+        noteReply(p);
+      } else {
+        delay(1);
+      }
+    }
+  } else {
+    // No stream to poll: search blocking, the host task still runs meanwhile
+    p = _searchSlots(plan.searchStart, plan.searchCount, &page, &searchScore);
+    noteReply(p);
+  }
+
+  if (!threaded && scan.winner.load() == RACE_NONE) {
+    raceHostScan(&scan);
+  }
+  while (threaded && !scan.done.load()) {
+    delay(1);
+  }
+  if (!replied) {
+    // Host decided first: the reply is collected before the next sensor command
+    Serial.printf("Host match after %lu ms, Search left running\n", (unsigned long)(scan.decidedUs / 1000));
+    _searchPending = true;
+    _searchSentMs = waitStart;
+  }
+
+  _race.winner = (RaceWinner)scan.winner.load();
+  _race.decidedUs = scan.decidedUs;
+  _race.hostUs = scan.hostUs;
+  _race.hostScored = scan.scored;
+  if (scan.scored) {
+    _noteCost(&_costs.hostCompareUs, scan.hostUs / scan.scored);
+  }
+
+  uint64_t packed = scan.best.load();
+  if (_race.winner != RACE_NONE) {
+    *best = (size_t)(uint32_t)packed;
+    *bestScore = packed >> 32;
+    return true;
+  }
+
+  // Undecided: host scores are not the sensor's verdict, so the host's best
+  // candidates are matched on the sensor against the Search hit
+  size_t found = replied && p == FINGERPRINT_OK ? gallery.findBySlot(page) : FingerPrintGallery::NOT_FOUND;
+  if (found != FingerPrintGallery::NOT_FOUND) {
+    *best = found;
+    *bestScore = searchScore;
+  }
+  for (uint8_t k = 0; k < RACE_CONFIRM && scan.top[k] != FingerPrintGallery::NOT_FOUND; k++) {
+    uint16_t matchScore = 0;
+    p = _compareWithProbe(gallery.at(scan.top[k]).data, &matchScore);
+    _race.confirmed++;
+    if (p == FINGERPRINT_TIMEOUT) {
+      *status = 5;
+    } else if (p == FINGERPRINT_UPLOADFAIL) {
+      if (*status == 4) *status = 3;
+    } else if (p == FINGERPRINT_OK && matchScore > *bestScore) {
+      *best = scan.top[k];
+      *bestScore = matchScore;
+    }
+  }
+  return true;
+}
+
+// Pick the cheapest way to search the gallery with the costs measured so far.
+// The probe capture is common to every strategy and left out.
+FingerPrint::IdentifyPlan FingerPrint::planIdentify(const FingerPrintGallery& gallery) const {
+  const uint64_t perTemplateUs = (uint64_t)_costs.uploadUs + _costs.matchUs;
+  const size_t active = gallery.activeCount();
+
+  IdentifyPlan plan;
+  plan.strategy = STRATEGY_UPLOAD_MATCH;
+  plan.searchStart = 0;
+  plan.searchCount = 0;
+  plan.shortlist = 0;
+  plan.uploads = active;
+  plan.estimatedUs = active * perTemplateUs;
+
+  if (_index && _index->size() > 0) {
+    // Records added since the index was built still need uploading
+    size_t uncovered = 0;
+    for (size_t i = _index->coveredRecords(); i < gallery.size(); i++) {
+      if (gallery.at(i).active) uncovered++;
+    }
+    size_t shortlist = min(_shortlist, _index->size());
+    uint64_t shortlistUs = (uint64_t)_costs.downloadUs + _costs.hostSearchUs +
+                           (shortlist + uncovered) * perTemplateUs;
+    if (shortlistUs < plan.estimatedUs) {
+      plan.strategy = STRATEGY_INDEX_SHORTLIST;
+      plan.shortlist = shortlist;
+      plan.uploads = shortlist + uncovered;
+      plan.estimatedUs = shortlistUs;
+    }
+  }
+
+  uint16_t first = 0;
+  uint16_t last = 0;
+  if (!gallery.slotRange(&first, &last)) {
+    return plan;
+  }
+
+  const uint16_t count = last - first + 1;
+  const size_t uncached = active - gallery.cachedCount();
+  uint64_t searchUs = _costs.matchUs + (uint64_t)count * _costs.searchPerSlotUs;
+  uint64_t restUs = uncached * perTemplateUs;
+  if (_acceptScore || _adaptiveFloor) {
+    // A decisive search hit skips the uploads entirely
+    restUs = restUs * (256 - _costs.searchHitRate) / 256;
+  }
+
+  if (searchUs + restUs < plan.estimatedUs) {
+    plan.strategy = STRATEGY_SENSOR_SEARCH;
+    plan.searchStart = first;
+    plan.searchCount = count;
+    plan.shortlist = 0;
+    plan.uploads = uncached;
+    plan.estimatedUs = searchUs + restUs;
+  }
+
+  if (_racing && uncached > 0) {
+    // Search and the host scan overlap; only an undecided race confirms
+    uint64_t hostUs = (uint64_t)uncached * _costs.hostCompareUs;
+    uint64_t confirmUs = RACE_CONFIRM * perTemplateUs;
+    if (_acceptScore || _adaptiveFloor) {
+      confirmUs = confirmUs * (256 - _costs.searchHitRate) / 256;
+    }
+    uint64_t raceUs = _costs.downloadUs + max(searchUs, hostUs) + confirmUs;
+    if (raceUs < plan.estimatedUs) {
+      plan.strategy = STRATEGY_RACE;
+      plan.searchStart = first;
+      plan.searchCount = count;
+      plan.shortlist = 0;
+      plan.uploads = RACE_CONFIRM;
+      plan.estimatedUs = raceUs;
+    }
+  }
+  return plan;
+}
+
+// Identify a live finger against a whole gallery (1:N). The probe is captured
+// once and the gallery searched with the strategy planIdentify() picks.
+uint8_t FingerPrint::identify(const FingerPrintGallery& gallery, size_t* matchIndex, uint16_t* score) {
+  Serial.println("\n---- Identifying Fingerprint ----");
+  *matchIndex = FingerPrintGallery::NOT_FOUND;
+  *score = 0;
+
+  if (gallery.activeCount() == 0) {
+    Serial.println("Gallery is empty");
+    return 4;
+  }
+
+  uint8_t p = _captureProbe();
+  if (p != 0) {
+    return p;
+  }
+
+  IdentifyPlan plan = planIdentify(gallery);
+  static const char* const strategyNames[] = {"upload/match", "sensor search", "index shortlist", "race"};
+  Serial.printf("Plan: %s, %u uploads, ~%lu ms\n", strategyNames[plan.strategy],
+                (unsigned)plan.uploads, (unsigned long)(plan.estimatedUs / 1000));
+
+  size_t best = FingerPrintGallery::NOT_FOUND;
+  uint16_t bestScore = 0;
+  uint8_t status = 4;
+  std::vector<size_t> candidates;
+
+  if (plan.strategy == STRATEGY_INDEX_SHORTLIST && !_shortlistFromIndex(gallery, plan.shortlist, &candidates)) {
+    Serial.println("Probe unusable on the host, falling back to upload/match");
+    plan.strategy = STRATEGY_UPLOAD_MATCH;
+  }
+  if (plan.strategy == STRATEGY_RACE && !_raceIdentify(gallery, plan, &best, &bestScore, &status)) {
+    Serial.println("Probe unusable on the host, falling back to sensor search");
+    plan.strategy = STRATEGY_SENSOR_SEARCH;
+  }
+
+  if (plan.strategy == STRATEGY_SENSOR_SEARCH) {
+    uint16_t page = 0;
+    uint16_t searchScore = 0;
+    uint32_t start = micros();
+    p = _searchSlots(plan.searchStart, plan.searchCount, &page, &searchScore);
+    uint32_t elapsed = micros() - start;
+    if (elapsed > _costs.matchUs) {
+      _noteCost(&_costs.searchPerSlotUs, (elapsed - _costs.matchUs) / plan.searchCount);
+    }
+
+    size_t found = (p == FINGERPRINT_OK) ? gallery.findBySlot(page) : FingerPrintGallery::NOT_FOUND;
+    _costs.searchHitRate += ((found != FingerPrintGallery::NOT_FOUND ? 256 : 0) - (int)_costs.searchHitRate) / 8;
+    if (found != FingerPrintGallery::NOT_FOUND) {
+      Serial.printf("Search hit: slot %d, score %d\n", page, searchScore);
+      best = found;
+      bestScore = searchScore;
+    } else if (p == FINGERPRINT_TIMEOUT) {
+      Serial.println("No response to Search");
+      status = 5;
+    }
+
+    uint16_t accept = best != FingerPrintGallery::NOT_FOUND ? acceptScoreFor(gallery.at(best).userId) : 0;
+    if (!(accept && bestScore >= accept)) {
+      _scanOrder(gallery, true, &candidates); // What Search did not cover
+    }
+  } else if (plan.strategy == STRATEGY_UPLOAD_MATCH) {
+    _scanOrder(gallery, false, &candidates);
+  }
+
+  for (size_t c = 0; c < candidates.size(); c++) {
+    size_t i = candidates[c];
+    const FingerPrintGallery::Record& record = gallery.at(i);
+    if (!record.active) {
+      continue;
+    }
+
+    uint16_t matchScore = 0;
+    p = _compareWithProbe(record.data, &matchScore);
+    if (p == FINGERPRINT_TIMEOUT) {
+      status = 5;
+      continue;
+    } else if (p == FINGERPRINT_UPLOADFAIL) {
+      Serial.printf("Skipping template %u, upload failed\n", (unsigned)i);
+      if (status == 4) status = 3;
+      continue;
+    }
+
+    if (p == FINGERPRINT_OK && matchScore > bestScore) {
+      best = i;
+      bestScore = matchScore;
+      uint16_t accept = acceptScoreFor(record.userId);
+      if (accept && matchScore >= accept) {
+        break; // Decisive, no need to look further
+      }
+    }
+  }
+
+  if (_searchPending) {
+    _liftPending = true; // Sensor still busy: the lift is awaited before the next capture
+  } else {
+    while (_sensor->getImage() != FINGERPRINT_NOFINGER) {
+      delay(100);
+    }
+    Serial.println("Finger removed");
+  }
+
+  if (best == FingerPrintGallery::NOT_FOUND) {
+    Serial.println("✗ No match in gallery");
+    return status;
+  }
+  *matchIndex = best;
+  *score = bestScore;
+  if (_adaptiveFloor && _acceptScore && bestScore >= _acceptScore) {
+    noteGenuineScore(gallery.at(best).userId, bestScore);
+  }
+  Serial.printf("✓ Identified user %lu (template %u), confidence: %d\n",
+                (unsigned long)gallery.at(best).userId, (unsigned)best, bestScore);
+  return 0;
+}
+
+// Site or global matcher asked by identifyTiered() when the local gallery
+// has no conclusive answer
+void FingerPrint::setRemoteMatcher(FingerPrintRemote* remote) {
+  _remote = remote;
+}
+
+// Identify against the local gallery first. When that is not conclusive (no
+// match, or a best below its user's accept score) the probe goes to the
+// remote matcher and code 6 is returned at once with a ticket, along with
+// the tentative local match if there was one, so the reader can give
+// feedback while the remote searches. pollRemote() delivers its answer.
+uint8_t FingerPrint::identifyTiered(FingerPrintGallery& gallery, size_t* matchIndex, uint16_t* score,
+                                    uint32_t* ticket) {
+  *ticket = 0;
+  if (!_remote) {
+    return identify(gallery, matchIndex, score);
+  }
+
+  uint8_t p = 4;
+  if (gallery.activeCount() > 0) {
+    p = identify(gallery, matchIndex, score);
+  } else {
+    // Nothing held locally yet: capture for the remote matcher alone
+    Serial.println("\n---- Identifying Fingerprint ----");
+    *matchIndex = FingerPrintGallery::NOT_FOUND;
+    *score = 0;
+    if (_captureProbe() != 0) {
+      return 1;
+    }
+    while (_sensor->getImage() != FINGERPRINT_NOFINGER) {
+      delay(100);
+    }
+    Serial.println("Finger removed");
+  }
+
+  if (p == 1) {
+    return p; // No usable probe
+  }
+  if (p == 0) {
+    uint16_t accept = acceptScoreFor(gallery.at(*matchIndex).userId);
+    if (!accept || *score >= accept) {
+      return p;
+    }
+  }
+  // CharBuffer1 still holds the probe; only Match and Search used CharBuffer2
+  if (_downloadProbe() != FINGERPRINT_OK) {
+    Serial.println("Probe download failed, remote matcher not asked");
+    return p;
+  }
+  *ticket = _remote->submit(_probe);
+  if (*ticket == 0) {
+    Serial.println("Remote matcher busy or stopped");
+    return p;
+  }
+  Serial.printf("%s, asking the remote matcher (ticket %lu)\n",
+                p == 0 ? "Local match not decisive" : "No local match", (unsigned long)*ticket);
+  return 6;
+}
+
+// Deliver the next answer of the remote matcher, oldest first. A remote
+// match is added to the gallery, once per user, finger and template, so
+// that user is found locally next time. Returns 0 with the record's local index, 4 when the
+// remote knows no one, 5 when it could not be reached and 6 while no answer
+// is ready. Remote scores are host matcher scores, not sensor scores.
+uint8_t FingerPrint::pollRemote(FingerPrintGallery& gallery, uint32_t* ticket, size_t* matchIndex, uint16_t* score) {
+  *ticket = 0;
+  *matchIndex = FingerPrintGallery::NOT_FOUND;
+  *score = 0;
+  FingerPrintRemoteResult result;
+  if (!_remote || !_remote->poll(&result)) {
+    return 6;
+  }
+
+  *ticket = result.ticket;
+  if (result.status == FingerPrintRemoteResult::UNREACHABLE) {
+    Serial.printf("Remote matcher unreachable (ticket %lu)\n", (unsigned long)result.ticket);
+    return 5;
+  }
+  if (result.status == FingerPrintRemoteResult::NOT_FOUND) {
+    Serial.printf("✗ No remote match (ticket %lu, %lu ms)\n", (unsigned long)result.ticket,
+                  (unsigned long)result.elapsedMs);
+    return 4;
+  }
+
+  bool added = false;
+  *matchIndex = gallery.import(result.userId, result.finger, result.templateData, &added);
+  *score = result.score;
+  Serial.printf("✓ Remote match: user %lu, confidence %d (ticket %lu, %lu ms)%s\n", (unsigned long)result.userId,
+                result.score, (unsigned long)result.ticket, (unsigned long)result.elapsedMs,
+                added ? ", cached locally" : "");
+  return 0;
+}
+
+// First- and second-finger evidence for one user during identifyMultiFinger()
+struct FingerEvidence {
+  uint32_t userId;
+  size_t record;      // template that gave the first-finger score
+  uint16_t first;
+  uint16_t second;
+};
+
+static bool strongerFirst(const FingerEvidence& a, const FingerEvidence& b) {
+  return a.first > b.first;
+}
+
+// Users whose first-finger scores are within this margin of the best are
+// considered too close to call
+void FingerPrint::setAmbiguityMargin(uint16_t margin) {
+  _ambiguityMargin = margin;
+}
+
+// Identify with up to two fingers. The first finger is scored against the
+// gallery; when the best users are too close to call, or the best is below
+// the accept score, a second finger is requested and compared only against
+// the other enrolled fingers of the users still in the running. A second
+// finger counts only at or above that user's accept score, and the reported
+// score is the weaker of the two fingers. Without second fingers enrolled, 7
+// is returned for users too close to call and 4 for a single user below the
+// accept score, with that user in *userId as a tentative answer.
+uint8_t FingerPrint::identifyMultiFinger(const FingerPrintGallery& gallery, uint32_t* userId, uint16_t* score) {
+  Serial.println("\n---- Multi-Finger Identification ----");
+  *userId = 0;
+  *score = 0;
+
+  if (gallery.activeCount() == 0) {
+    Serial.println("Gallery is empty");
+    return 4;
+  }
+
+  Serial.println("First finger:");
+  uint8_t p = _captureProbe();
+  if (p != 0) {
+    return p;
+  }
+
+  IdentifyPlan plan = planIdentify(gallery);
+  std::vector<size_t> candidates;
+  if (plan.strategy != STRATEGY_INDEX_SHORTLIST || !_shortlistFromIndex(gallery, plan.shortlist, &candidates)) {
+    candidates.clear();
+    _scanOrder(gallery, false, &candidates);
+  }
+
+  uint8_t status = 4;
+  std::vector<FingerEvidence> users;
+  for (size_t c = 0; c < candidates.size(); c++) {
+    const FingerPrintGallery::Record& record = gallery.at(candidates[c]);
+    if (!record.active) {
+      continue;
+    }
+    uint16_t matchScore = 0;
+    p = _compareWithProbe(record.data, &matchScore);
+    if (p == FINGERPRINT_TIMEOUT) {
+      status = 5;
+    } else if (p == FINGERPRINT_UPLOADFAIL) {
+      if (status == 4) status = 3;
+    } else if (p == FINGERPRINT_OK) {
+      size_t u = 0;
+      while (u < users.size() && users[u].userId != record.userId) u++;
+      if (u == users.size()) {
+        FingerEvidence evidence = {record.userId, candidates[c], 0, 0};
+        users.push_back(evidence);
+      }
+      if (matchScore > users[u].first) {
+        users[u].first = matchScore;
+        users[u].record = candidates[c];
+      }
+    }
+  }
+
+  while (_sensor->getImage() != FINGERPRINT_NOFINGER) {
+    delay(100);
+  }
+  Serial.println("Finger removed");
+
+  if (users.empty()) {
+    Serial.println("✗ No match in gallery");
+    return status;
+  }
+
+  std::sort(users.begin(), users.end(), strongerFirst);
+  const uint16_t top = users[0].first;
+  size_t contenders = 1;
+  while (contenders < users.size() && users[contenders].first + _ambiguityMargin > top) {
+    contenders++;
+  }
+
+  uint16_t accept = contenders == 1 ? acceptScoreFor(users[0].userId) : 0;
+  if (contenders == 1 && !(accept && top < accept)) {
+    *userId = users[0].userId;
+    *score = top;
+    if (_adaptiveFloor && _acceptScore && top >= _acceptScore) {
+      noteGenuineScore(users[0].userId, top);
+    }
+    Serial.printf("✓ Identified user %lu, confidence: %d\n", (unsigned long)*userId, top);
+    return 0;
+  }
+
+  // A second finger only helps if some contender has another one enrolled
+  bool secondEnrolled = false;
+  for (size_t i = 0; i < gallery.size() && !secondEnrolled; i++) {
+    const FingerPrintGallery::Record& record = gallery.at(i);
+    for (size_t u = 0; record.active && u < contenders; u++) {
+      if (record.userId == users[u].userId && record.finger != gallery.at(users[u].record).finger) {
+        secondEnrolled = true;
+        break;
+      }
+    }
+  }
+  if (!secondEnrolled) {
+    *userId = users[0].userId;
+    *score = top;
+    if (contenders > 1) {
+      Serial.printf("✗ %u candidate users too close to call, none has a second finger enrolled\n",
+                    (unsigned)contenders);
+      return 7;
+    }
+    Serial.printf("✗ Best match user %lu, confidence %d, below the accept score %d, no second finger enrolled\n",
+                  (unsigned long)*userId, top, accept);
+    return 4;
+  }
+
+  Serial.printf("%u candidate users too close to call, second finger needed\n", (unsigned)contenders);
+  Serial.println("Place a different finger on the sensor...");
+  delay(1000);
+  p = _captureProbe();
+  if (p != 0) {
+    return p;
+  }
+
+  for (size_t i = 0; i < gallery.size(); i++) {
+    const FingerPrintGallery::Record& record = gallery.at(i);
+    if (!record.active) {
+      continue;
+    }
+    for (size_t u = 0; u < contenders; u++) {
+      if (record.userId != users[u].userId || record.finger == gallery.at(users[u].record).finger) {
+        continue;
+      }
+      uint16_t matchScore = 0;
+      if (_compareWithProbe(record.data, &matchScore) == FINGERPRINT_OK && matchScore > users[u].second) {
+        users[u].second = matchScore;
+      }
+      break;
+    }
+  }
+
+  while (_sensor->getImage() != FINGERPRINT_NOFINGER) {
+    delay(100);
+  }
+  Serial.println("Finger removed");
+
+  // Both fingers must agree, so a user is only as strong as their weaker one
+  size_t best = contenders;
+  uint16_t bestFused = 0;
+  for (size_t u = 0; u < contenders; u++) {
+    if (users[u].second == 0 || users[u].second < acceptScoreFor(users[u].userId)) {
+      continue;
+    }
+    uint16_t fused = users[u].first < users[u].second ? users[u].first : users[u].second;
+    if (best == contenders || fused > bestFused) {
+      bestFused = fused;
+      best = u;
+    }
+  }
+  if (best == contenders) {
+    Serial.println("✗ Second finger matched none of the candidates at the accept score");
+    return 4;
+  }
+
+  *userId = users[best].userId;
+  *score = bestFused;
+  if (_adaptiveFloor && _acceptScore && users[best].first >= _acceptScore) {
+    noteGenuineScore(users[best].userId, users[best].first);
+  }
+  Serial.printf("✓ Identified user %lu, confidence: %d + %d\n",
+                (unsigned long)*userId, users[best].first, users[best].second);
+  return 0;
+}
@@ -5,12 +5,102 @@
 #include <cstddef>
 #include <cstdint>
 #include <mbedtls/sha256.h>
+#include <vector>
+#include "FingerPrintGallery.h"
+#include "FingerPrintLog.h"
+
+class FingerPrintIndex;
+class FingerPrintRemote;
 
 // create a fingerprint object
 class FingerPrint {
   public:
     static const uint16_t HASH_SIZE = 32; // SHA-256 hash size in bytes
     static const uint16_t TEMPLATE_SIZE = 512;
+
+    // Transfer health of the sensor UART link, updated on every template transfer
+    struct LinkStats {
+      uint32_t transfers;  // template uploads/downloads attempted
+      uint32_t errors;     // timeouts, bad headers, checksum mismatches, short reads
+      uint32_t retries;    // downloads repeated after an error
+      uint32_t stepDowns;  // times auto-tune moved to a slower setting
+      uint32_t stepUps;    // times auto-tune moved to a faster setting
+      uint32_t baudrate;   // current link speed
+      uint16_t packetSize; // current data packet payload size
+    };
+
+    // Stages from power-on to ready-to-scan, in the order they normally run
+    enum StartupStage : uint8_t {
+      STAGE_BOOT = 0,            // power-on until begin() is called
+      STAGE_BEGIN = 1,           // UART set-up in begin()
+      STAGE_VERIFY_PASSWORD = 2, // first handshake in init()
+      STAGE_BAUD_PROBE = 3,      // auto-tune search for the sensor's rate
+      STAGE_GET_PARAMETERS = 4,
+      STAGE_TEMPLATE_COUNT = 5,
+      STAGE_GALLERY_LOAD = 6,    // reported by the application
+      STAGE_CACHE_WARMUP = 7,    // warmCaches()
+      STAGE_COUNT = 8,
+    };
+
+    struct StartupReport {
+      uint32_t stageUs[STAGE_COUNT];  // 0 for stages that did not run
+      uint32_t readyUs;               // micros() when the last stage ended
+    };
+
+    // Outcome of the last live capture
+    struct CaptureStats {
+      uint16_t frames;     // images taken while the finger was down
+      uint16_t rejected;   // frames the sensor could not convert
+      uint16_t quality;    // host quality of the chosen frame, 0 when not measured
+      uint32_t elapsedMs;  // from the first frame to a usable probe
+    };
+
+    // How identify() searches the gallery
+    enum IdentifyStrategy : uint8_t {
+      STRATEGY_UPLOAD_MATCH = 0,   // upload each template to CharBuffer2 and Match
+      STRATEGY_SENSOR_SEARCH = 1,  // Search the cached slot range, then upload the rest
+      STRATEGY_INDEX_SHORTLIST = 2, // download the probe, shortlist on the host index, confirm on the sensor
+      STRATEGY_RACE = 3,           // Search the cached pages while the host scores the rest, first decisive match wins
+    };
+
+    // Per-operation costs measured on this sensor and link, in microseconds
+    struct IdentifyCosts {
+      uint32_t uploadUs;        // one template into CharBuffer2
+      uint32_t matchUs;         // one Match round trip
+      uint32_t searchPerSlotUs; // Search time per library page scanned
+      uint32_t downloadUs;      // probe out of CharBuffer1
+      uint32_t hostSearchUs;    // one index search on the host
+      uint32_t hostCompareUs;   // one template scored by the host matcher
+      uint16_t searchHitRate;   // share of searches that found the user, 0-256
+    };
+
+    // Strategy and parameters chosen for one identify() call
+    struct IdentifyPlan {
+      IdentifyStrategy strategy;
+      uint16_t searchStart;     // first library page searched
+      uint16_t searchCount;     // pages searched, 0 when not searching
+      size_t shortlist;         // index candidates confirmed on the sensor
+      size_t uploads;           // templates uploaded one by one
+      uint64_t estimatedUs;
+    };
+
+    // Which side of a STRATEGY_RACE identify() settled it
+    enum RaceWinner : uint8_t {
+      RACE_NONE = 0,    // no decisive match; the best was confirmed on the sensor
+      RACE_SENSOR = 1,  // decisive Search hit
+      RACE_HOST = 2,    // decisive host score
+    };
+
+    // Outcome of the last STRATEGY_RACE identify()
+    struct RaceStats {
+      RaceWinner winner;
+      uint32_t decidedUs;    // from sending Search to the decision
+      uint32_t searchUs;     // Search round trip, 0 when abandoned
+      uint32_t hostUs;       // host scan, cancelled or complete
+      uint32_t hostScored;   // templates the host scored
+      uint16_t confirmed;    // host candidates confirmed on the sensor afterwards
+    };
+
     FingerPrint(Adafruit_Fingerprint* sensor);
     void begin(uint32_t baudrate = 57600);
     void setSerial(Stream* serial);  // ADD THIS LINE
@@ -21,12 +111,101 @@ class FingerPrint {
 	uint8_t enrollAndGetTemplate(uint8_t templateOutput[TEMPLATE_SIZE]);
     uint8_t uploadTemplateToBuffer(const uint8_t* templateData, uint8_t bufferID);
     uint8_t matchWithTemplate(const uint8_t* storedTemplate, uint16_t* score);
+
+    void setAutoTune(bool enabled);
+    void setLog(FingerPrintLog* log);  // nullptr (default): print transfer detail directly
+    LinkStats getLinkStats() const;
+    StartupReport getStartupReport() const;
+    void noteStartupStage(StartupStage stage, uint32_t startedUs);
+    void printStartupReport() const;
+    void setBurstCapture(uint16_t windowMs, uint16_t minQuality = 0);
+    CaptureStats getCaptureStats() const;
+
+    uint8_t identify(const FingerPrintGallery& gallery, size_t* matchIndex, uint16_t* score);
+    IdentifyPlan planIdentify(const FingerPrintGallery& gallery) const;
+    IdentifyCosts getIdentifyCosts() const;
+    void setAcceptScore(uint16_t score);
+    void setAdaptiveAccept(uint16_t floorScore, uint8_t deviations = 2);
+    uint16_t acceptScoreFor(uint32_t userId) const;
+    void noteGenuineScore(uint32_t userId, uint16_t score);
+    void setIndex(const FingerPrintIndex* index, size_t shortlist = 8);
+    void setRacing(bool enabled);
+    RaceStats getRaceStats() const;
+    uint8_t identifyMultiFinger(const FingerPrintGallery& gallery, uint32_t* userId, uint16_t* score);
+    void setAmbiguityMargin(uint16_t margin);
+    void setRemoteMatcher(FingerPrintRemote* remote);  // nullptr (default): local gallery only
+    uint8_t identifyTiered(FingerPrintGallery& gallery, size_t* matchIndex, uint16_t* score, uint32_t* ticket);
+    uint8_t pollRemote(FingerPrintGallery& gallery, uint32_t* ticket, size_t* matchIndex, uint16_t* score);
+    size_t warmCaches(FingerPrintGallery& gallery, const std::vector<uint32_t>& expectedUsers,
+                      uint16_t firstSlot, uint16_t slotCount);
+    uint8_t cacheInSlot(FingerPrintGallery& gallery, size_t index, uint16_t slot);
+    uint8_t evictSlot(FingerPrintGallery& gallery, size_t index);
   private:
     Adafruit_Fingerprint* _sensor;
     Stream* _serial;  // ADD THIS LINE
+    uint32_t _baudrate;
+    uint16_t _packetSize;
+    bool _autoTune;
+    bool _lastTransferClean;
+    uint8_t _linkLevel;
+    uint8_t _windowTransfers;
+    uint8_t _windowErrors;
+    uint16_t _cleanRun;
+    uint16_t _stepUpAfter;
+    LinkStats _link;
+    IdentifyCosts _costs;
+    uint16_t _acceptScore;
+    // Genuine-score history of one user, in 1/16 score units
+    struct UserScores {
+      uint32_t userId;
+      uint16_t mean;
+      uint16_t deviation;   // mean absolute deviation
+      uint8_t samples;      // saturates at 255
+    };
+    std::vector<UserScores> _userScores;  // sorted by userId
+    uint16_t _adaptiveFloor;
+    uint8_t _adaptiveDeviations;
+    const FingerPrintIndex* _index;
+    size_t _shortlist;
+    uint16_t _ambiguityMargin;
+    std::vector<size_t> _warmRecords;
+    uint16_t _burstWindowMs;
+    uint16_t _burstMinQuality;
+    CaptureStats _capture;
+    bool _racing;
+    RaceStats _race;
+    bool _searchPending;     // a host-won race left the Search reply unread
+    uint32_t _searchSentMs;
+    bool _liftPending;       // ... and did not wait for the finger to lift
+    FingerPrintRemote* _remote;
+    uint8_t _probe[TEMPLATE_SIZE];  // host copy of CharBuffer1 once downloaded
+    bool _probeHeld;                // _probe matches the current capture
+    StartupReport _startup;
+    FingerPrintLog* _log;
     uint8_t _getTemplateBytes(uint8_t templateBuffer[TEMPLATE_SIZE]);
     uint8_t _readRawTemplate(uint8_t* buffer);
+    uint8_t _downloadTemplate(uint8_t* buffer);
+    void _drainSerial();
+    void _settleSensor(bool capture);
+    template <typename... Args>
+    void _trace(FingerPrintLog::Level level, const char* format, Args... args);
+    void _recordTransfer(bool ok);
+    bool _applyLinkLevel(uint8_t level);
+    bool _probeBaudrate();
     int16_t _readByte(uint32_t timeout_ms);
+    uint8_t _captureProbe();
+    uint8_t _downloadProbe();
+    uint16_t _probeQuality(uint8_t* probe);
+    uint8_t _matchBuffers(uint16_t* score);
+    uint8_t _searchSlots(uint16_t start, uint16_t count, uint16_t* page, uint16_t* score);
+    void _sendSearch(uint16_t start, uint16_t count);
+    uint8_t _readSearchReply(uint16_t* page, uint16_t* score);
+    uint8_t _compareWithProbe(const uint8_t* templateData, uint16_t* score);
+    bool _shortlistFromIndex(const FingerPrintGallery& gallery, size_t shortlist, std::vector<size_t>* candidates);
+    bool _raceIdentify(const FingerPrintGallery& gallery, const IdentifyPlan& plan, size_t* best,
+                       uint16_t* bestScore, uint8_t* status);
+    void _scanOrder(const FingerPrintGallery& gallery, bool uncachedOnly, std::vector<size_t>* candidates) const;
+    void _noteCost(uint32_t* average, uint32_t sampleUs);
     void _printHex(const uint8_t* buffer, size_t size);
 };
 #endif // FINGERPRINT_H
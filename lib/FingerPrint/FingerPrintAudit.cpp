@@ -0,0 +1,446 @@
+#include "FingerPrintAudit.h"
+
+#if defined(__linux__)
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+
+static const uint16_t DEFAULT_THRESHOLD = 60;  // impostor pairs stay well below
+static const size_t DEFAULT_SHORTLIST = 32;
+
+// Blocking keys: a minutia with two of its nearest neighbours, as the two
+// distances, the directions to both neighbours and both neighbours' ridge
+// angles, all relative to the centre minutia, plus the three types. Packed
+// exactly into 31 bits. Stored records use the bins the values fall in;
+// probes also try the nearer neighbouring bin of the first few values, so
+// jitter across a bin edge does not lose the structure.
+static const uint8_t KEY_NEIGHBOURS = 4;
+static const float KEY_DISTANCE_STEP = 10.0f;  // pixels
+static const uint8_t KEY_DISTANCE_BINS = 64;
+static const uint8_t KEY_ANGLE_STEP = 16;      // angle units, 16 bins per turn
+static const uint8_t KEY_PROBED_VALUES = 4;    // 16 probe keys per structure
+static const uint8_t MIN_SHARED_KEYS = 2;
+static const float TWO_PI = 6.28318530718f;
+
+static int64_t nowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool strongerPair(const FingerPrintAudit::Pair& a, const FingerPrintAudit::Pair& b) {
+  if (a.score != b.score) {
+    return a.score > b.score;
+  }
+  return a.first != b.first ? a.first < b.first : a.second < b.second;
+}
+
+static void blockingKeys(const FingerPrintFeatures& f, bool probe, std::vector<uint32_t>* keys) {
+  keys->clear();
+  for (uint8_t i = 0; i < f.count; i++) {
+    const FingerPrintMinutia& m = f.minutiae[i];
+    // Nearest neighbours by insertion into a short sorted list
+    uint8_t near[KEY_NEIGHBOURS];
+    float nearDistance[KEY_NEIGHBOURS];
+    uint8_t found = 0;
+    for (uint8_t j = 0; j < f.count; j++) {
+      if (j == i) {
+        continue;
+      }
+      float d = hypotf((float)f.minutiae[j].x - m.x, (float)f.minutiae[j].y - m.y);
+      uint8_t at = found < KEY_NEIGHBOURS ? found++ : KEY_NEIGHBOURS;
+      while (at > 0 && nearDistance[at - 1] > d) {
+        if (at < KEY_NEIGHBOURS) {
+          near[at] = near[at - 1];
+          nearDistance[at] = nearDistance[at - 1];
+        }
+        at--;
+      }
+      if (at < KEY_NEIGHBOURS) {
+        near[at] = j;
+        nearDistance[at] = d;
+      }
+    }
+
+    for (uint8_t p = 0; p < found; p++) {
+      for (uint8_t q = p + 1; q < found; q++) {
+        const FingerPrintMinutia& a = f.minutiae[near[p]];
+        const FingerPrintMinutia& b = f.minutiae[near[q]];
+        float value[6];
+        value[0] = nearDistance[p] / KEY_DISTANCE_STEP;
+        value[1] = nearDistance[q] / KEY_DISTANCE_STEP;
+        value[2] = atan2f((float)a.y - m.y, (float)a.x - m.x) * 256.0f / TWO_PI - m.angle;
+        value[3] = atan2f((float)b.y - m.y, (float)b.x - m.x) * 256.0f / TWO_PI - m.angle;
+        value[4] = (uint8_t)(a.angle - m.angle);
+        value[5] = (uint8_t)(b.angle - m.angle);
+
+        int bin[6];
+        int other[6];
+        for (uint8_t v = 0; v < 6; v++) {
+          float x = v < 2 ? value[v] : value[v] / KEY_ANGLE_STEP;
+          bin[v] = (int)floorf(x);
+          other[v] = x - bin[v] < 0.5f ? bin[v] - 1 : bin[v] + 1;
+          if (v < 2) {
+            bin[v] = bin[v] < KEY_DISTANCE_BINS ? bin[v] : KEY_DISTANCE_BINS - 1;
+            other[v] = other[v] < 0 ? 0 : (other[v] < KEY_DISTANCE_BINS ? other[v] : KEY_DISTANCE_BINS - 1);
+          } else {
+            bin[v] &= 256 / KEY_ANGLE_STEP - 1;
+            other[v] &= 256 / KEY_ANGLE_STEP - 1;
+          }
+        }
+
+        const uint32_t variants = probe ? 1u << KEY_PROBED_VALUES : 1;
+        for (uint32_t variant = 0; variant < variants; variant++) {
+          uint32_t key = (m.type - 1) << 2 | (a.type - 1) << 1 | (b.type - 1);
+          for (uint8_t v = 0; v < 6; v++) {
+            int chosen = v < KEY_PROBED_VALUES && (variant >> v & 1) ? other[v] : bin[v];
+            key = v < 2 ? key << 6 | chosen : key << 4 | chosen;
+          }
+          keys->push_back(key);
+        }
+      }
+    }
+  }
+  std::sort(keys->begin(), keys->end());
+  keys->erase(std::unique(keys->begin(), keys->end()), keys->end());
+}
+
+// Spread the packed keys over the buckets; the bits left over tag the
+// posting so most foreign keys sharing a bucket are told apart
+static uint32_t mixKey(uint32_t key) {
+  key ^= key >> 16;
+  key *= 0x7FEB352D;
+  key ^= key >> 15;
+  key *= 0x846CA68B;
+  key ^= key >> 16;
+  return key;
+}
+
+static size_t findRoot(std::vector<size_t>& parent, size_t x) {
+  while (parent[x] != x) {
+    parent[x] = parent[parent[x]];
+    x = parent[x];
+  }
+  return x;
+}
+
+FingerPrintAudit::FingerPrintAudit(const FingerPrintGallery& gallery)
+  : _gallery(gallery) {
+  _threshold = DEFAULT_THRESHOLD;
+  _shortlist = DEFAULT_SHORTLIST;
+  _threads = 0;
+  memset(&_stats, 0, sizeof(_stats));
+}
+
+void FingerPrintAudit::setThreshold(uint16_t score) {
+  _threshold = score ? score : 1;
+}
+
+void FingerPrintAudit::setShortlist(size_t k) {
+  _shortlist = k;
+}
+
+void FingerPrintAudit::setThreads(uint16_t threads) {
+  _threads = threads;
+}
+
+const std::vector<FingerPrintAudit::Pair>& FingerPrintAudit::pairs() const {
+  return _pairs;
+}
+
+const std::vector<FingerPrintAudit::Cluster>& FingerPrintAudit::clusters() const {
+  return _clusters;
+}
+
+FingerPrintAudit::Stats FingerPrintAudit::stats() const {
+  return _stats;
+}
+
+// Pairs of one user never count, and compare() cannot exceed
+// 300 * smaller / larger minutia count, so lopsided pairs need no scoring
+bool FingerPrintAudit::_worthScoring(size_t a, size_t b) const {
+  const FingerPrintFeatures& fa = _features[a];
+  const FingerPrintFeatures& fb = _features[b];
+  if (fa.count == 0 || fb.count == 0 || _gallery.at(a).userId == _gallery.at(b).userId) {
+    return false;
+  }
+  uint32_t smaller = fa.count < fb.count ? fa.count : fb.count;
+  uint32_t larger = fa.count < fb.count ? fb.count : fa.count;
+  return 300 * smaller >= (uint32_t)_threshold * larger;
+}
+
+// Run worker(n) for n in [0, threads) on its own thread. Workers pull work
+// from shared counters, so uneven items do not leave cores idle.
+void FingerPrintAudit::_parallel(uint16_t threads, const std::function<void(uint16_t)>& worker) const {
+  if (threads == 1) {
+    worker(0);
+    return;
+  }
+  std::vector<std::thread> pool;
+  for (uint16_t n = 0; n < threads; n++) {
+    pool.push_back(std::thread(worker, n));
+  }
+  for (size_t n = 0; n < pool.size(); n++) {
+    pool[n].join();
+  }
+}
+
+// Candidate pairs, packed as first << 32 | second, sorted and without
+// repeats. Each record keeps the others sharing the most blocking keys with
+// it, so a pair can be found from either side.
+void FingerPrintAudit::_block(uint16_t threads, std::vector<uint64_t>* candidates) {
+  const size_t records = _features.size();
+  std::atomic<size_t> next(0);
+
+  std::vector<std::vector<uint32_t> > stored(records);
+  _parallel(threads, [&](uint16_t) {
+    for (size_t i = next++; i < records; i = next++) {
+      blockingKeys(_features[i], false, &stored[i]);
+    }
+  });
+
+  // Inverted index as one bucket table, about four postings per bucket
+  size_t postings = 0;
+  for (size_t i = 0; i < records; i++) {
+    postings += stored[i].size();
+  }
+  uint8_t bucketBits = 10;
+  while (bucketBits < 30 && ((size_t)1 << bucketBits) * 4 < postings) {
+    bucketBits++;
+  }
+  std::vector<uint32_t> bucketStart(((size_t)1 << bucketBits) + 1, 0);
+  std::vector<uint32_t> postRecord(postings);
+  std::vector<uint8_t> postTag(postings);
+  for (size_t i = 0; i < records; i++) {
+    for (size_t k = 0; k < stored[i].size(); k++) {
+      bucketStart[(mixKey(stored[i][k]) >> (32 - bucketBits)) + 1]++;
+    }
+  }
+  for (size_t b = 1; b < bucketStart.size(); b++) {
+    bucketStart[b] += bucketStart[b - 1];
+  }
+  std::vector<uint32_t> fill(bucketStart.begin(), bucketStart.end() - 1);
+  for (size_t i = 0; i < records; i++) {
+    for (size_t k = 0; k < stored[i].size(); k++) {
+      uint32_t mixed = mixKey(stored[i][k]);
+      uint32_t at = fill[mixed >> (32 - bucketBits)]++;
+      postRecord[at] = (uint32_t)i;
+      postTag[at] = mixed & 0xFF;
+    }
+    std::vector<uint32_t>().swap(stored[i]);
+  }
+  std::vector<uint32_t>().swap(fill);
+  _stats.indexBytes = bucketStart.size() * sizeof(uint32_t) + postings * (sizeof(uint32_t) + sizeof(uint8_t));
+
+  std::vector<std::vector<uint64_t> > found(threads);
+  std::vector<uint64_t> bounded(threads, 0);
+  next = 0;
+  _parallel(threads, [&](uint16_t n) {
+    std::vector<uint32_t> keys;
+    std::vector<uint16_t> shared(records, 0);
+    std::vector<uint32_t> touched;
+    for (size_t a = next++; a < records; a = next++) {
+      if (_features[a].count == 0) {
+        continue;
+      }
+      blockingKeys(_features[a], true, &keys);
+      for (size_t k = 0; k < keys.size(); k++) {
+        uint32_t mixed = mixKey(keys[k]);
+        uint32_t bucket = mixed >> (32 - bucketBits);
+        for (uint32_t at = bucketStart[bucket]; at < bucketStart[bucket + 1]; at++) {
+          uint32_t b = postRecord[at];
+          if (postTag[at] != (mixed & 0xFF) || b == a) {
+            continue;
+          }
+          if (shared[b]++ == 0) {
+            touched.push_back(b);
+          }
+        }
+      }
+
+      // Strongest first; only records sharing a few structures qualify
+      size_t kept = 0;
+      for (size_t t = 0; t < touched.size(); t++) {
+        if (shared[touched[t]] >= MIN_SHARED_KEYS) {
+          touched[kept++] = touched[t];
+        } else {
+          shared[touched[t]] = 0;
+        }
+      }
+      touched.resize(kept);
+      size_t shortlist = _shortlist < kept ? _shortlist : kept;
+      std::partial_sort(touched.begin(), touched.begin() + shortlist, touched.end(), [&](uint32_t x, uint32_t y) {
+        return shared[x] != shared[y] ? shared[x] > shared[y] : x < y;
+      });
+      for (size_t t = 0; t < touched.size(); t++) {
+        size_t b = touched[t];
+        shared[b] = 0;
+        if (t >= shortlist) {
+          continue;
+        }
+        if (!_worthScoring(a, b)) {
+          bounded[n] += _gallery.at(a).userId != _gallery.at(b).userId;
+          continue;
+        }
+        size_t first = a < b ? a : b;
+        size_t second = a < b ? b : a;
+        found[n].push_back((uint64_t)first << 32 | second);
+      }
+      touched.clear();
+    }
+  });
+
+  candidates->clear();
+  for (uint16_t n = 0; n < threads; n++) {
+    candidates->insert(candidates->end(), found[n].begin(), found[n].end());
+    std::vector<uint64_t>().swap(found[n]);
+    _stats.boundedPairs += bounded[n];
+  }
+  std::sort(candidates->begin(), candidates->end());
+  candidates->erase(std::unique(candidates->begin(), candidates->end()), candidates->end());
+}
+
+// Score the gallery against itself and group the suspects. With the
+// shortlist set to 0 every pair is scored, which is exact but only practical
+// for a few thousand records.
+size_t FingerPrintAudit::run() {
+  const int64_t started = nowMs();
+  const size_t records = _gallery.size();
+  uint16_t threads = _threads;
+  if (threads == 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = online > 0 ? (uint16_t)online : 1;
+  }
+  memset(&_stats, 0, sizeof(_stats));
+  _stats.threads = threads;
+  _pairs.clear();
+  _clusters.clear();
+
+  // Decode every active record once; failures keep a count of 0
+  _features.assign(records, FingerPrintFeatures());
+  std::atomic<size_t> next(0);
+  std::atomic<size_t> decoded(0);
+  _parallel(threads, [&](uint16_t) {
+    for (size_t i = next++; i < records; i = next++) {
+      if (_gallery.at(i).active && FingerPrintMatcher::decode(_gallery.at(i).data, &_features[i])) {
+        decoded++;
+      }
+    }
+  });
+  _stats.records = decoded;
+
+  std::vector<uint64_t> candidates;
+  std::vector<size_t> firstPair;  // per record, its first entry in candidates
+  const bool blocked = _shortlist > 0;
+  if (blocked) {
+    _block(threads, &candidates);
+    firstPair.assign(records + 1, candidates.size());
+    for (size_t c = candidates.size(); c-- > 0;) {
+      firstPair[candidates[c] >> 32] = c;
+    }
+    for (size_t a = records; a-- > 0;) {
+      if (firstPair[a] > firstPair[a + 1]) {
+        firstPair[a] = firstPair[a + 1];
+      }
+    }
+  }
+
+  std::vector<std::vector<Pair> > suspects(threads);
+  std::vector<uint64_t> scored(threads, 0);
+  std::vector<uint64_t> bounded(threads, 0);
+  next = 0;
+  _parallel(threads, [&](uint16_t n) {
+    FingerPrintPreparedProbe prepared;
+    for (size_t a = next++; a < records; a = next++) {
+      if (_features[a].count == 0 || (blocked && firstPair[a] == firstPair[a + 1])) {
+        continue;
+      }
+      FingerPrintMatcher::prepareProbe(_features[a], &prepared);
+      const size_t end = blocked ? firstPair[a + 1] : records;
+      for (size_t c = blocked ? firstPair[a] : a + 1; c < end; c++) {
+        const size_t b = blocked ? (size_t)(candidates[c] & 0xFFFFFFFF) : c;
+        if (!blocked && !_worthScoring(a, b)) {
+          bounded[n] += _features[b].count != 0 && _gallery.at(a).userId != _gallery.at(b).userId;
+          continue;
+        }
+        scored[n]++;
+        uint16_t score = FingerPrintMatcher::compare(prepared, _features[b]);
+        if (score >= _threshold) {
+          Pair pair = {a, b, score};
+          suspects[n].push_back(pair);
+        }
+      }
+    }
+  });
+
+  for (uint16_t n = 0; n < threads; n++) {
+    _pairs.insert(_pairs.end(), suspects[n].begin(), suspects[n].end());
+    _stats.candidatePairs += scored[n];
+    _stats.boundedPairs += bounded[n];
+  }
+  std::sort(_pairs.begin(), _pairs.end(), strongerPair);
+  _stats.suspectPairs = _pairs.size();
+  _group();
+  _stats.elapsedMs = (uint32_t)(nowMs() - started);
+  return _clusters.size();
+}
+
+// Records linked by suspect pairs, directly or through others, form one
+// cluster, so a person enrolled three times shows up once
+void FingerPrintAudit::_group() {
+  std::vector<size_t> members;
+  for (size_t p = 0; p < _pairs.size(); p++) {
+    members.push_back(_pairs[p].first);
+    members.push_back(_pairs[p].second);
+  }
+  std::sort(members.begin(), members.end());
+  members.erase(std::unique(members.begin(), members.end()), members.end());
+
+  // Union-find over positions in members
+  std::vector<size_t> parent(members.size());
+  for (size_t m = 0; m < parent.size(); m++) {
+    parent[m] = m;
+  }
+  for (size_t p = 0; p < _pairs.size(); p++) {
+    size_t a = std::lower_bound(members.begin(), members.end(), _pairs[p].first) - members.begin();
+    size_t b = std::lower_bound(members.begin(), members.end(), _pairs[p].second) - members.begin();
+    parent[findRoot(parent, a)] = findRoot(parent, b);
+  }
+
+  std::vector<size_t> clusterOf(members.size(), (size_t)-1);
+  for (size_t m = 0; m < members.size(); m++) {
+    size_t root = findRoot(parent, m);
+    if (clusterOf[root] == (size_t)-1) {
+      clusterOf[root] = _clusters.size();
+      _clusters.push_back(Cluster());
+      _clusters.back().topScore = 0;
+    }
+    Cluster& cluster = _clusters[clusterOf[root]];
+    cluster.records.push_back(members[m]);
+    cluster.users.push_back(_gallery.at(members[m]).userId);
+  }
+  for (size_t p = 0; p < _pairs.size(); p++) {
+    size_t m = std::lower_bound(members.begin(), members.end(), _pairs[p].first) - members.begin();
+    Cluster& cluster = _clusters[clusterOf[findRoot(parent, m)]];
+    if (_pairs[p].score > cluster.topScore) {
+      cluster.topScore = _pairs[p].score;
+    }
+  }
+  for (size_t c = 0; c < _clusters.size(); c++) {
+    std::vector<uint32_t>& users = _clusters[c].users;
+    std::sort(users.begin(), users.end());
+    users.erase(std::unique(users.begin(), users.end()), users.end());
+  }
+  std::stable_sort(_clusters.begin(), _clusters.end(), [](const Cluster& a, const Cluster& b) {
+    if (a.users.size() != b.users.size()) {
+      return a.users.size() > b.users.size();
+    }
+    return a.topScore > b.topScore;
+  });
+}
+#endif // __linux__
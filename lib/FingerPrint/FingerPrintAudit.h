@@ -0,0 +1,74 @@
+#ifndef FINGERPRINT_AUDIT_H
+#define FINGERPRINT_AUDIT_H
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include "FingerPrintGallery.h"
+#include "FingerPrintMatcher.h"
+
+#if defined(__linux__)
+// Offline comparison of a gallery against itself, to find people enrolled
+// under more than one user id and templates close enough to make
+// identification ambiguous. run() works in three stages:
+//   blocking - every record is cut into local structures (a minutia and two
+//              of its nearest neighbours, described in terms that survive
+//              shifts and rotations) and looked up in an inverted index of
+//              everyone else's. The records sharing the most structures are
+//              its candidates. Pairs whose minutia counts alone keep them
+//              under the threshold are dropped.
+//   scoring  - candidate pairs are scored with the host matcher on every
+//              core, each record prepared once as the probe for its pairs.
+//   grouping - records joined by a suspect pair form one cluster.
+// Only pairs of different users are reported: a user's own fingers and
+// re-enrollments are expected to match each other.
+class FingerPrintAudit {
+  public:
+    struct Pair {
+      size_t first;    // gallery record indices, first < second
+      size_t second;
+      uint16_t score;  // FingerPrintMatcher::compare() with first as the probe
+    };
+
+    struct Cluster {
+      std::vector<size_t> records;  // ascending
+      std::vector<uint32_t> users;  // distinct, ascending
+      uint16_t topScore;
+    };
+
+    struct Stats {
+      size_t records;           // active records that decoded
+      uint64_t candidatePairs;  // pairs scored
+      uint64_t boundedPairs;    // candidates dropped on minutia counts
+      size_t indexBytes;        // blocking index at its largest
+      size_t suspectPairs;
+      uint32_t elapsedMs;
+      uint16_t threads;
+    };
+
+    FingerPrintAudit(const FingerPrintGallery& gallery);
+    void setThreshold(uint16_t score);  // default 60
+    void setShortlist(size_t k);        // candidates per record, default 32; 0 scores every pair
+    void setThreads(uint16_t threads);  // 0 (default): every online CPU
+    size_t run();
+
+    const std::vector<Pair>& pairs() const;        // strongest first
+    const std::vector<Cluster>& clusters() const;  // largest first
+    Stats stats() const;
+  private:
+    const FingerPrintGallery& _gallery;
+    uint16_t _threshold;
+    size_t _shortlist;
+    uint16_t _threads;
+    std::vector<FingerPrintFeatures> _features;  // by record, count 0 when skipped
+    std::vector<Pair> _pairs;
+    std::vector<Cluster> _clusters;
+    Stats _stats;
+
+    bool _worthScoring(size_t a, size_t b) const;
+    void _parallel(uint16_t threads, const std::function<void(uint16_t)>& worker) const;
+    void _block(uint16_t threads, std::vector<uint64_t>* candidates);
+    void _group();
+};
+#endif // __linux__
+#endif // FINGERPRINT_AUDIT_H
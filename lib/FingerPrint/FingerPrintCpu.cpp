@@ -0,0 +1,253 @@
+#include "FingerPrintCpu.h"
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define FINGERPRINT_CPU_X86 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+static uint64_t countMask(uint8_t count) {
+  return count >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << count) - 1;
+}
+
+// Scalar kernels: the reference every other variant has to agree with
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32cScalar(const uint8_t* data, size_t length, uint32_t crc) {
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    crc = __crc32cd(crc, word);
+  }
+  for (; i < length; i++) {
+    crc = __crc32cb(crc, data[i]);
+  }
+  return crc;
+}
+#else
+// Reflected CRC32C table, built on first use
+static uint32_t crcTable[256];
+
+static const uint32_t* buildCrcTable() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) {
+      c = (c >> 1) ^ (0x82F63B78 & (0 - (c & 1)));
+    }
+    crcTable[i] = c;
+  }
+  return crcTable;
+}
+
+static uint32_t crc32cScalar(const uint8_t* data, size_t length, uint32_t crc) {
+  static const uint32_t* table = buildCrcTable();
+  for (size_t i = 0; i < length; i++) {
+    crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return crc;
+}
+#endif
+
+static uint32_t squaredDistanceScalar(const uint8_t* a, const uint8_t* b, size_t length) {
+  uint32_t sum = 0;
+  for (size_t i = 0; i < length; i++) {
+    int32_t d = (int32_t)a[i] - b[i];
+    sum += d * d;
+  }
+  return sum;
+}
+
+static uint64_t angleMatchesScalar(const uint8_t* angles, uint8_t count, uint8_t target, uint8_t tolerance) {
+  uint64_t matches = 0;
+  for (uint8_t n = 0; n < count; n++) {
+    if ((uint8_t)(target - angles[n] + tolerance) <= 2 * tolerance) {
+      matches |= (uint64_t)1 << n;
+    }
+  }
+  return matches;
+}
+
+#if defined(FINGERPRINT_CPU_X86)
+// The angle test is done on bytes as (target - angle + tolerance) <= 2 *
+// tolerance, unsigned, which wraps the same way as the int8_t form
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSse42(const uint8_t* data, size_t length, uint32_t crc) {
+  uint64_t c = crc;
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    c = _mm_crc32_u64(c, word);
+  }
+  for (; i < length; i++) {
+    c = _mm_crc32_u8((uint32_t)c, data[i]);
+  }
+  return (uint32_t)c;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t squaredDistanceSse42(const uint8_t* a, const uint8_t* b, size_t length) {
+  __m128i sum = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8) {
+    __m128i wa = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(a + i)));
+    __m128i wb = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(b + i)));
+    __m128i d = _mm_sub_epi16(wa, wb);
+    sum = _mm_add_epi32(sum, _mm_madd_epi16(d, d));
+  }
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+  return (uint32_t)_mm_cvtsi128_si32(sum) + squaredDistanceScalar(a + i, b + i, length - i);
+}
+
+__attribute__((target("sse4.2")))
+static uint64_t angleMatchesSse42(const uint8_t* angles, uint8_t count, uint8_t target, uint8_t tolerance) {
+  const __m128i shift = _mm_set1_epi8((char)(uint8_t)(target + tolerance));
+  const __m128i limit = _mm_set1_epi8((char)(2 * tolerance));
+  uint64_t matches = 0;
+  for (int block = 0; block < 4; block++) {
+    __m128i v = _mm_sub_epi8(shift, _mm_loadu_si128((const __m128i*)(angles + 16 * block)));
+    __m128i inside = _mm_cmpeq_epi8(_mm_min_epu8(v, limit), v);
+    matches |= (uint64_t)(uint16_t)_mm_movemask_epi8(inside) << (16 * block);
+  }
+  return matches & countMask(count);
+}
+
+__attribute__((target("avx2")))
+static uint32_t squaredDistanceAvx2(const uint8_t* a, const uint8_t* b, size_t length) {
+  __m256i sum = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m256i wa = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(a + i)));
+    __m256i wb = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(b + i)));
+    __m256i d = _mm256_sub_epi16(wa, wb);
+    sum = _mm256_add_epi32(sum, _mm256_madd_epi16(d, d));
+  }
+  __m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+  half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4E));
+  half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xB1));
+  return (uint32_t)_mm_cvtsi128_si32(half) + squaredDistanceScalar(a + i, b + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static uint64_t angleMatchesAvx2(const uint8_t* angles, uint8_t count, uint8_t target, uint8_t tolerance) {
+  const __m256i shift = _mm256_set1_epi8((char)(uint8_t)(target + tolerance));
+  const __m256i limit = _mm256_set1_epi8((char)(2 * tolerance));
+  __m256i low = _mm256_sub_epi8(shift, _mm256_loadu_si256((const __m256i*)angles));
+  __m256i high = _mm256_sub_epi8(shift, _mm256_loadu_si256((const __m256i*)(angles + 32)));
+  uint32_t lowMatches = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(low, limit), low));
+  uint32_t highMatches = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(high, limit), high));
+  return ((uint64_t)highMatches << 32 | lowMatches) & countMask(count);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static uint32_t squaredDistanceAvx512(const uint8_t* a, const uint8_t* b, size_t length) {
+  __m512i sum = _mm512_setzero_si512();
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m512i wa = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(a + i)));
+    __m512i wb = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(b + i)));
+    __m512i d = _mm512_sub_epi16(wa, wb);
+    sum = _mm512_add_epi32(sum, _mm512_madd_epi16(d, d));
+  }
+  // Summed through memory: GCC 12's lane-extract intrinsics trip
+  // -Wuninitialized in its own headers
+  int32_t lanes[16];
+  _mm512_storeu_si512((void*)lanes, sum);
+  uint32_t total = 0;
+  for (int lane = 0; lane < 16; lane++) {
+    total += (uint32_t)lanes[lane];
+  }
+  return total + squaredDistanceScalar(a + i, b + i, length - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t angleMatchesAvx512(const uint8_t* angles, uint8_t count, uint8_t target, uint8_t tolerance) {
+  __m512i v = _mm512_sub_epi8(_mm512_set1_epi8((char)(uint8_t)(target + tolerance)),
+                              _mm512_loadu_si512((const void*)angles));
+  return _mm512_cmple_epu8_mask(v, _mm512_set1_epi8((char)(2 * tolerance))) & countMask(count);
+}
+#endif
+
+// One table per level. The CRC instruction is no wider above SSE4.2, so the
+// higher levels share its kernel.
+static const FingerPrintCpu::Kernels KERNELS[] = {
+  {FingerPrintCpu::LEVEL_SCALAR, crc32cScalar, squaredDistanceScalar, angleMatchesScalar},
+#if defined(FINGERPRINT_CPU_X86)
+  {FingerPrintCpu::LEVEL_SSE42, crc32cSse42, squaredDistanceSse42, angleMatchesSse42},
+  {FingerPrintCpu::LEVEL_AVX2, crc32cSse42, squaredDistanceAvx2, angleMatchesAvx2},
+  {FingerPrintCpu::LEVEL_AVX512, crc32cSse42, squaredDistanceAvx512, angleMatchesAvx512},
+#endif
+};
+
+static const char* const LEVEL_NAMES[] = {"scalar", "sse4.2", "avx2", "avx512"};
+
+// Constant-initialised, so kernels() is safe from other static constructors
+static std::atomic<const FingerPrintCpu::Kernels*> bound(nullptr);
+
+FingerPrintCpu::Level FingerPrintCpu::detected() {
+#if defined(FINGERPRINT_CPU_X86)
+  // __builtin_cpu_supports() also checks that the OS saves the wider registers
+  static const Level level = [] {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+      return LEVEL_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+      return LEVEL_AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+      return LEVEL_SSE42;
+    }
+    return LEVEL_SCALAR;
+  }();
+  return level;
+#else
+  return LEVEL_SCALAR;
+#endif
+}
+
+const char* FingerPrintCpu::name(Level level) {
+  return level <= LEVEL_AVX512 ? LEVEL_NAMES[level] : "unknown";
+}
+
+const FingerPrintCpu::Kernels& FingerPrintCpu::kernels() {
+  const Kernels* kernels = bound.load(std::memory_order_acquire);
+  if (kernels) {
+    return *kernels;
+  }
+
+  Level level = detected();
+#if !defined(ESP_PLATFORM)
+  const char* cap = getenv("FINGERPRINT_CPU");
+  for (uint8_t l = LEVEL_SCALAR; cap && l < level; l++) {
+    if (strcmp(cap, LEVEL_NAMES[l]) == 0) {
+      level = (Level)l;
+    }
+  }
+#endif
+  // Racing first calls bind the same table
+  kernels = &KERNELS[level];
+  bound.store(kernels, std::memory_order_release);
+  return *kernels;
+}
+
+FingerPrintCpu::Level FingerPrintCpu::active() {
+  return kernels().level;
+}
+
+// Meant for benchmarks and tests, between runs: a kernel already in flight
+// on another thread finishes on the level it started with
+bool FingerPrintCpu::force(Level level) {
+  if (level > detected()) {
+    return false;
+  }
+  bound.store(&KERNELS[level], std::memory_order_release);
+  return true;
+}
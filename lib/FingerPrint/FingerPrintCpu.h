@@ -0,0 +1,44 @@
+#ifndef FINGERPRINT_CPU_H
+#define FINGERPRINT_CPU_H
+#include <cstddef>
+#include <cstdint>
+
+// Instruction-set dispatch for the host-side kernels. The CPU is probed once,
+// on the first kernels() call, and every kernel is bound to the best variant
+// it supports, so one x86-64 binary runs the AVX-512 code on a server and the
+// SSE or plain C code on an older gateway. Every variant gives bit-identical
+// results; only the speed differs.
+//
+// For benchmarking, force() binds a lower level at run time, and on hosted
+// builds the FINGERPRINT_CPU environment variable (scalar, sse4.2, avx2,
+// avx512) caps the level picked at startup. Other architectures always run
+// the scalar kernels, which use the ARMv8 CRC instructions when the compiler
+// targets them.
+class FingerPrintCpu {
+  public:
+    enum Level : uint8_t {
+      LEVEL_SCALAR = 0,
+      LEVEL_SSE42 = 1,
+      LEVEL_AVX2 = 2,
+      LEVEL_AVX512 = 3,   // AVX-512 F and BW
+    };
+
+    struct Kernels {
+      Level level;
+      // CRC32C register update, without the initial and final inversion
+      uint32_t (*crc32c)(const uint8_t* data, size_t length, uint32_t crc);
+      // Sum of squared byte differences
+      uint32_t (*squaredDistance)(const uint8_t* a, const uint8_t* b, size_t length);
+      // Bit n set for each n < count with |(int8_t)(target - angles[n])| <=
+      // tolerance. angles must be readable for 64 bytes.
+      uint64_t (*angleMatches)(const uint8_t* angles, uint8_t count, uint8_t target, uint8_t tolerance);
+    };
+
+    static Level detected();   // best level this CPU and OS support
+    static Level active();     // level the kernels are bound to
+    static bool force(Level level);  // false, and nothing changes, above detected()
+    static const char* name(Level level);
+
+    static const Kernels& kernels();
+};
+#endif // FINGERPRINT_CPU_H
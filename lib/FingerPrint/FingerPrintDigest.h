@@ -0,0 +1,18 @@
+#ifndef FINGERPRINT_DIGEST_H
+#define FINGERPRINT_DIGEST_H
+#include <cstddef>
+#include <cstdint>
+
+// Digests over stored templates. SHA-256 gives the same bytes as
+// FingerPrint::readAndHashFingerprint(); it uses mbedtls on ESP32 and a
+// portable implementation elsewhere. CRC32C (Castagnoli) is the cheap check
+// run on every read; FingerPrintCpu picks the SSE4.2 or ARMv8 CRC
+// instructions when the CPU has them and a table otherwise.
+class FingerPrintDigest {
+  public:
+    static const uint16_t SHA256_SIZE = 32;
+
+    static void sha256(const uint8_t* data, size_t length, uint8_t out[SHA256_SIZE]);
+    static uint32_t crc32c(const uint8_t* data, size_t length, uint32_t crc = 0);
+};
+#endif // FINGERPRINT_DIGEST_H
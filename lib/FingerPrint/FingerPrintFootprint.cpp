@@ -0,0 +1,129 @@
+#include "FingerPrintFootprint.h"
+#include <cstdlib>
+#include <cstring>
+
+#if defined(ESP_PLATFORM)
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_heap_caps.h>
+
+struct ProbeTask {
+  void (*call)(void* arg);
+  void* arg;
+  TaskHandle_t caller;
+};
+
+static void probeTask(void* param) {
+  ProbeTask* task = (ProbeTask*)param;
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY); // Wait for the caller's heap baseline
+  task->call(task->arg);
+  xTaskNotifyGive(task->caller);
+  vTaskSuspend(nullptr); // Stay alive so the caller can read the high-water mark
+}
+
+// FreeRTOS already paints task stacks; uxTaskGetStackHighWaterMark reports
+// the untouched remainder. The heap is read after the probe task exists and
+// before it is deleted, so its own stack and TCB cancel out. heapPeakBytes
+// only sees new low points of free heap since boot, so it reads 0 when an
+// earlier call went deeper.
+bool FingerPrintFootprint::measure(void (*call)(void* arg), void* arg, Result* result) {
+  ProbeTask task = {call, arg, xTaskGetCurrentTaskHandle()};
+  TaskHandle_t handle = nullptr;
+  if (xTaskCreate(probeTask, "fp_probe", PROBE_STACK, &task, uxTaskPriorityGet(nullptr), &handle) != pdPASS) {
+    return false;
+  }
+  size_t freeBefore = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  size_t lowBefore = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+  xTaskNotifyGive(handle);
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  UBaseType_t untouched = uxTaskGetStackHighWaterMark(handle);
+  size_t freeAfter = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  size_t lowAfter = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+  vTaskDelete(handle);
+
+  result->stackBytes = PROBE_STACK - untouched;
+  result->heapBytes = (int32_t)freeBefore - (int32_t)freeAfter;
+  result->heapPeakBytes = lowAfter < lowBefore ? freeBefore - lowAfter : 0;
+  return true;
+}
+#elif defined(__linux__)
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+static const uint8_t PAINT = 0xA5;
+
+static const size_t PAINT_MARGIN = 512;  // left unpainted below the running frame
+
+struct ProbeThread {
+  void (*call)(void* arg);
+  void* arg;
+  uint8_t* stack;       // lowest address of the thread's stack
+  uint8_t* top;         // stack pointer (roughly) when the call was made
+  size_t painted;       // bytes painted from stack upwards
+  long heapBytes;
+};
+
+static size_t heapInUse() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  return mallinfo2().uordblks;
+#else
+  return 0;
+#endif
+}
+
+// Stacks grow down. Thread start-up and the thread's first malloc (arena
+// set-up) run first; then everything below the current frame is painted and
+// the call made, so only the call's own depth shows as overwritten bytes.
+// Heap is glibc's allocated total before and after the call.
+static void* probeThread(void* param) {
+  ProbeThread* thread = (ProbeThread*)param;
+  free(malloc(1));
+  volatile uint8_t marker = 0;
+  thread->top = (uint8_t*)&marker;
+  // &marker is not part of the stack array as far as the compiler knows, so
+  // the distance is taken on addresses rather than by pointer subtraction
+  thread->painted = (uintptr_t)thread->top - PAINT_MARGIN - (uintptr_t)thread->stack;
+  memset(thread->stack, PAINT, thread->painted);
+
+  size_t before = heapInUse();
+  thread->call(thread->arg);
+  thread->heapBytes = (long)heapInUse() - (long)before;
+  return nullptr;
+}
+
+// Heap is the net change in glibc's allocated total; the peak is not
+// available here
+bool FingerPrintFootprint::measure(void (*call)(void* arg), void* arg, Result* result) {
+  void* stack = mmap(nullptr, PROBE_STACK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (stack == MAP_FAILED) {
+    return false;
+  }
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstack(&attr, stack, PROBE_STACK);
+  ProbeThread thread = {call, arg, (uint8_t*)stack, nullptr, 0, 0};
+  pthread_t id;
+  bool ok = pthread_create(&id, &attr, probeThread, &thread) == 0;
+  pthread_attr_destroy(&attr);
+  if (ok) {
+    pthread_join(id, nullptr);
+    const uint8_t* lowest = thread.stack;
+    while (lowest < thread.stack + thread.painted && *lowest == PAINT) {
+      lowest++;
+    }
+    result->stackBytes = (uintptr_t)thread.top - (uintptr_t)lowest;
+    result->heapBytes = (int32_t)thread.heapBytes;
+    result->heapPeakBytes = 0;
+  }
+  munmap(stack, PROBE_STACK);
+  return ok;
+}
+#else
+bool FingerPrintFootprint::measure(void (*call)(void* arg), void* arg, Result* result) {
+  (void)call;
+  (void)arg;
+  (void)result;
+  return false;
+}
+#endif
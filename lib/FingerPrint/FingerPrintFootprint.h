@@ -0,0 +1,27 @@
+#ifndef FINGERPRINT_FOOTPRINT_H
+#define FINGERPRINT_FOOTPRINT_H
+#include <cstddef>
+#include <cstdint>
+
+// Measures how much stack and heap one call needs, for sizing task stacks.
+// The call runs on a fresh stack painted with a known pattern (a FreeRTOS
+// task on ESP32, a thread on Linux); the deepest overwritten byte gives the
+// stack high-water mark. Results below PAINT_MARGIN (512 bytes) on Linux
+// read as 512; the figure is rounded up, never down.
+class FingerPrintFootprint {
+  public:
+#if defined(ESP_PLATFORM)
+    static const size_t PROBE_STACK = 16 * 1024;
+#else
+    static const size_t PROBE_STACK = 256 * 1024;
+#endif
+
+    struct Result {
+      uint32_t stackBytes;     // peak stack depth of the call
+      int32_t heapBytes;       // heap still held after it returned
+      uint32_t heapPeakBytes;  // lowest free heap reached below the start, 0 when not measurable
+    };
+
+    static bool measure(void (*call)(void* arg), void* arg, Result* result);
+};
+#endif // FINGERPRINT_FOOTPRINT_H
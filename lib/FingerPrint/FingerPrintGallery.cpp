@@ -0,0 +1,261 @@
+#include "FingerPrintGallery.h"
+#include <cstring>
+
+FingerPrintGallery::FingerPrintGallery() {
+  _activeCount = 0;
+  _cachedCount = 0;
+}
+
+// Records point into the blob store, so copies re-point them at their own
+FingerPrintGallery::FingerPrintGallery(const FingerPrintGallery& other) {
+  *this = other;
+}
+
+FingerPrintGallery& FingerPrintGallery::operator=(const FingerPrintGallery& other) {
+  if (this == &other) {
+    return *this;
+  }
+  _records = other._records;
+  _blobs = other._blobs;
+  _byDigest = other._byDigest;
+  _log = other._log;
+  _activeCount = other._activeCount;
+  _cachedCount = other._cachedCount;
+  for (size_t i = 0; i < _records.size(); i++) {
+    _records[i].data = _blobs[_records[i].blob].data;
+  }
+  return *this;
+}
+
+size_t FingerPrintGallery::DigestHash::operator()(const DigestKey& digest) const {
+  size_t hash;
+  memcpy(&hash, &digest[0], sizeof(hash));
+  return hash;
+}
+
+// A digest passed in comes from storage and is not hashed here; it is only
+// checked where it could do harm, on first use by findByDigest()
+bool FingerPrintGallery::_digestMatches(uint32_t blob) const {
+  const Blob& stored = _blobs[blob];
+  if (stored.digestOk < 0) {
+    uint8_t digest[FingerPrintDigest::SHA256_SIZE];
+    FingerPrintDigest::sha256(stored.data, TEMPLATE_SIZE, digest);
+    stored.digestOk = memcmp(digest, stored.digest, sizeof(digest)) == 0;
+  }
+  return stored.digestOk;
+}
+
+// Find or create the shared copy of these bytes and count a reference. The
+// bytes are compared before sharing, so a wrong stored digest cannot merge
+// two templates: the data is hashed instead, and a blob filed under a digest
+// that is not its own leaves the index.
+uint32_t FingerPrintGallery::_store(const uint8_t data[TEMPLATE_SIZE], const uint8_t* digest, size_t index) {
+  DigestKey key;
+  bool hashed = !digest;
+  if (digest) {
+    memcpy(&key[0], digest, key.size());
+  } else {
+    FingerPrintDigest::sha256(data, TEMPLATE_SIZE, &key[0]);
+  }
+  std::unordered_map<DigestKey, uint32_t, DigestHash>::iterator found = _byDigest.find(key);
+  if (found != _byDigest.end() && memcmp(_blobs[found->second].data, data, TEMPLATE_SIZE) != 0) {
+    if (!hashed) {
+      FingerPrintDigest::sha256(data, TEMPLATE_SIZE, &key[0]);
+      hashed = true;
+      found = _byDigest.find(key);
+    }
+    if (found != _byDigest.end() && memcmp(_blobs[found->second].data, data, TEMPLATE_SIZE) != 0) {
+      _blobs[found->second].digestOk = 0;
+      _byDigest.erase(found);
+      found = _byDigest.end();
+    }
+  }
+  uint32_t blob;
+  if (found != _byDigest.end()) {
+    blob = found->second;
+  } else {
+    blob = _blobs.size();
+    _blobs.push_back(Blob());
+    memcpy(_blobs[blob].digest, &key[0], key.size());
+    memcpy(_blobs[blob].data, data, TEMPLATE_SIZE);
+    _blobs[blob].refs = 0;
+    _blobs[blob].owner = NOT_FOUND;
+    _blobs[blob].digestOk = hashed ? 1 : -1;
+    _byDigest[key] = blob;
+  }
+  if (_blobs[blob].refs++ == 0) {
+    _blobs[blob].owner = index;
+  }
+  return blob;
+}
+
+size_t FingerPrintGallery::add(uint32_t userId, uint8_t finger, const uint8_t data[TEMPLATE_SIZE],
+                               const uint8_t* digest) {
+  Record record;
+  record.userId = userId;
+  record.finger = finger;
+  record.active = true;
+  record.slot = NO_SLOT;
+  record.blob = _store(data, digest, _records.size());
+  record.data = _blobs[record.blob].data;
+  _records.push_back(record);
+  _activeCount++;
+
+  Change change = {CHANGE_ADD, _records.size() - 1};
+  _log.push_back(change);
+  return _records.size() - 1;
+}
+
+// Add unless an active record of the same user and finger already holds
+// byte-identical data, in which case that record's index is returned and
+// nothing changes. The same bytes under another user or finger get a record
+// of their own that shares the stored copy.
+size_t FingerPrintGallery::import(uint32_t userId, uint8_t finger, const uint8_t data[TEMPLATE_SIZE], bool* added) {
+  uint8_t digest[FingerPrintDigest::SHA256_SIZE];
+  FingerPrintDigest::sha256(data, TEMPLATE_SIZE, digest);
+  size_t existing = _findHolder(digest, data, userId, finger);
+  if (added) {
+    *added = existing == NOT_FOUND;
+  }
+  return existing != NOT_FOUND ? existing : add(userId, finger, data, digest);
+}
+
+// Active record of userId and finger using the blob with this digest. The
+// owner is checked first; other holders are only searched when shared.
+size_t FingerPrintGallery::_findHolder(const uint8_t* digest, const uint8_t data[TEMPLATE_SIZE], uint32_t userId,
+                                       uint8_t finger) const {
+  DigestKey key;
+  memcpy(&key[0], digest, key.size());
+  std::unordered_map<DigestKey, uint32_t, DigestHash>::const_iterator found = _byDigest.find(key);
+  if (found == _byDigest.end() || _blobs[found->second].refs == 0) {
+    return NOT_FOUND;
+  }
+  const Blob& blob = _blobs[found->second];
+  if (memcmp(blob.data, data, TEMPLATE_SIZE) != 0) {
+    return NOT_FOUND;   // filed under a wrong digest; add() sorts it out
+  }
+  const Record& owner = _records[blob.owner];
+  if (owner.userId == userId && owner.finger == finger) {
+    return blob.owner;
+  }
+  for (size_t i = 0; blob.refs > 1 && i < _records.size(); i++) {
+    const Record& record = _records[i];
+    if (record.active && record.blob == found->second && record.userId == userId && record.finger == finger) {
+      return i;
+    }
+  }
+  return NOT_FOUND;
+}
+
+bool FingerPrintGallery::remove(size_t index) {
+  if (index >= _records.size() || !_records[index].active) {
+    return false;
+  }
+  setSlot(index, NO_SLOT);
+  _records[index].active = false;
+  _activeCount--;
+
+  // The bytes stay in place for the tombstone and for a later re-import
+  Blob& blob = _blobs[_records[index].blob];
+  blob.refs--;
+  if (blob.owner == index) {
+    blob.owner = NOT_FOUND;
+    for (size_t i = 0; blob.refs > 0 && i < _records.size(); i++) {
+      if (_records[i].active && _records[i].blob == _records[index].blob) {
+        blob.owner = i;
+        break;
+      }
+    }
+  }
+
+  Change change = {CHANGE_REMOVE, index};
+  _log.push_back(change);
+  return true;
+}
+
+const FingerPrintGallery::Record& FingerPrintGallery::at(size_t index) const {
+  return _records[index];
+}
+
+size_t FingerPrintGallery::size() const {
+  return _records.size();
+}
+
+size_t FingerPrintGallery::activeCount() const {
+  return _activeCount;
+}
+
+// Active record holding bytes with this SHA-256 digest, or NOT_FOUND
+size_t FingerPrintGallery::findByDigest(const uint8_t digest[FingerPrintDigest::SHA256_SIZE]) const {
+  DigestKey key;
+  memcpy(&key[0], digest, key.size());
+  std::unordered_map<DigestKey, uint32_t, DigestHash>::const_iterator found = _byDigest.find(key);
+  if (found == _byDigest.end() || !_digestMatches(found->second)) {
+    return NOT_FOUND;
+  }
+  return _blobs[found->second].owner;
+}
+
+const uint8_t* FingerPrintGallery::digest(size_t index) const {
+  return _blobs[_records[index].blob].digest;
+}
+
+size_t FingerPrintGallery::storedCount() const {
+  return _blobs.size();
+}
+
+uint64_t FingerPrintGallery::sequence() const {
+  return _log.size();
+}
+
+bool FingerPrintGallery::change(uint64_t sequence, Change* change) const {
+  if (sequence >= _log.size()) {
+    return false;
+  }
+  *change = _log[sequence];
+  return true;
+}
+
+void FingerPrintGallery::setSlot(size_t index, uint16_t slot) {
+  if (index >= _records.size() || !_records[index].active) {
+    return;
+  }
+  Record& record = _records[index];
+  if (record.slot == NO_SLOT && slot != NO_SLOT) {
+    _cachedCount++;
+  } else if (record.slot != NO_SLOT && slot == NO_SLOT) {
+    _cachedCount--;
+  }
+  record.slot = slot;
+}
+
+size_t FingerPrintGallery::cachedCount() const {
+  return _cachedCount;
+}
+
+size_t FingerPrintGallery::findBySlot(uint16_t slot) const {
+  if (slot == NO_SLOT) {
+    return NOT_FOUND;
+  }
+  for (size_t i = 0; i < _records.size(); i++) {
+    if (_records[i].active && _records[i].slot == slot) {
+      return i;
+    }
+  }
+  return NOT_FOUND;
+}
+
+// Lowest and highest occupied sensor page, false when nothing is cached
+bool FingerPrintGallery::slotRange(uint16_t* first, uint16_t* last) const {
+  bool found = false;
+  for (size_t i = 0; i < _records.size(); i++) {
+    const Record& record = _records[i];
+    if (!record.active || record.slot == NO_SLOT) {
+      continue;
+    }
+    if (!found || record.slot < *first) *first = record.slot;
+    if (!found || record.slot > *last) *last = record.slot;
+    found = true;
+  }
+  return found;
+}
@@ -0,0 +1,89 @@
+#ifndef FINGERPRINT_GALLERY_H
+#define FINGERPRINT_GALLERY_H
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+#include "FingerPrintDigest.h"
+
+// In-memory template store searched by the identification paths.
+// Removed records leave a tombstone so indices stay valid for callers.
+// Adds and removals are numbered in a change log that replicas replay; the
+// sensor slot copies are local to each reader and not logged.
+// Template bytes are stored once per SHA-256 digest and shared by every
+// record holding the same bytes.
+class FingerPrintGallery {
+  public:
+    static const uint16_t TEMPLATE_SIZE = 512;
+    static const uint16_t NO_SLOT = 0xFFFF;   // record has no copy in sensor flash
+    static const size_t NOT_FOUND = (size_t)-1;
+
+    struct Record {
+      uint32_t userId;
+      uint8_t finger;      // 0-9, which finger of the user
+      bool active;         // false once removed
+      uint16_t slot;       // sensor library page holding a copy, or NO_SLOT
+      uint32_t blob;       // shared template storage
+      const uint8_t* data; // TEMPLATE_SIZE bytes, valid for the gallery's lifetime
+    };
+
+    // One entry of the change log, numbered from 0 in the order applied
+    enum ChangeType : uint8_t {
+      CHANGE_ADD = 'A',
+      CHANGE_REMOVE = 'R',
+    };
+    struct Change {
+      ChangeType type;
+      size_t index;      // record added or removed
+    };
+
+    FingerPrintGallery();
+    FingerPrintGallery(const FingerPrintGallery& other);
+    FingerPrintGallery& operator=(const FingerPrintGallery& other);
+    size_t add(uint32_t userId, uint8_t finger, const uint8_t data[TEMPLATE_SIZE],
+               const uint8_t* digest = nullptr);  // digest: stored SHA-256 of data, skips hashing
+    size_t import(uint32_t userId, uint8_t finger, const uint8_t data[TEMPLATE_SIZE], bool* added = nullptr);
+    bool remove(size_t index);
+    const Record& at(size_t index) const;
+    size_t size() const;         // including removed records
+    size_t activeCount() const;
+
+    size_t findByDigest(const uint8_t digest[FingerPrintDigest::SHA256_SIZE]) const;
+    const uint8_t* digest(size_t index) const;
+    size_t storedCount() const;  // distinct templates held
+
+    uint64_t sequence() const;   // changes applied so far
+    bool change(uint64_t sequence, Change* change) const;  // false past sequence()
+
+    void setSlot(size_t index, uint16_t slot);
+    size_t cachedCount() const;  // active records with a sensor slot
+    size_t findBySlot(uint16_t slot) const;
+    bool slotRange(uint16_t* first, uint16_t* last) const;
+  private:
+    struct Blob {
+      uint8_t digest[FingerPrintDigest::SHA256_SIZE];
+      uint8_t data[TEMPLATE_SIZE];
+      uint32_t refs;     // active records using it
+      size_t owner;      // one of those records, NOT_FOUND when refs is 0
+      mutable int8_t digestOk;  // digest checked against data: 1 matches, 0 not, -1 not yet
+    };
+    // Digests are uniformly distributed, so their first bytes are the hash
+    typedef std::array<uint8_t, FingerPrintDigest::SHA256_SIZE> DigestKey;
+    struct DigestHash {
+      size_t operator()(const DigestKey& digest) const;
+    };
+
+    std::vector<Record> _records;
+    std::deque<Blob> _blobs;     // deque: stable addresses for Record::data
+    std::unordered_map<DigestKey, uint32_t, DigestHash> _byDigest;
+    std::vector<Change> _log;
+    size_t _activeCount;
+    size_t _cachedCount;
+
+    uint32_t _store(const uint8_t data[TEMPLATE_SIZE], const uint8_t* digest, size_t index);
+    bool _digestMatches(uint32_t blob) const;
+    size_t _findHolder(const uint8_t* digest, const uint8_t data[TEMPLATE_SIZE], uint32_t userId, uint8_t finger) const;
+};
+#endif // FINGERPRINT_GALLERY_H
@@ -0,0 +1,594 @@
+#include "FingerPrintGraphIndex.h"
+#include "FingerPrintCpu.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Node layout: record(8) | level(1) pad(3) | layer-0 link count(4) |
+// layer-0 links(4 * maxLinks0) | descriptor(DESCRIPTOR_SIZE)
+static const size_t NODE_LEVEL = 8;
+static const size_t NODE_COUNT = 12;
+static const size_t NODE_LINKS = 16;
+static const uint8_t MAX_LEVEL = 15;
+
+// File layout: fixed header, node block, then the upper-layer links of every
+// node above layer 0 in node order
+static const char FILE_MAGIC[8] = {'F', 'P', 'H', 'N', 'S', 'W', '1', 0};
+static const size_t FILE_HEADER_SIZE = 64;
+
+struct GraphFileHeader {
+  char magic[8];
+  uint32_t m;
+  uint32_t maxLinks0;
+  uint32_t nodeSize;
+  int32_t entryPoint;
+  uint32_t topLevel;
+  uint32_t reserved;
+  uint64_t count;
+  uint64_t covered;
+};
+
+// Heap orderings over candidates
+static bool nearerFirst(const FingerPrintGraphIndex::Candidate& a, const FingerPrintGraphIndex::Candidate& b) {
+  return a.distance > b.distance;
+}
+static bool fartherFirst(const FingerPrintGraphIndex::Candidate& a, const FingerPrintGraphIndex::Candidate& b) {
+  return a.distance < b.distance;
+}
+
+FingerPrintGraphIndex::FingerPrintGraphIndex(uint16_t m, uint16_t efConstruction) {
+  _m = m < 2 ? 2 : m;
+  _maxLinks0 = 2 * _m;
+  _efConstruction = efConstruction < _m ? _m : efConstruction;
+  _efSearch = 64;
+  _nodeSize = NODE_LINKS + 4 * _maxLinks0 + FingerPrintMatcher::DESCRIPTOR_SIZE;
+  _nodes = nullptr;
+  _count = 0;
+  _capacity = 0;
+  _mapping = nullptr;
+  _mappingSize = 0;
+  _entryPoint = -1;
+  _topLevel = 0;
+  _covered = 0;
+  _seed = 0x2545F491;
+  _visitEpoch = 0;
+  _distanceCount = 0;
+}
+
+FingerPrintGraphIndex::~FingerPrintGraphIndex() {
+  _release();
+}
+
+// Candidates examined per search; higher finds more true neighbours at the
+// cost of more distance evaluations
+void FingerPrintGraphIndex::setSearchEffort(uint16_t ef) {
+  _efSearch = ef ? ef : 1;
+}
+
+size_t FingerPrintGraphIndex::size() const {
+  return _count;
+}
+
+size_t FingerPrintGraphIndex::coveredRecords() const {
+  return _covered;
+}
+
+size_t FingerPrintGraphIndex::lastDistanceCount() const {
+  return _distanceCount;
+}
+
+uint8_t* FingerPrintGraphIndex::_node(uint32_t node) const {
+  return _nodes + (size_t)node * _nodeSize;
+}
+
+uint8_t FingerPrintGraphIndex::_level(uint32_t node) const {
+  return _node(node)[NODE_LEVEL];
+}
+
+uint64_t FingerPrintGraphIndex::_record(uint32_t node) const {
+  uint64_t record;
+  memcpy(&record, _node(node), sizeof(record));
+  return record;
+}
+
+const uint8_t* FingerPrintGraphIndex::_descriptor(uint32_t node) const {
+  return _node(node) + NODE_LINKS + 4 * _maxLinks0;
+}
+
+// Links of a node on one level; count points at the number in use
+uint32_t* FingerPrintGraphIndex::_links(uint32_t node, uint8_t level, uint32_t** count) const {
+  if (level == 0) {
+    *count = (uint32_t*)(_node(node) + NODE_COUNT);
+    return (uint32_t*)(_node(node) + NODE_LINKS);
+  }
+  uint32_t* upper = const_cast<uint32_t*>(&_upperLinks[node][(size_t)(level - 1) * (1 + _m)]);
+  *count = upper;
+  return upper + 1;
+}
+
+// Squared L2 between two descriptors
+uint32_t FingerPrintGraphIndex::_distance(const uint8_t* a, const uint8_t* b) const {
+  _distanceCount++;
+  return FingerPrintCpu::kernels().squaredDistance(a, b, FingerPrintMatcher::DESCRIPTOR_SIZE);
+}
+
+bool FingerPrintGraphIndex::_reserve(size_t capacity) {
+  if (capacity <= _capacity) {
+    return true;
+  }
+  size_t grown = _capacity ? _capacity * 2 : 1024;
+  if (grown < capacity) {
+    grown = capacity;
+  }
+  uint8_t* nodes = (uint8_t*)malloc(grown * _nodeSize);
+  if (!nodes) {
+    return false;
+  }
+  if (_count) {
+    memcpy(nodes, _nodes, _count * _nodeSize);
+  }
+
+  // A mapped file becomes a private heap copy once it has to grow
+  if (_mapping) {
+#if defined(__linux__)
+    munmap(_mapping, _mappingSize);
+#endif
+    _mapping = nullptr;
+    _mappingSize = 0;
+  } else {
+    free(_nodes);
+  }
+  _nodes = nodes;
+  _capacity = grown;
+  _visited.resize(grown, 0);
+  return true;
+}
+
+void FingerPrintGraphIndex::_release() {
+  if (_mapping) {
+#if defined(__linux__)
+    munmap(_mapping, _mappingSize);
+#endif
+  } else {
+    free(_nodes);
+  }
+  _nodes = nullptr;
+  _mapping = nullptr;
+  _mappingSize = 0;
+  _count = 0;
+  _capacity = 0;
+  _upperLinks.clear();
+  _visited.clear();
+  _entryPoint = -1;
+  _topLevel = 0;
+  _covered = 0;
+}
+
+// Drop every node, e.g. before re-adding a gallery that was replaced
+void FingerPrintGraphIndex::clear() {
+  _release();
+}
+
+// Geometric level draw with mean 1 / ln(M), as in the HNSW paper
+uint8_t FingerPrintGraphIndex::_randomLevel() {
+  _seed ^= _seed << 13;
+  _seed ^= _seed >> 17;
+  _seed ^= _seed << 5;
+  double u = ((_seed >> 8) + 1) / 16777217.0;
+  int level = (int)(-log(u) / log((double)_m));
+  return level > MAX_LEVEL ? MAX_LEVEL : (uint8_t)level;
+}
+
+// Best-first search on one layer, keeping the ef closest nodes seen
+void FingerPrintGraphIndex::_searchLayer(const uint8_t* query, uint32_t entry, uint16_t ef, uint8_t level,
+                                         std::vector<Candidate>* found) const {
+  if (_visited.size() < _capacity) {
+    _visited.resize(_capacity, 0);
+  }
+  if (++_visitEpoch == 0) {
+    std::fill(_visited.begin(), _visited.end(), 0);
+    _visitEpoch = 1;
+  }
+
+  std::vector<Candidate> frontier;
+  found->clear();
+  Candidate start;
+  start.node = entry;
+  start.distance = _distance(query, _descriptor(entry));
+  frontier.push_back(start);
+  found->push_back(start);
+  _visited[entry] = _visitEpoch;
+
+  while (!frontier.empty()) {
+    std::pop_heap(frontier.begin(), frontier.end(), nearerFirst);
+    Candidate current = frontier.back();
+    frontier.pop_back();
+    if (found->size() >= ef && current.distance > found->front().distance) {
+      break;
+    }
+
+    uint32_t* count;
+    uint32_t* links = _links(current.node, level, &count);
+    for (uint32_t i = 0; i < *count; i++) {
+      uint32_t next = links[i];
+      if (_visited[next] == _visitEpoch) {
+        continue;
+      }
+      _visited[next] = _visitEpoch;
+
+      Candidate candidate;
+      candidate.node = next;
+      candidate.distance = _distance(query, _descriptor(next));
+      if (found->size() < ef || candidate.distance < found->front().distance) {
+        frontier.push_back(candidate);
+        std::push_heap(frontier.begin(), frontier.end(), nearerFirst);
+        found->push_back(candidate);
+        std::push_heap(found->begin(), found->end(), fartherFirst);
+        if (found->size() > ef) {
+          std::pop_heap(found->begin(), found->end(), fartherFirst);
+          found->pop_back();
+        }
+      }
+    }
+  }
+}
+
+// Neighbour selection heuristic: keep a candidate only if it is closer to
+// the base node than to every neighbour already kept, which spreads links
+// across clusters instead of spending them all inside one
+void FingerPrintGraphIndex::_selectNeighbours(std::vector<Candidate>* candidates, uint16_t maxLinks) const {
+  std::sort(candidates->begin(), candidates->end(), fartherFirst);
+  std::vector<Candidate> selected;
+  for (size_t i = 0; i < candidates->size() && selected.size() < maxLinks; i++) {
+    const Candidate& c = (*candidates)[i];
+    bool keep = true;
+    for (size_t j = 0; j < selected.size(); j++) {
+      if (_distance(_descriptor(c.node), _descriptor(selected[j].node)) < c.distance) {
+        keep = false;
+        break;
+      }
+    }
+    if (keep) {
+      selected.push_back(c);
+    }
+  }
+  candidates->swap(selected);
+}
+
+// Add a back link, re-selecting the neighbour's links when it is full
+void FingerPrintGraphIndex::_connect(uint32_t node, uint32_t neighbour, uint8_t level) {
+  uint16_t maxLinks = level == 0 ? _maxLinks0 : _m;
+  uint32_t* count;
+  uint32_t* links = _links(node, level, &count);
+  if (*count < maxLinks) {
+    links[(*count)++] = neighbour;
+    return;
+  }
+
+  const uint8_t* base = _descriptor(node);
+  std::vector<Candidate> candidates;
+  for (uint32_t i = 0; i <= *count; i++) {
+    Candidate c;
+    c.node = i < *count ? links[i] : neighbour;
+    c.distance = _distance(base, _descriptor(c.node));
+    candidates.push_back(c);
+  }
+  _selectNeighbours(&candidates, maxLinks);
+  *count = candidates.size();
+  for (size_t i = 0; i < candidates.size(); i++) {
+    links[i] = candidates[i].node;
+  }
+}
+
+// Insert one gallery record. Returns false if it is removed or does not decode.
+bool FingerPrintGraphIndex::add(const FingerPrintGallery& gallery, size_t index) {
+  FingerPrintFeatures features;
+  if (index >= gallery.size() || !gallery.at(index).active ||
+      !FingerPrintMatcher::decode(gallery.at(index).data, &features)) {
+    return false;
+  }
+  if (!_reserve(_count + 1)) {
+    return false;
+  }
+
+  const uint32_t id = _count;
+  const uint8_t level = _randomLevel();
+  uint8_t* node = _node(id);
+  memset(node, 0, _nodeSize);
+  uint64_t record = index;
+  memcpy(node, &record, sizeof(record));
+  node[NODE_LEVEL] = level;
+  FingerPrintMatcher::describe(features, node + NODE_LINKS + 4 * _maxLinks0);
+  _upperLinks.push_back(std::vector<uint32_t>((size_t)level * (1 + _m), 0));
+
+  if (_entryPoint < 0) {
+    _entryPoint = id;
+    _topLevel = level;
+    _count++;
+    return true;
+  }
+
+  // Greedy descent through the levels above the new node's top
+  const uint8_t* query = _descriptor(id);
+  uint32_t current = _entryPoint;
+  uint32_t currentDistance = _distance(query, _descriptor(current));
+  for (int l = _topLevel; l > level; l--) {
+    bool moved = true;
+    while (moved) {
+      moved = false;
+      uint32_t* count;
+      uint32_t* links = _links(current, l, &count);
+      for (uint32_t i = 0; i < *count; i++) {
+        uint32_t d = _distance(query, _descriptor(links[i]));
+        if (d < currentDistance) {
+          currentDistance = d;
+          current = links[i];
+          moved = true;
+        }
+      }
+    }
+  }
+
+  std::vector<Candidate> found;
+  for (int l = level < _topLevel ? level : _topLevel; l >= 0; l--) {
+    _searchLayer(query, current, _efConstruction, l, &found);
+    uint32_t closest = found.front().node;
+    uint32_t closestDistance = found.front().distance;
+    for (size_t i = 0; i < found.size(); i++) {
+      if (found[i].distance < closestDistance) {
+        closestDistance = found[i].distance;
+        closest = found[i].node;
+      }
+    }
+
+    _selectNeighbours(&found, l == 0 ? _maxLinks0 : _m);
+    uint32_t* count;
+    uint32_t* links = _links(id, l, &count);
+    *count = found.size();
+    for (size_t i = 0; i < found.size(); i++) {
+      links[i] = found[i].node;
+      _connect(found[i].node, id, l);
+    }
+    current = closest;
+  }
+
+  if (level > _topLevel) {
+    _topLevel = level;
+    _entryPoint = id;
+  }
+  _count++;
+  return true;
+}
+
+// Insert every gallery record added since the last sync
+size_t FingerPrintGraphIndex::sync(const FingerPrintGallery& gallery) {
+  size_t added = 0;
+  for (; _covered < gallery.size(); _covered++) {
+    if (add(gallery, _covered)) {
+      added++;
+    }
+  }
+  return added;
+}
+
+size_t FingerPrintGraphIndex::search(const FingerPrintFeatures& probe, size_t k, float maxDistance,
+                                     std::vector<Result>* results) const {
+  results->clear();
+  _distanceCount = 0;
+  if (_entryPoint < 0 || k == 0) {
+    return 0;
+  }
+
+  uint8_t query[FingerPrintMatcher::DESCRIPTOR_SIZE];
+  FingerPrintMatcher::describe(probe, query);
+
+  uint32_t current = _entryPoint;
+  uint32_t currentDistance = _distance(query, _descriptor(current));
+  for (int l = _topLevel; l > 0; l--) {
+    bool moved = true;
+    while (moved) {
+      moved = false;
+      uint32_t* count;
+      uint32_t* links = _links(current, l, &count);
+      for (uint32_t i = 0; i < *count; i++) {
+        uint32_t d = _distance(query, _descriptor(links[i]));
+        if (d < currentDistance) {
+          currentDistance = d;
+          current = links[i];
+          moved = true;
+        }
+      }
+    }
+  }
+
+  std::vector<Candidate> found;
+  _searchLayer(query, current, _efSearch > k ? _efSearch : k, 0, &found);
+  std::sort(found.begin(), found.end(), fartherFirst);
+
+  // Descriptors have norm 255, so 255 * sqrt(2) bounds their distance
+  const float scale = 1.0f / (255.0f * 1.41421356f);
+  for (size_t i = 0; i < found.size() && results->size() < k; i++) {
+    Result result;
+    result.index = _record(found[i].node);
+    result.distance = sqrtf((float)found[i].distance) * scale;
+    if (result.distance > maxDistance) {
+      break;
+    }
+    results->push_back(result);
+  }
+  return results->size();
+}
+
+bool FingerPrintGraphIndex::save(const char* path) const {
+  FILE* file = fopen(path, "wb");
+  if (!file) {
+    return false;
+  }
+
+  uint8_t header[FILE_HEADER_SIZE] = {0};
+  GraphFileHeader fields;
+  memcpy(fields.magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+  fields.m = _m;
+  fields.maxLinks0 = _maxLinks0;
+  fields.nodeSize = _nodeSize;
+  fields.entryPoint = _entryPoint;
+  fields.topLevel = _topLevel;
+  fields.reserved = 0;
+  fields.count = _count;
+  fields.covered = _covered;
+  memcpy(header, &fields, sizeof(fields));
+
+  bool ok = fwrite(header, 1, sizeof(header), file) == sizeof(header);
+  if (ok && _count) {
+    ok = fwrite(_nodes, _nodeSize, _count, file) == _count;
+  }
+  for (size_t i = 0; ok && i < _count; i++) {
+    const std::vector<uint32_t>& upper = _upperLinks[i];
+    if (!upper.empty()) {
+      ok = fwrite(&upper[0], sizeof(uint32_t), upper.size(), file) == upper.size();
+    }
+  }
+  return fclose(file) == 0 && ok;
+}
+
+// Checks a loaded graph before search() trusts it: levels within the top
+// level, the entry point on it, and every link in range and pointing at a
+// node that has the link's level
+bool FingerPrintGraphIndex::_consistent() const {
+  if (_count && _level(_entryPoint) != _topLevel) {
+    return false;
+  }
+  for (uint32_t node = 0; node < _count; node++) {
+    uint8_t level = _level(node);
+    if (level > _topLevel) {
+      return false;
+    }
+    for (uint8_t l = 0; l <= level; l++) {
+      uint32_t* count;
+      const uint32_t* links = _links(node, l, &count);
+      if (*count > (l == 0 ? _maxLinks0 : _m)) {
+        return false;
+      }
+      for (uint32_t i = 0; i < *count; i++) {
+        if (links[i] >= _count || _level(links[i]) < l) {
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+// Load a saved index. On Linux the node block is mapped copy-on-write, so a
+// large index is usable at once and pages in on demand.
+bool FingerPrintGraphIndex::load(const char* path) {
+  _release();
+
+  GraphFileHeader fields;
+  uint8_t* base = nullptr;
+  size_t size = 0;
+#if defined(__linux__)
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < FILE_HEADER_SIZE) {
+    close(fd);
+    return false;
+  }
+  size = st.st_size;
+  void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return false;
+  }
+  base = (uint8_t*)mapping;
+#else
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    return false;
+  }
+  fseek(file, 0, SEEK_END);
+  size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  base = (uint8_t*)malloc(size);
+  if (!base || fread(base, 1, size, file) != size) {
+    free(base);
+    fclose(file);
+    return false;
+  }
+  fclose(file);
+#endif
+
+  memcpy(&fields, base, sizeof(fields));
+  bool ok = size >= FILE_HEADER_SIZE && memcmp(fields.magic, FILE_MAGIC, sizeof(FILE_MAGIC)) == 0 &&
+            fields.m >= 2 && fields.maxLinks0 == 2 * fields.m &&
+            fields.nodeSize == NODE_LINKS + 4 * fields.maxLinks0 + FingerPrintMatcher::DESCRIPTOR_SIZE &&
+            fields.count <= (size - FILE_HEADER_SIZE) / fields.nodeSize && fields.count <= UINT32_MAX &&
+            fields.topLevel <= MAX_LEVEL &&
+            (fields.count ? fields.entryPoint >= 0 && (uint64_t)fields.entryPoint < fields.count
+                          : fields.entryPoint == -1);
+  if (!ok) {
+#if defined(__linux__)
+    munmap(base, size);
+#else
+    free(base);
+#endif
+    return false;
+  }
+
+  _m = fields.m;
+  _maxLinks0 = fields.maxLinks0;
+  _nodeSize = fields.nodeSize;
+  _entryPoint = fields.entryPoint;
+  _topLevel = fields.topLevel;
+  _count = fields.count;
+  _capacity = fields.count;
+  _covered = fields.covered;
+#if defined(__linux__)
+  _nodes = base + FILE_HEADER_SIZE;
+  _mapping = base;
+  _mappingSize = size;
+#else
+  _nodes = (uint8_t*)malloc(_count * _nodeSize);
+  if (_count && !_nodes) {
+    free(base);
+    _count = 0;
+    _capacity = 0;
+    return false;
+  }
+  memcpy(_nodes, base + FILE_HEADER_SIZE, _count * _nodeSize);
+#endif
+
+  const uint32_t* upper = (const uint32_t*)(base + FILE_HEADER_SIZE + _count * _nodeSize);
+  const uint32_t* end = (const uint32_t*)(base + size);
+  _upperLinks.resize(_count);
+  ok = true;
+  for (size_t i = 0; ok && i < _count; i++) {
+    size_t words = (size_t)_level(i) * (1 + _m);
+    if (upper + words > end) {
+      ok = false;
+      break;
+    }
+    _upperLinks[i].assign(upper, upper + words);
+    upper += words;
+  }
+#if !defined(__linux__)
+  free(base);
+#endif
+  if (!ok || !_consistent()) {
+    _release();
+    return false;
+  }
+  _visited.assign(_capacity, 0);
+  return true;
+}
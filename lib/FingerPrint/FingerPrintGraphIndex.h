@@ -0,0 +1,80 @@
+#ifndef FINGERPRINT_GRAPH_INDEX_H
+#define FINGERPRINT_GRAPH_INDEX_H
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "FingerPrintIndex.h"
+
+// Hierarchical navigable small-world graph over template descriptors
+// (FingerPrintMatcher::describe()), for galleries too large to scan or to
+// keep in a tree. Records are inserted one at a time as the gallery grows;
+// search effort, and with it recall, is set by setSearchEffort().
+//
+// Layer 0 and the descriptors live in one flat block of fixed-size nodes,
+// which load() maps straight from the saved file on Linux. Upper layers hold
+// roughly one node in M and are kept on the heap.
+//
+// search() reuses internal scratch space: one search at a time per index.
+class FingerPrintGraphIndex : public FingerPrintIndex {
+  public:
+    struct Candidate {
+      uint32_t distance;  // squared L2 between descriptors
+      uint32_t node;
+    };
+
+    FingerPrintGraphIndex(uint16_t m = 16, uint16_t efConstruction = 100);
+    ~FingerPrintGraphIndex();
+
+    bool add(const FingerPrintGallery& gallery, size_t index);
+    size_t sync(const FingerPrintGallery& gallery);
+    void setSearchEffort(uint16_t ef);
+
+    size_t search(const FingerPrintFeatures& probe, size_t k, float maxDistance,
+                  std::vector<Result>* results) const;
+    size_t size() const;
+    size_t coveredRecords() const;
+    size_t lastDistanceCount() const;
+
+    bool save(const char* path) const;
+    bool load(const char* path);
+    void clear();
+  private:
+    uint16_t _m;
+    uint16_t _maxLinks0;
+    uint16_t _efConstruction;
+    uint16_t _efSearch;
+    size_t _nodeSize;
+
+    uint8_t* _nodes;           // heap buffer or file mapping
+    size_t _count;
+    size_t _capacity;
+    void* _mapping;            // non-null while _nodes points into a mapping
+    size_t _mappingSize;
+
+    std::vector<std::vector<uint32_t> > _upperLinks;  // per node, levels 1..top, _m slots each
+    int32_t _entryPoint;
+    uint8_t _topLevel;
+    size_t _covered;
+    uint32_t _seed;
+
+    mutable std::vector<uint32_t> _visited;
+    mutable uint32_t _visitEpoch;
+    mutable size_t _distanceCount;
+
+    uint8_t* _node(uint32_t node) const;
+    uint8_t _level(uint32_t node) const;
+    uint64_t _record(uint32_t node) const;
+    const uint8_t* _descriptor(uint32_t node) const;
+    uint32_t* _links(uint32_t node, uint8_t level, uint32_t** count) const;
+    uint32_t _distance(const uint8_t* a, const uint8_t* b) const;
+
+    bool _reserve(size_t capacity);
+    void _release();
+    uint8_t _randomLevel();
+    void _searchLayer(const uint8_t* query, uint32_t entry, uint16_t ef, uint8_t level,
+                      std::vector<Candidate>* found) const;
+    void _selectNeighbours(std::vector<Candidate>* candidates, uint16_t maxLinks) const;
+    void _connect(uint32_t node, uint32_t neighbour, uint8_t level);
+    bool _consistent() const;
+};
+#endif // FINGERPRINT_GRAPH_INDEX_H
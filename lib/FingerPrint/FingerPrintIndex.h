@@ -0,0 +1,28 @@
+#ifndef FINGERPRINT_INDEX_H
+#define FINGERPRINT_INDEX_H
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "FingerPrintGallery.h"
+#include "FingerPrintMatcher.h"
+
+// Host-side index that shortlists gallery records close to a probe, so only
+// a few of them need an exact comparison. Distances are in [0, 1].
+class FingerPrintIndex {
+  public:
+    struct Result {
+      size_t index;    // gallery record index
+      float distance;
+    };
+
+    virtual ~FingerPrintIndex() {}
+    // k nearest records within maxDistance, closest first
+    virtual size_t search(const FingerPrintFeatures& probe, size_t k, float maxDistance,
+                          std::vector<Result>* results) const = 0;
+    virtual size_t size() const = 0;
+    // Gallery records [0, coveredRecords()) have been considered for the index
+    virtual size_t coveredRecords() const = 0;
+    // Distance evaluations in the last search
+    virtual size_t lastDistanceCount() const = 0;
+};
+#endif // FINGERPRINT_INDEX_H
@@ -0,0 +1,373 @@
+#include "FingerPrintIso.h"
+#include <cstring>
+
+// Record layouts, big endian:
+//   ISO:  "FMR\0" " 20\0" length u32 | equipment u16 | width u16 | height u16 |
+//         xres u16 | yres u16 | views u8 | 0 u8                        (24 bytes)
+//   ANSI: "FMR\0" " 20\0" length u16 [0 then length u32 when over 64 KB] |
+//         CBEFF product u32 | equipment u16 | width u16 | height u16 |
+//         xres u16 | yres u16 | views u8 | 0 u8                        (26 or 30)
+// then for each view:
+//   position u8 | view:4 impression:4 | quality u8 | count u8 |
+//   count * (type:2 x:14 | 0:2 y:14 | angle u8 | quality u8) |
+//   extended length u16 | extended data
+static const uint8_t MAGIC[8] = {'F', 'M', 'R', 0, ' ', '2', '0', 0};
+static const uint8_t VIEW_HEADER_SIZE = 4;
+static const uint8_t MINUTIA_SIZE = 6;
+static const uint8_t TYPE_OTHER = 0;
+static const uint8_t TYPE_LIMIT = 3;       // reserved in both standards
+static const uint8_t LAST_FINGER = 10;     // left little finger
+static const uint8_t QUALITY_LEVELS = 16;  // sensor minutia quality 0-15
+
+static void put16(uint8_t* p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v & 0xFF;
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = (v >> 16) & 0xFF;
+  p[2] = (v >> 8) & 0xFF;
+  p[3] = v & 0xFF;
+}
+
+static uint16_t get16(const uint8_t* p) {
+  return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const uint8_t* p) {
+  return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// Offset of the width field; views count and first view follow at fixed
+// distances from it
+static size_t geometryOffset(const uint8_t* record, FingerPrintIso::Format format) {
+  if (format == FingerPrintIso::FORMAT_ISO) {
+    return 14;
+  }
+  return get16(record + 8) == 0 ? 20 : 16;
+}
+
+static uint8_t qualityToStandard(uint8_t quality) {
+  return (quality * 100 + 7) / 15;
+}
+
+static uint8_t qualityFromStandard(uint8_t quality) {
+  uint16_t q = (quality * 15 + 50) / 100;
+  return q < QUALITY_LEVELS ? q : QUALITY_LEVELS - 1;
+}
+
+// 256 units per turn to 2-degree ANSI steps and back, both rounded
+static uint8_t angleToAnsi(uint8_t angle) {
+  return ((angle * 45 + 32) / 64) % 180;
+}
+
+static uint8_t angleFromAnsi(uint8_t angle) {
+  return (uint8_t)((angle * 64 + 22) / 45);
+}
+
+size_t FingerPrintIso::recordSize(const uint8_t* header, size_t available, Format format) {
+  size_t needed = format == FORMAT_ISO ? 12 : 10;
+  if (available < needed) {
+    return 0;
+  }
+  if (memcmp(header, MAGIC, sizeof(MAGIC)) != 0) {
+    return NOT_A_RECORD;
+  }
+  size_t size = 0;
+  size_t minimum = 24;
+  if (format == FORMAT_ISO) {
+    size = get32(header + 8);
+  } else if (get16(header + 8) != 0) {
+    size = get16(header + 8);
+    minimum = 26;
+  } else {
+    if (available < 14) {
+      return 0;
+    }
+    size = get32(header + 10);
+    minimum = 30;
+  }
+  return size < minimum ? NOT_A_RECORD : size;
+}
+
+uint8_t FingerPrintIso::viewCount(const uint8_t* record, size_t size, Format format) {
+  size_t views = geometryOffset(record, format) + 8;
+  return size > views ? record[views] : 0;
+}
+
+size_t FingerPrintIso::encode(const FingerPrintFeatures& features, uint8_t finger, Format format, uint8_t* record,
+                              size_t capacity) {
+  const uint8_t count = features.count;
+  const size_t header = format == FORMAT_ISO ? 24 : 26;
+  const size_t size = header + VIEW_HEADER_SIZE + count * MINUTIA_SIZE + 2;
+  if (capacity < size) {
+    return 0;
+  }
+
+  memset(record, 0, header);
+  memcpy(record, MAGIC, sizeof(MAGIC));
+  uint8_t* geometry = record + 14;
+  if (format == FORMAT_ISO) {
+    put32(record + 8, size);
+  } else {
+    put16(record + 8, size);  // CBEFF product and equipment left 0: unreported
+    geometry = record + 16;
+  }
+  put16(geometry, FingerPrintMatcher::IMAGE_WIDTH);
+  put16(geometry + 2, FingerPrintMatcher::IMAGE_HEIGHT);
+  put16(geometry + 4, RESOLUTION);
+  put16(geometry + 6, RESOLUTION);
+  geometry[8] = 1;
+
+  uint8_t* view = record + header;
+  uint32_t qualitySum = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    const FingerPrintMinutia& m = features.minutiae[i];
+    uint8_t* p = view + VIEW_HEADER_SIZE + i * MINUTIA_SIZE;
+    put16(p, ((m.type & 0x03) << 14) | (m.x & 0x3FFF));
+    put16(p + 2, m.y & 0x3FFF);
+    p[4] = format == FORMAT_ISO ? m.angle : angleToAnsi(m.angle);
+    p[5] = qualityToStandard(m.quality);
+    qualitySum += p[5];
+  }
+  view[0] = finger < LAST_FINGER ? finger + 1 : 0;
+  view[1] = 0;  // first view, live-scan plain impression
+  view[2] = count ? qualitySum / count : 0;
+  view[3] = count;
+  put16(view + VIEW_HEADER_SIZE + count * MINUTIA_SIZE, 0);  // no extended data
+  return size;
+}
+
+// Three passes over the view's minutiae, so nothing is buffered: the
+// bounding box for centring, a quality histogram of what falls in the frame,
+// then the minutiae of the best qualities that fit in 62
+bool FingerPrintIso::decode(const uint8_t* record, size_t size, Format format, uint8_t view,
+                            FingerPrintFeatures* features, uint8_t* finger) {
+  features->count = 0;
+  *finger = UNKNOWN_FINGER;
+  const size_t geometry = geometryOffset(record, format);
+  if (size < geometry + 10 || view >= record[geometry + 8]) {
+    return false;
+  }
+
+  // Walk to the requested view
+  size_t offset = geometry + 10;
+  for (uint8_t v = 0;; v++) {
+    if (offset + VIEW_HEADER_SIZE > size) {
+      return false;
+    }
+    size_t extended = offset + VIEW_HEADER_SIZE + record[offset + 3] * MINUTIA_SIZE;
+    if (extended + 2 > size) {
+      return false;
+    }
+    if (v == view) {
+      break;
+    }
+    offset = extended + 2 + get16(record + extended);
+  }
+
+  const uint8_t* header = record + offset;
+  const uint8_t* minutiae = header + VIEW_HEADER_SIZE;
+  const uint8_t count = header[3];
+  if (header[0] >= 1 && header[0] <= LAST_FINGER) {
+    *finger = header[0] - 1;
+  }
+
+  uint32_t width = get16(record + geometry);
+  uint32_t height = get16(record + geometry + 2);
+  uint32_t xres = get16(record + geometry + 4);
+  uint32_t yres = get16(record + geometry + 6);
+  xres = xres ? xres : RESOLUTION;
+  yres = yres ? yres : RESOLUTION;
+  const bool scaled = xres != RESOLUTION || yres != RESOLUTION;
+  width = width * RESOLUTION / xres;
+  height = height * RESOLUTION / yres;
+
+  auto position = [&](const uint8_t* p, int32_t* x, int32_t* y) {
+    *x = get16(p) & 0x3FFF;
+    *y = get16(p + 2) & 0x3FFF;
+    if (scaled) {
+      *x = (*x * RESOLUTION + xres / 2) / xres;
+      *y = (*y * RESOLUTION + yres / 2) / yres;
+    }
+  };
+  auto usable = [](const uint8_t* p) {
+    uint8_t type = p[0] >> 6;
+    return type != TYPE_OTHER && type != TYPE_LIMIT;
+  };
+
+  int32_t minX = INT32_MAX, minY = INT32_MAX, maxX = INT32_MIN, maxY = INT32_MIN;
+  int32_t x, y;
+  for (uint8_t i = 0; i < count; i++) {
+    const uint8_t* p = minutiae + i * MINUTIA_SIZE;
+    if (usable(p)) {
+      position(p, &x, &y);
+      minX = x < minX ? x : minX;
+      maxX = x > maxX ? x : maxX;
+      minY = y < minY ? y : minY;
+      maxY = y > maxY ? y : maxY;
+    }
+  }
+  int32_t shiftX = 0;
+  int32_t shiftY = 0;
+  if (minX <= maxX && (width > FingerPrintMatcher::IMAGE_WIDTH || height > FingerPrintMatcher::IMAGE_HEIGHT)) {
+    shiftX = FingerPrintMatcher::IMAGE_WIDTH / 2 - (minX + maxX) / 2;
+    shiftY = FingerPrintMatcher::IMAGE_HEIGHT / 2 - (minY + maxY) / 2;
+  }
+  auto inFrame = [&](const uint8_t* p) {
+    position(p, &x, &y);
+    x += shiftX;
+    y += shiftY;
+    return usable(p) && x >= 0 && y >= 0 && x < FingerPrintMatcher::IMAGE_WIDTH &&
+           y < FingerPrintMatcher::IMAGE_HEIGHT;
+  };
+
+  uint16_t histogram[QUALITY_LEVELS] = {0};
+  for (uint8_t i = 0; i < count; i++) {
+    const uint8_t* p = minutiae + i * MINUTIA_SIZE;
+    if (inFrame(p)) {
+      histogram[qualityFromStandard(p[5])]++;
+    }
+  }
+  // Lowest quality kept, and how many of that quality still fit
+  uint8_t floor = 0;
+  uint16_t room = FingerPrintFeatures::MAX_MINUTIAE;
+  uint16_t kept = 0;
+  for (uint8_t q = QUALITY_LEVELS; q-- > 0;) {
+    if (kept + histogram[q] > FingerPrintFeatures::MAX_MINUTIAE) {
+      floor = q;
+      room = FingerPrintFeatures::MAX_MINUTIAE - kept;
+      break;
+    }
+    kept += histogram[q];
+  }
+
+  for (uint8_t i = 0; i < count; i++) {
+    const uint8_t* p = minutiae + i * MINUTIA_SIZE;
+    uint8_t quality = qualityFromStandard(p[5]);
+    if (quality < floor || !inFrame(p)) {
+      continue;
+    }
+    if (quality == floor) {
+      if (room == 0) {
+        continue;
+      }
+      room--;
+    }
+    FingerPrintMinutia& m = features->minutiae[features->count++];
+    m.x = x;
+    m.y = y;
+    m.angle = format == FORMAT_ISO ? p[4] : angleFromAnsi(p[4]);
+    m.type = p[0] >> 6;
+    m.quality = quality;
+  }
+  return features->count > 0;
+}
+
+size_t FingerPrintIso::exportGallery(const FingerPrintGallery& gallery, Format format, RecordSink sink,
+                                     void* context) {
+  FingerPrintFeatures features;
+  uint8_t record[MAX_RECORD_SIZE];
+  size_t written = 0;
+  for (size_t i = 0; i < gallery.size(); i++) {
+    const FingerPrintGallery::Record& entry = gallery.at(i);
+    if (!entry.active || !FingerPrintMatcher::decode(entry.data, &features)) {
+      continue;
+    }
+    size_t size = encode(features, entry.finger, format, record, sizeof(record));
+    if (!sink(entry.userId, record, size, context)) {
+      break;
+    }
+    written++;
+  }
+  return written;
+}
+
+FingerPrintIsoReader::FingerPrintIsoReader(FingerPrintIso::Format format, ViewHandler handler, void* context) {
+  _format = format;
+  _handler = handler;
+  _context = context;
+  _records = 0;
+  _views = 0;
+  _skipped = 0;
+  _failed = false;
+}
+
+bool FingerPrintIsoReader::complete() const {
+  return _pending.empty() && !_failed;
+}
+
+size_t FingerPrintIsoReader::records() const {
+  return _records;
+}
+
+size_t FingerPrintIsoReader::views() const {
+  return _views;
+}
+
+size_t FingerPrintIsoReader::skipped() const {
+  return _skipped;
+}
+
+bool FingerPrintIsoReader::_deliver(const uint8_t* record, size_t size) {
+  FingerPrintFeatures features;
+  uint8_t finger = FingerPrintIso::UNKNOWN_FINGER;
+  uint8_t views = FingerPrintIso::viewCount(record, size, _format);
+  for (uint8_t v = 0; v < views; v++) {
+    if (!FingerPrintIso::decode(record, size, _format, v, &features, &finger)) {
+      _skipped++;
+      continue;
+    }
+    _views++;
+    if (!_handler(features, finger, _records, _context)) {
+      _records++;
+      return false;
+    }
+  }
+  _records++;
+  return true;
+}
+
+bool FingerPrintIsoReader::feed(const uint8_t* data, size_t size) {
+  while (!_failed) {
+    // Finish a record left over from the last chunk
+    if (!_pending.empty()) {
+      size_t total = FingerPrintIso::recordSize(&_pending[0], _pending.size(), _format);
+      if (total == FingerPrintIso::NOT_A_RECORD || (total && total > MAX_STREAM_RECORD)) {
+        _failed = true;
+        break;
+      }
+      size_t wanted = total ? total : FingerPrintIso::HEADER_PEEK;
+      size_t take = wanted - _pending.size() < size ? wanted - _pending.size() : size;
+      _pending.insert(_pending.end(), data, data + take);
+      data += take;
+      size -= take;
+      if (_pending.size() < wanted) {
+        return true;
+      }
+      if (total) {
+        _failed = !_deliver(&_pending[0], total);
+        _pending.clear();
+      }
+      continue;
+    }
+
+    if (size == 0) {
+      return true;
+    }
+    size_t total = FingerPrintIso::recordSize(data, size, _format);
+    if (total == FingerPrintIso::NOT_A_RECORD || (total && total > MAX_STREAM_RECORD)) {
+      _failed = true;
+      break;
+    }
+    if (total == 0 || total > size) {
+      _pending.assign(data, data + size);
+      return true;
+    }
+    _failed = !_deliver(data, total);
+    data += total;
+    size -= total;
+  }
+  return false;
+}
@@ -0,0 +1,81 @@
+#ifndef FINGERPRINT_ISO_H
+#define FINGERPRINT_ISO_H
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "FingerPrintGallery.h"
+#include "FingerPrintMatcher.h"
+
+// Standard finger minutiae records, ISO/IEC 19794-2:2005 and ANSI INCITS
+// 378-2004, for galleries shared with other matching engines. Only the
+// minutiae of the sensor template have a standard form: position, angle,
+// type and quality. A template rebuilt from a record with
+// FingerPrintMatcher::encode() scores the same on the host matcher, but is
+// not meant for upload to the sensor.
+//
+// Angles keep the sensor's 256 units per turn, the ISO unit; ANSI uses 2
+// degrees, so an ANSI round trip moves angles by up to one unit. Quality
+// 0-15 maps to 0-100. Records from other devices are scaled to the sensor's
+// 500 dpi and, when their image is larger than the sensor frame, centred on
+// it. Minutiae still outside the frame, or of type "other", are dropped.
+// When more than 62 remain, the best-quality ones are kept.
+class FingerPrintIso {
+  public:
+    enum Format : uint8_t {
+      FORMAT_ISO = 0,    // ISO/IEC 19794-2:2005
+      FORMAT_ANSI = 1,   // ANSI INCITS 378-2004
+    };
+
+    static const uint16_t RESOLUTION = 197;       // pixels per cm, 500 dpi
+    static const uint8_t UNKNOWN_FINGER = 0xFF;   // finger position 0, "unknown"
+    static const size_t MAX_RECORD_SIZE = 26 + 4 + 6 * FingerPrintFeatures::MAX_MINUTIAE + 2;  // encode() output
+    static const size_t HEADER_PEEK = 14;         // bytes recordSize() needs at most
+    static const size_t NOT_A_RECORD = (size_t)-1;
+
+    // One finger view. finger is the gallery's 0-9, or UNKNOWN_FINGER.
+    // Returns the record size, 0 when capacity is too small.
+    static size_t encode(const FingerPrintFeatures& features, uint8_t finger, Format format, uint8_t* record,
+                         size_t capacity);
+    static bool decode(const uint8_t* record, size_t size, Format format, uint8_t view,
+                       FingerPrintFeatures* features, uint8_t* finger);
+    static uint8_t viewCount(const uint8_t* record, size_t size, Format format);
+    // Total size from the start of a record: 0 until HEADER_PEEK bytes (fewer
+    // for most records) are available, NOT_A_RECORD for anything else
+    static size_t recordSize(const uint8_t* header, size_t available, Format format);
+
+    // Every active record of a gallery, one record each, in gallery order.
+    // Records the sensor decoder cannot read are skipped. Returns the number
+    // passed to sink, which can stop the export by returning false.
+    typedef bool (*RecordSink)(uint32_t userId, const uint8_t* record, size_t size, void* context);
+    static size_t exportGallery(const FingerPrintGallery& gallery, Format format, RecordSink sink, void* context);
+};
+
+// Reads a stream of concatenated records in chunks of any size and hands
+// every finger view to a handler as decoded features. Complete records are
+// parsed in place; only one straddling two chunks is copied.
+class FingerPrintIsoReader {
+  public:
+    // record counts from 0 in the stream; return false to stop
+    typedef bool (*ViewHandler)(const FingerPrintFeatures& features, uint8_t finger, size_t record, void* context);
+
+    FingerPrintIsoReader(FingerPrintIso::Format format, ViewHandler handler, void* context);
+    bool feed(const uint8_t* data, size_t size);  // false after a malformed record or a stop
+    bool complete() const;    // no partial record left over
+    size_t records() const;
+    size_t views() const;     // passed to the handler
+    size_t skipped() const;   // views without a usable minutia
+  private:
+    static const size_t MAX_STREAM_RECORD = 1 << 20;  // larger lengths are taken as corruption
+
+    FingerPrintIso::Format _format;
+    ViewHandler _handler;
+    void* _context;
+    std::vector<uint8_t> _pending;
+    size_t _records;
+    size_t _views;
+    size_t _skipped;
+    bool _failed;
+
+    bool _deliver(const uint8_t* record, size_t size);
+};
+#endif // FINGERPRINT_ISO_H
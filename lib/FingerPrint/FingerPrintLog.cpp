@@ -0,0 +1,310 @@
+#include "FingerPrintLog.h"
+#include <cstdio>
+
+#if defined(ESP_PLATFORM)
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <time.h>
+#else
+#include <chrono>
+#endif
+
+static const uint32_t DRAIN_INTERVAL_MS = 10;  // background task sleep between drains
+
+static uint32_t nowUs() {
+#if defined(ESP_PLATFORM)
+  return (uint32_t)esp_timer_get_time();
+#elif defined(__linux__)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+#else
+  return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+static void stdoutSink(const char* line, void*) {
+  fputs(line, stdout);
+}
+
+// Format one entry the way printf would have at the call site. Each
+// conversion is handed to snprintf on its own, with the captured argument
+// read back as the type its length modifier and conversion call for.
+static size_t formatEntry(char* out, size_t size, const char* format, const uint64_t* args, uint8_t count) {
+  size_t used = 0;
+  uint8_t next = 0;
+  const char* p = format;
+  while (*p && used + 1 < size) {
+    if (*p != '%') {
+      out[used++] = *p++;
+      continue;
+    }
+    if (p[1] == '%') {
+      out[used++] = '%';
+      p += 2;
+      continue;
+    }
+
+    // Copy the conversion spec: flags, width, precision, length, conversion
+    char spec[16];
+    size_t s = 0;
+    spec[s++] = *p++;
+    while (*p && strchr("-+ #0123456789.", *p) && s < sizeof(spec) - 4) {
+      spec[s++] = *p++;
+    }
+    uint8_t longs = 0;
+    bool sized = false;
+    while (*p == 'l' || *p == 'h' || *p == 'z') {
+      longs += *p == 'l';
+      sized |= *p == 'z';
+      p++;
+    }
+    char conversion = *p ? *p++ : '\0';
+    if (longs == 1 || sized) {
+      spec[s++] = 'l';
+    } else if (longs > 1) {
+      spec[s++] = 'l';
+      spec[s++] = 'l';
+    }
+    spec[s++] = conversion;
+    spec[s] = '\0';
+
+    if (next >= count || !strchr("diuoxXcspfFeEgG", conversion) || conversion == '\0') {
+      used += snprintf(out + used, size - used, "%s", "<?>");
+      used = used < size ? used : size - 1;
+      continue;
+    }
+    uint64_t arg = args[next++];
+    int n;
+    switch (conversion) {
+      case 'd':
+      case 'i':
+        n = longs > 1 ? snprintf(out + used, size - used, spec, (long long)arg)
+          : longs == 1 || sized ? snprintf(out + used, size - used, spec, (long)arg)
+          : snprintf(out + used, size - used, spec, (int)arg);
+        break;
+      case 's':
+        n = snprintf(out + used, size - used, spec, arg ? (const char*)(uintptr_t)arg : "(null)");
+        break;
+      case 'p':
+        n = snprintf(out + used, size - used, spec, (void*)(uintptr_t)arg);
+        break;
+      case 'f':
+      case 'F':
+      case 'e':
+      case 'E':
+      case 'g':
+      case 'G': {
+        double value;
+        memcpy(&value, &arg, sizeof(value));
+        n = snprintf(out + used, size - used, spec, value);
+        break;
+      }
+      default:  // u o x X c
+        n = longs > 1 ? snprintf(out + used, size - used, spec, (unsigned long long)arg)
+          : longs == 1 || sized ? snprintf(out + used, size - used, spec, (unsigned long)arg)
+          : snprintf(out + used, size - used, spec, (unsigned)arg);
+        break;
+    }
+    if (n > 0) {
+      used += (size_t)n;
+    }
+    used = used < size ? used : size - 1;
+  }
+  out[used] = '\0';
+  return used;
+}
+
+FingerPrintLog::FingerPrintLog(uint16_t capacity) {
+  uint32_t slots = 2;
+  while (slots < capacity) {
+    slots <<= 1;
+  }
+  _entries = new Entry[slots];
+  for (uint32_t i = 0; i < slots; i++) {
+    _entries[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  _mask = slots - 1;
+  _head.store(0);
+  _tail = 0;
+  _dropped.store(0);
+  _written.store(0);
+  _droppedReported = 0;
+  _level.store(LEVEL_INFO);
+  _sink = stdoutSink;
+  _sinkContext = nullptr;
+  _running.store(false);
+  _task.store(nullptr);
+}
+
+FingerPrintLog::~FingerPrintLog() {
+  stop();
+  drain();
+  delete[] _entries;
+}
+
+void FingerPrintLog::setLevel(Level level) {
+  _level.store(level, std::memory_order_relaxed);
+}
+
+FingerPrintLog::Level FingerPrintLog::level() const {
+  return (Level)_level.load(std::memory_order_relaxed);
+}
+
+void FingerPrintLog::setSink(Sink sink, void* context) {
+  _sink = sink ? sink : stdoutSink;
+  _sinkContext = context;
+}
+
+uint32_t FingerPrintLog::dropped() const {
+  return _dropped.load(std::memory_order_relaxed);
+}
+
+uint32_t FingerPrintLog::written() const {
+  return _written.load(std::memory_order_relaxed);
+}
+
+// Bounded multi-producer queue: a writer claims a position by advancing
+// _head, fills the slot and publishes it by setting its sequence one past
+// the position. A slot whose sequence still trails the position has not
+// been drained yet, which means the ring is full.
+bool FingerPrintLog::_push(Level level, const char* format, const uint64_t* args, uint8_t count) {
+  uint32_t position = _head.load(std::memory_order_relaxed);
+  Entry* entry;
+  for (;;) {
+    entry = &_entries[position & _mask];
+    int32_t lag = (int32_t)(entry->sequence.load(std::memory_order_acquire) - position);
+    if (lag == 0) {
+      if (_head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (lag < 0) {
+      _dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    } else {
+      position = _head.load(std::memory_order_relaxed);
+    }
+  }
+
+  entry->timeUs = nowUs();
+  entry->format = format;
+  entry->level = level;
+  entry->count = count;
+  for (uint8_t i = 0; i < count; i++) {
+    entry->args[i] = args[i];
+  }
+  entry->sequence.store(position + 1, std::memory_order_release);
+  _written.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+void FingerPrintLog::_emit(const Entry& entry) {
+  char line[LINE_SIZE];
+  int prefix = snprintf(line, sizeof(line), "[%10lu] ", (unsigned long)entry.timeUs);
+  formatEntry(line + prefix, sizeof(line) - prefix, entry.format, entry.args, entry.count);
+  _sink(line, _sinkContext);
+}
+
+// Format and emit up to maxEntries waiting entries, oldest first. Only one
+// thread may drain at a time; the background task does when started.
+size_t FingerPrintLog::drain(size_t maxEntries) {
+  size_t emitted = 0;
+  while (emitted < maxEntries) {
+    Entry& entry = _entries[_tail & _mask];
+    if (entry.sequence.load(std::memory_order_acquire) != _tail + 1) {
+      break;
+    }
+    _emit(entry);
+    entry.sequence.store(_tail + _mask + 1, std::memory_order_release);
+    _tail++;
+    emitted++;
+  }
+
+  uint32_t dropped = _dropped.load(std::memory_order_relaxed);
+  if (dropped != _droppedReported) {
+    char line[64];
+    snprintf(line, sizeof(line), "[log] %lu entries dropped\n", (unsigned long)(dropped - _droppedReported));
+    _sink(line, _sinkContext);
+    _droppedReported = dropped;
+  }
+  return emitted;
+}
+
+void FingerPrintLog::_run(void* self) {
+  FingerPrintLog* log = (FingerPrintLog*)self;
+  while (log->_running.load()) {
+    log->drain();
+#if defined(ESP_PLATFORM)
+    vTaskDelay(pdMS_TO_TICKS(DRAIN_INTERVAL_MS));
+#elif defined(__linux__)
+    struct timespec pause = {0, (long)DRAIN_INTERVAL_MS * 1000000};
+    nanosleep(&pause, nullptr);
+#endif
+  }
+  log->drain();
+}
+
+// Drain in the background: a FreeRTOS task at the given priority on ESP32
+// (keep it below the sensor loop's), a thread on Linux. Elsewhere call
+// drain() from the application's idle time instead.
+bool FingerPrintLog::start(uint8_t priority, uint32_t stackBytes) {
+  if (_running.load()) {
+    return true;
+  }
+  _running.store(true);
+#if defined(ESP_PLATFORM)
+  TaskHandle_t handle = nullptr;
+  _task.store((void*)1);  // cleared by the task as it exits
+  if (xTaskCreate([](void* self) {
+        _run(self);
+        ((FingerPrintLog*)self)->_task.store(nullptr);
+        vTaskDelete(nullptr);
+      }, "fp_log", stackBytes, this, priority, &handle) != pdPASS) {
+    _task.store(nullptr);
+    _running.store(false);
+    return false;
+  }
+  return true;
+#elif defined(__linux__)
+  (void)priority;
+  (void)stackBytes;
+  pthread_t* thread = new pthread_t;
+  if (pthread_create(thread, nullptr, [](void* self) -> void* {
+        _run(self);
+        return nullptr;
+      }, this) != 0) {
+    delete thread;
+    _running.store(false);
+    return false;
+  }
+  _task.store(thread);
+  return true;
+#else
+  (void)priority;
+  (void)stackBytes;
+  _running.store(false);
+  return false;
+#endif
+}
+
+void FingerPrintLog::stop() {
+  if (!_running.load()) {
+    return;
+  }
+  _running.store(false);
+#if defined(ESP_PLATFORM)
+  // The task finishes its last drain and deletes itself
+  while (_task.load()) {
+    vTaskDelay(1);
+  }
+#elif defined(__linux__)
+  pthread_t* thread = (pthread_t*)_task.load();
+  pthread_join(*thread, nullptr);
+  delete thread;
+  _task.store(nullptr);
+#endif
+}
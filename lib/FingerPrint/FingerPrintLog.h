@@ -0,0 +1,103 @@
+#ifndef FINGERPRINT_LOG_H
+#define FINGERPRINT_LOG_H
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// Deferred-format logger for the transfer paths. write() only copies the
+// format pointer and up to MAX_ARGS arguments into a lock-free ring; a
+// low-priority task (or the application, through drain()) formats and emits
+// the entries later, so logging costs the sensor loop a few hundred
+// nanoseconds instead of a console write. When the ring is full, new entries
+// are dropped and counted rather than waited for.
+//
+// Formats are printf-style and must outlive the entry: string literals.
+// %s arguments are kept as pointers, so they must be literals too.
+// Supported conversions: d i u o x X c s p f F e E g G, with the usual
+// flags, width, precision and hh/h/l/ll/z length modifiers; not '*'.
+class FingerPrintLog {
+  public:
+    static const uint8_t MAX_ARGS = 6;
+    static const size_t LINE_SIZE = 160;  // longer lines are cut
+
+    enum Level : uint8_t {
+      LEVEL_OFF = 0,
+      LEVEL_ERROR = 1,
+      LEVEL_INFO = 2,
+      LEVEL_DEBUG = 3,   // per-packet transfer detail
+    };
+
+    // Receives each formatted line, newline included
+    typedef void (*Sink)(const char* line, void* context);
+
+    FingerPrintLog(uint16_t capacity = 64);  // rounded up to a power of two
+    ~FingerPrintLog();
+
+    void setLevel(Level level);
+    Level level() const;
+    void setSink(Sink sink, void* context);  // default: stdout
+    bool start(uint8_t priority = 1, uint32_t stackBytes = 3072);  // background drain
+    void stop();
+
+    template <typename... Args>
+    bool write(Level level, const char* format, Args... args) {
+      static_assert(sizeof...(Args) <= MAX_ARGS, "too many log arguments");
+      if (level > _level.load(std::memory_order_relaxed)) {
+        return false;
+      }
+      uint64_t packed[sizeof...(Args) + 1] = {_pack(args)...};
+      return _push(level, format, packed, sizeof...(Args));
+    }
+
+    size_t drain(size_t maxEntries = (size_t)-1);
+    uint32_t dropped() const;   // entries lost to a full ring
+    uint32_t written() const;   // entries accepted
+  private:
+    struct Entry {
+      std::atomic<uint32_t> sequence;  // ring position this slot holds, + 1 once filled
+      uint32_t timeUs;
+      const char* format;
+      uint8_t level;
+      uint8_t count;
+      uint64_t args[MAX_ARGS];
+    };
+
+    Entry* _entries;
+    uint32_t _mask;
+    std::atomic<uint32_t> _head;     // next position to claim
+    uint32_t _tail;                  // next position to read, drain side only
+    std::atomic<uint32_t> _dropped;
+    std::atomic<uint32_t> _written;
+    uint32_t _droppedReported;
+    std::atomic<uint8_t> _level;
+    Sink _sink;
+    void* _sinkContext;
+    std::atomic<bool> _running;
+    std::atomic<void*> _task;        // FreeRTOS task or pthread while started
+
+    bool _push(Level level, const char* format, const uint64_t* args, uint8_t count);
+    void _emit(const Entry& entry);
+    static void _run(void* self);
+
+    // Arguments are widened to 64 bits as they are captured; the format
+    // decides how they are read back
+    template <typename T>
+    static typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value, uint64_t>::type
+    _pack(T value) {
+      return (uint64_t)(int64_t)value;
+    }
+    template <typename T>
+    static typename std::enable_if<std::is_floating_point<T>::value, uint64_t>::type _pack(T value) {
+      double wide = value;
+      uint64_t bits;
+      memcpy(&bits, &wide, sizeof(bits));
+      return bits;
+    }
+    template <typename T>
+    static uint64_t _pack(T* value) {
+      return (uint64_t)(uintptr_t)value;
+    }
+};
+#endif // FINGERPRINT_LOG_H
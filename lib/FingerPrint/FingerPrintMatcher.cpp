@@ -0,0 +1,713 @@
+#include "FingerPrintMatcher.h"
+#include "FingerPrintCpu.h"
+#include <cmath>
+#include <cstring>
+
+// Layout of the 512-byte template as read by the host-side code: two
+// 256-byte character files, each with an 8-byte header followed by packed
+// 4-byte minutia records (big endian):
+//   x:9 | y:9 | angle:8 | type:2 | quality:4
+// Header byte 1 holds the record count. Records outside the sensor frame are
+// dropped, so firmware with a different layout decodes to few or no minutiae
+// rather than to garbage.
+static const uint16_t CHAR_FILE_SIZE = 256;
+static const uint8_t HEADER_SIZE = 8;
+static const uint8_t COUNT_OFFSET = 1;
+static const uint8_t RECORD_SIZE = 4;
+static const uint8_t RECORDS_PER_FILE = (CHAR_FILE_SIZE - HEADER_SIZE) / RECORD_SIZE;
+
+// Pairing tolerances after alignment
+static const float PAIR_DISTANCE = 12.0f;   // pixels
+static const int PAIR_ANGLE = 14;           // angle units (~20 degrees)
+static const int DUPLICATE_DISTANCE = 4;    // same minutia seen in both character files
+
+// Alignment votes: rotation first, then translation among the pairs that
+// agree on it. Two small grids instead of one 3-D accumulator keep this on
+// the stack of a microcontroller task.
+static const int ROTATION_BINS = 32;
+static const int TRANSLATION_BIN = 16;     // pixels
+static const int TRANSLATION_BINS = 48;    // covers +-384 pixels
+
+// Descriptor histogram: minutia pairs binned by separation and by the
+// angle between their directions
+static const int DESCRIPTOR_DISTANCE_BINS = 8;
+static const int DESCRIPTOR_DISTANCE_STEP = 24;   // pixels per bin, last bin open-ended
+static const int DESCRIPTOR_ANGLE_BINS = 8;
+
+#if !defined(FINGERPRINT_FIXED_POINT)
+static const float TWO_PI = 6.28318530718f;
+#endif
+
+static int angleDiff(int a, int b) {
+  int d = (a - b) & 0xFF;
+  return d > 128 ? 256 - d : d;
+}
+
+// Tables for the fixed-point matcher, computed by the compiler: the sine of
+// each angle unit in Q14, and the squared upper bound of each descriptor
+// distance bin
+static const int Q = 14;
+
+static constexpr double sineSeries(double x2, double term, int n, double sum) {
+  return n > 23 ? sum : sineSeries(x2, -term * x2 / ((n + 1) * (n + 2)), n + 2, sum + term);
+}
+
+static constexpr int16_t sineQ14(int a) {
+  return (int16_t)(sineSeries(((a > 128 ? a - 256 : a) * 6.283185307179586 / 256) *
+                                  ((a > 128 ? a - 256 : a) * 6.283185307179586 / 256),
+                              (a > 128 ? a - 256 : a) * 6.283185307179586 / 256, 1, 0.0) * (1 << Q) +
+                   (a > 128 ? -0.5 : 0.5));
+}
+
+#define SINE4(a) sineQ14(a), sineQ14(a + 1), sineQ14(a + 2), sineQ14(a + 3)
+#define SINE16(a) SINE4(a), SINE4(a + 4), SINE4(a + 8), SINE4(a + 12)
+#define SINE64(a) SINE16(a), SINE16(a + 16), SINE16(a + 32), SINE16(a + 48)
+static constexpr int16_t SINE_Q14[256] = {SINE64(0), SINE64(64), SINE64(128), SINE64(192)};
+#undef SINE64
+#undef SINE16
+#undef SINE4
+
+static constexpr int32_t squaredBinLimit(int bin) {
+  return (bin + 1) * DESCRIPTOR_DISTANCE_STEP * (bin + 1) * DESCRIPTOR_DISTANCE_STEP;
+}
+
+static constexpr int32_t DISTANCE_BIN_LIMITS[DESCRIPTOR_DISTANCE_BINS - 1] = {
+  squaredBinLimit(0), squaredBinLimit(1), squaredBinLimit(2), squaredBinLimit(3),
+  squaredBinLimit(4), squaredBinLimit(5), squaredBinLimit(6),
+};
+
+static int32_t sineOf(int angle) {
+  return SINE_Q14[angle & 0xFF];
+}
+
+static int32_t cosineOf(int angle) {
+  return SINE_Q14[(angle + 64) & 0xFF];
+}
+
+// Q14 values are floored by arithmetic shifts and divisions by a multiple of
+// the scale
+static int32_t floorDiv(int32_t value, int32_t divisor) {
+  return value >= 0 ? value / divisor : -((-value + divisor - 1) / divisor);
+}
+
+bool FingerPrintMatcher::decode(const uint8_t data[TEMPLATE_SIZE], FingerPrintFeatures* features) {
+  features->count = 0;
+  for (uint16_t file = 0; file < TEMPLATE_SIZE / CHAR_FILE_SIZE; file++) {
+    const uint8_t* base = data + file * CHAR_FILE_SIZE;
+    uint8_t records = base[COUNT_OFFSET];
+    if (records > RECORDS_PER_FILE) {
+      records = RECORDS_PER_FILE;
+    }
+
+    for (uint8_t r = 0; r < records; r++) {
+      const uint8_t* p = base + HEADER_SIZE + r * RECORD_SIZE;
+      uint32_t packed = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+
+      FingerPrintMinutia m;
+      m.x = (packed >> 23) & 0x1FF;
+      m.y = (packed >> 14) & 0x1FF;
+      m.angle = (packed >> 6) & 0xFF;
+      m.type = (packed >> 4) & 0x03;
+      m.quality = packed & 0x0F;
+      if (m.x >= IMAGE_WIDTH || m.y >= IMAGE_HEIGHT || m.type == 0 || m.type == 3) {
+        continue;
+      }
+
+      bool duplicate = false;
+      for (uint8_t i = 0; i < features->count && file > 0; i++) {
+        const FingerPrintMinutia& other = features->minutiae[i];
+        if (abs((int)other.x - m.x) <= DUPLICATE_DISTANCE &&
+            abs((int)other.y - m.y) <= DUPLICATE_DISTANCE) {
+          duplicate = true;
+          break;
+        }
+      }
+      if (!duplicate && features->count < FingerPrintFeatures::MAX_MINUTIAE) {
+        features->minutiae[features->count++] = m;
+      }
+    }
+  }
+  return features->count > 0;
+}
+
+// The inverse of decode() for the fields it reads: every minutia goes into
+// the first character file. decode() gives the same features back, but the
+// sensor may not accept the result, since the rest of its format is unknown.
+void FingerPrintMatcher::encode(const FingerPrintFeatures& features, uint8_t data[TEMPLATE_SIZE]) {
+  memset(data, 0, TEMPLATE_SIZE);
+  uint8_t count = features.count < RECORDS_PER_FILE ? features.count : RECORDS_PER_FILE;
+  data[COUNT_OFFSET] = count;
+  for (uint8_t r = 0; r < count; r++) {
+    const FingerPrintMinutia& m = features.minutiae[r];
+    uint32_t packed = ((uint32_t)(m.x & 0x1FF) << 23) | ((uint32_t)(m.y & 0x1FF) << 14) |
+                      ((uint32_t)m.angle << 6) | ((m.type & 0x03) << 4) | (m.quality & 0x0F);
+    uint8_t* p = data + HEADER_SIZE + r * RECORD_SIZE;
+    p[0] = packed >> 24;
+    p[1] = (packed >> 16) & 0xFF;
+    p[2] = (packed >> 8) & 0xFF;
+    p[3] = packed & 0xFF;
+  }
+}
+
+// FingerPrintFeatures is public, so features built by callers may hold
+// what decode() never produces. Minutiae past MAX_MINUTIAE, or of a type
+// other than ending or bifurcation, take no part in matching.
+static uint8_t minutiaCount(const FingerPrintFeatures& features) {
+  return features.count < FingerPrintFeatures::MAX_MINUTIAE ? features.count : FingerPrintFeatures::MAX_MINUTIAE;
+}
+
+static bool knownType(const FingerPrintMinutia& m) {
+  return m.type == 1 || m.type == 2;
+}
+
+// Lay the probe out for _pairCount(). Everything here depends on the probe
+// alone, so it is done once however many candidates are compared. Both
+// tables are built in place to keep this light on the stack. Minutiae
+// outside the frame are left out too, having no grid cell.
+static uint16_t gridCell(int x, int y) {
+  return (y / FingerPrintPreparedProbe::GRID_CELL) * FingerPrintPreparedProbe::GRID_COLUMNS +
+         x / FingerPrintPreparedProbe::GRID_CELL;
+}
+
+bool FingerPrintMatcher::prepareProbe(const FingerPrintFeatures& probe, FingerPrintPreparedProbe* prepared) {
+  const uint16_t cells = FingerPrintPreparedProbe::GRID_COLUMNS * FingerPrintPreparedProbe::GRID_ROWS;
+  memset(prepared->anglesBelow, 0, sizeof(prepared->anglesBelow));
+  memset(prepared->cellStart, 0, sizeof(prepared->cellStart));
+
+  uint8_t n = 0;
+  for (uint8_t i = 0; i < minutiaCount(probe); i++) {
+    const FingerPrintMinutia& m = probe.minutiae[i];
+    if (!knownType(m) || m.x >= IMAGE_WIDTH || m.y >= IMAGE_HEIGHT) {
+      continue;
+    }
+    prepared->angle[n] = m.angle;
+    prepared->type[n] = m.type;
+    prepared->x[n] = m.x - IMAGE_WIDTH / 2;
+    prepared->y[n] = m.y - IMAGE_HEIGHT / 2;
+    prepared->anglesBelow[m.type - 1][m.angle + 1]++;
+    if (m.angle + 257 < FingerPrintPreparedProbe::ANGLE_TABLE_SIZE) {
+      prepared->anglesBelow[m.type - 1][m.angle + 257]++;
+    }
+    prepared->cellStart[gridCell(m.x, m.y)]++;
+    n++;
+  }
+  prepared->count = n;
+  for (uint16_t a = 1; a < FingerPrintPreparedProbe::ANGLE_TABLE_SIZE; a++) {
+    prepared->anglesBelow[0][a] += prepared->anglesBelow[0][a - 1];
+    prepared->anglesBelow[1][a] += prepared->anglesBelow[1][a - 1];
+  }
+
+  // Running totals leave each cell's end in cellStart; filling backwards
+  // moves it to the cell's start and keeps index order within the cell
+  for (uint16_t c = 1; c <= cells; c++) {
+    prepared->cellStart[c] += prepared->cellStart[c - 1];
+  }
+  for (uint8_t i = n; i-- > 0;) {
+    uint16_t cell = gridCell(prepared->x[i] + IMAGE_WIDTH / 2, prepared->y[i] + IMAGE_HEIGHT / 2);
+    prepared->cellItems[--prepared->cellStart[cell]] = i;
+  }
+  return n > 0;
+}
+
+bool FingerPrintMatcher::prepareProbe(const uint8_t data[TEMPLATE_SIZE], FingerPrintPreparedProbe* prepared) {
+  FingerPrintFeatures features;
+  decode(data, &features);
+  return prepareProbe(features, prepared);
+}
+
+// Coarse rotation, in angle units, that the most same-type minutia pairs
+// agree on; -1 when no pair votes. Shared by both matchers, being integer.
+static int coarseRotation(const FingerPrintPreparedProbe& probe, const FingerPrintFeatures& candidate) {
+  const int binWidth = 256 / ROTATION_BINS;
+
+  // Each candidate minutia votes for the bins its same-type probe minutiae
+  // fall in, read off the probe's running angle counts
+  uint16_t rotationVotes[ROTATION_BINS] = {0};
+  for (uint8_t j = 0; j < minutiaCount(candidate); j++) {
+    if (!knownType(candidate.minutiae[j])) {
+      continue;
+    }
+    const uint8_t* below = probe.anglesBelow[candidate.minutiae[j].type - 1];
+    for (int b = 0; b < ROTATION_BINS; b++) {
+      int from = (candidate.minutiae[j].angle + b * binWidth) & 0xFF;
+      rotationVotes[b] += below[from + binWidth] - below[from];
+    }
+  }
+
+  // Neighbouring bins count at half weight, so a rotation on a bin edge is
+  // not split while the bin holding it still wins
+  int bestBin = 0;
+  uint32_t bestVotes = 0;
+  for (int b = 0; b < ROTATION_BINS; b++) {
+    uint32_t v = rotationVotes[(b + ROTATION_BINS - 1) % ROTATION_BINS] + 2 * rotationVotes[b] +
+                 rotationVotes[(b + 1) % ROTATION_BINS];
+    if (v > bestVotes) {
+      bestVotes = v;
+      bestBin = b;
+    }
+  }
+  if (bestVotes == 0) {
+    return -1;
+  }
+  return bestBin * 256 / ROTATION_BINS + 128 / ROTATION_BINS;
+}
+
+#if !defined(FINGERPRINT_FIXED_POINT)
+// Align candidate to probe by voting over every pair of same-type minutiae:
+// rotation first, then translation among the pairs that agree on it. The
+// pairs around the winning translation are nearly all true correspondences,
+// so their mean offsets give the final transform. Coordinates are taken
+// about the frame centre to keep rotation error from growing with distance.
+// Minutiae are then paired greedily under that transform.
+uint8_t FingerPrintMatcher::_pairCount(const FingerPrintPreparedProbe& probe, const FingerPrintFeatures& candidate) {
+  const int binWidth = 256 / ROTATION_BINS;
+
+  const int coarse = coarseRotation(probe, candidate);
+  if (coarse < 0) {
+    return 0;
+  }
+  const float coarseTheta = coarse * TWO_PI / 256.0f;
+  const float coarseCos = cosf(coarseTheta);
+  const float coarseSin = sinf(coarseTheta);
+  const float cx0 = IMAGE_WIDTH / 2.0f;
+  const float cy0 = IMAGE_HEIGHT / 2.0f;
+
+  // Candidate minutiae by type, and turned by the coarse rotation, once each
+  // rather than once per pair. Their angles are packed by type too, so the
+  // angle test runs over a whole type at once; padded for the widest kernel.
+  const FingerPrintCpu::Kernels& kernels = FingerPrintCpu::kernels();
+  const uint8_t angleTolerance = binWidth * 3 / 2;
+  uint8_t byType[2][FingerPrintFeatures::MAX_MINUTIAE];
+  uint8_t typeAngles[2][64] = {{0}};
+  uint8_t typeCount[2] = {0, 0};
+  float turnedX[FingerPrintFeatures::MAX_MINUTIAE];
+  float turnedY[FingerPrintFeatures::MAX_MINUTIAE];
+  for (uint8_t j = 0; j < minutiaCount(candidate); j++) {
+    const FingerPrintMinutia& c = candidate.minutiae[j];
+    if (!knownType(c)) {
+      continue;
+    }
+    uint8_t t = c.type - 1;
+    typeAngles[t][typeCount[t]] = c.angle;
+    byType[t][typeCount[t]++] = j;
+    float x = c.x - cx0;
+    float y = c.y - cy0;
+    turnedX[j] = x * coarseCos - y * coarseSin;
+    turnedY[j] = x * coarseSin + y * coarseCos;
+  }
+
+  uint8_t translationVotes[TRANSLATION_BINS][TRANSLATION_BINS];
+  memset(translationVotes, 0, sizeof(translationVotes));
+  int bestX = 0;
+  int bestY = 0;
+  uint8_t bestCell = 0;
+  int32_t angleSum = 0;
+  float sumX = 0;
+  float sumY = 0;
+  uint32_t sumCount = 0;
+
+  for (int pass = 0; pass < 2; pass++) {
+    for (uint8_t i = 0; i < probe.count; i++) {
+      const uint8_t t = probe.type[i] - 1;
+      uint64_t agreeing = kernels.angleMatches(typeAngles[t], typeCount[t], probe.angle[i] - coarse, angleTolerance);
+      for (; agreeing; agreeing &= agreeing - 1) {
+        const uint8_t j = byType[t][__builtin_ctzll(agreeing)];
+        int offset = (int8_t)(uint8_t)((probe.angle[i] - candidate.minutiae[j].angle - coarse) & 0xFF);
+        float dx = probe.x[i] - turnedX[j];
+        float dy = probe.y[i] - turnedY[j];
+        int xb = (int)floorf(dx / TRANSLATION_BIN) + TRANSLATION_BINS / 2;
+        int yb = (int)floorf(dy / TRANSLATION_BIN) + TRANSLATION_BINS / 2;
+        if (xb < 0 || yb < 0 || xb >= TRANSLATION_BINS || yb >= TRANSLATION_BINS) {
+          continue;
+        }
+        if (pass == 0) {
+          if (translationVotes[xb][yb] < 0xFF && ++translationVotes[xb][yb] > bestCell) {
+            bestCell = translationVotes[xb][yb];
+            bestX = xb;
+            bestY = yb;
+          }
+        } else if (abs(xb - bestX) <= 1 && abs(yb - bestY) <= 1) {
+          angleSum += offset;
+          sumX += probe.x[i];
+          sumY += probe.y[i];
+          sumCount++;
+        }
+      }
+    }
+    if (bestCell == 0) {
+      return 0;
+    }
+  }
+
+  // Refined rotation from the agreeing pairs, then the translation that
+  // maps their candidate centroid onto their probe centroid
+  const int rotation = (coarse + angleSum / (int32_t)sumCount) & 0xFF;
+  const float theta = rotation * TWO_PI / 256.0f;
+  const float cosT = cosf(theta);
+  const float sinT = sinf(theta);
+  float candX = 0;
+  float candY = 0;
+  for (uint8_t i = 0; i < probe.count; i++) {
+    const uint8_t t = probe.type[i] - 1;
+    uint64_t agreeing = kernels.angleMatches(typeAngles[t], typeCount[t], probe.angle[i] - coarse, angleTolerance);
+    for (; agreeing; agreeing &= agreeing - 1) {
+      const uint8_t j = byType[t][__builtin_ctzll(agreeing)];
+      float dx = probe.x[i] - turnedX[j];
+      float dy = probe.y[i] - turnedY[j];
+      int xb = (int)floorf(dx / TRANSLATION_BIN) + TRANSLATION_BINS / 2;
+      int yb = (int)floorf(dy / TRANSLATION_BIN) + TRANSLATION_BINS / 2;
+      if (abs(xb - bestX) <= 1 && abs(yb - bestY) <= 1) {
+        float x = candidate.minutiae[j].x - cx0;
+        float y = candidate.minutiae[j].y - cy0;
+        candX += x * cosT - y * sinT;
+        candY += x * sinT + y * cosT;
+      }
+    }
+  }
+  const float dx = (sumX - candX) / sumCount;
+  const float dy = (sumY - candY) / sumCount;
+
+  // Only the grid cells around where a candidate minutia lands can hold a
+  // probe minutia within pairing distance. Ties go to the lower index.
+  bool used[FingerPrintFeatures::MAX_MINUTIAE] = {false};
+  uint8_t pairs = 0;
+  for (uint8_t j = 0; j < minutiaCount(candidate); j++) {
+    const FingerPrintMinutia& c = candidate.minutiae[j];
+    if (!knownType(c)) {
+      continue;
+    }
+    float x = c.x - cx0;
+    float y = c.y - cy0;
+    float px = x * cosT - y * sinT + dx + cx0;
+    float py = x * sinT + y * cosT + dy + cy0;
+    int cAngle = (c.angle + rotation) & 0xFF;
+
+    int column = (int)floorf(px / FingerPrintPreparedProbe::GRID_CELL);
+    int row = (int)floorf(py / FingerPrintPreparedProbe::GRID_CELL);
+    int firstColumn = column > 0 ? column - 1 : 0;
+    int lastColumn = column < FingerPrintPreparedProbe::GRID_COLUMNS - 2 ? column + 1 : FingerPrintPreparedProbe::GRID_COLUMNS - 1;
+    int firstRow = row > 0 ? row - 1 : 0;
+    int lastRow = row < FingerPrintPreparedProbe::GRID_ROWS - 2 ? row + 1 : FingerPrintPreparedProbe::GRID_ROWS - 1;
+
+    int bestIndex = -1;
+    float bestDist = PAIR_DISTANCE;
+    for (int r = firstRow; r <= lastRow; r++) {
+      for (int col = firstColumn; col <= lastColumn; col++) {
+        const int cell = r * FingerPrintPreparedProbe::GRID_COLUMNS + col;
+        for (uint8_t k = probe.cellStart[cell]; k < probe.cellStart[cell + 1]; k++) {
+          const uint8_t i = probe.cellItems[k];
+          if (used[i] || angleDiff(probe.angle[i], cAngle) > PAIR_ANGLE) {
+            continue;
+          }
+          float d = hypotf(probe.x[i] + IMAGE_WIDTH / 2 - px, probe.y[i] + IMAGE_HEIGHT / 2 - py);
+          if (d < bestDist || (d == bestDist && bestIndex > i)) {
+            bestDist = d;
+            bestIndex = i;
+          }
+        }
+      }
+    }
+    if (bestIndex >= 0) {
+      used[bestIndex] = true;
+      pairs++;
+    }
+  }
+  return pairs;
+}
+#endif
+
+// _pairCount() in integers, for cores without an FPU. Candidate positions
+// are kept in Q14 fixed point about the frame centre and turned with the
+// sine table; pairing compares squared distances in Q8. Rounding in the
+// table and shifts moves a pair across a vote or pairing boundary now and
+// then, so the pair count can differ from the floating-point one by one or
+// two.
+uint8_t FingerPrintMatcher::_pairCountFixed(const FingerPrintPreparedProbe& probe, const FingerPrintFeatures& candidate) {
+  const int binWidth = 256 / ROTATION_BINS;
+
+  const int coarse = coarseRotation(probe, candidate);
+  if (coarse < 0) {
+    return 0;
+  }
+  const int32_t coarseCos = cosineOf(coarse);
+  const int32_t coarseSin = sineOf(coarse);
+
+  const FingerPrintCpu::Kernels& kernels = FingerPrintCpu::kernels();
+  const uint8_t angleTolerance = binWidth * 3 / 2;
+  uint8_t byType[2][FingerPrintFeatures::MAX_MINUTIAE];
+  uint8_t typeAngles[2][64] = {{0}};
+  uint8_t typeCount[2] = {0, 0};
+  int32_t turnedX[FingerPrintFeatures::MAX_MINUTIAE];  // Q14
+  int32_t turnedY[FingerPrintFeatures::MAX_MINUTIAE];
+  for (uint8_t j = 0; j < minutiaCount(candidate); j++) {
+    const FingerPrintMinutia& c = candidate.minutiae[j];
+    if (!knownType(c)) {
+      continue;
+    }
+    uint8_t t = c.type - 1;
+    typeAngles[t][typeCount[t]] = c.angle;
+    byType[t][typeCount[t]++] = j;
+    int32_t x = (int32_t)c.x - IMAGE_WIDTH / 2;
+    int32_t y = (int32_t)c.y - IMAGE_HEIGHT / 2;
+    turnedX[j] = x * coarseCos - y * coarseSin;
+    turnedY[j] = x * coarseSin + y * coarseCos;
+  }
+
+  // A translation bin is 16 pixels, so the Q14 offset shifts straight to it
+  const int binShift = Q + 4;
+  static_assert(TRANSLATION_BIN == 1 << 4, "translation bins are a power of two");
+  uint8_t translationVotes[TRANSLATION_BINS][TRANSLATION_BINS];
+  memset(translationVotes, 0, sizeof(translationVotes));
+  int bestX = 0;
+  int bestY = 0;
+  uint8_t bestCell = 0;
+  int32_t angleSum = 0;
+  int32_t sumX = 0;
+  int32_t sumY = 0;
+  int32_t sumCount = 0;
+
+  for (int pass = 0; pass < 2; pass++) {
+    for (uint8_t i = 0; i < probe.count; i++) {
+      const uint8_t t = probe.type[i] - 1;
+      uint64_t agreeing = kernels.angleMatches(typeAngles[t], typeCount[t], probe.angle[i] - coarse, angleTolerance);
+      for (; agreeing; agreeing &= agreeing - 1) {
+        const uint8_t j = byType[t][__builtin_ctzll(agreeing)];
+        int offset = (int8_t)(uint8_t)((probe.angle[i] - candidate.minutiae[j].angle - coarse) & 0xFF);
+        int xb = (((int32_t)probe.x[i] << Q) - turnedX[j]) >> binShift;
+        int yb = (((int32_t)probe.y[i] << Q) - turnedY[j]) >> binShift;
+        xb += TRANSLATION_BINS / 2;
+        yb += TRANSLATION_BINS / 2;
+        if (xb < 0 || yb < 0 || xb >= TRANSLATION_BINS || yb >= TRANSLATION_BINS) {
+          continue;
+        }
+        if (pass == 0) {
+          if (translationVotes[xb][yb] < 0xFF && ++translationVotes[xb][yb] > bestCell) {
+            bestCell = translationVotes[xb][yb];
+            bestX = xb;
+            bestY = yb;
+          }
+        } else if (abs(xb - bestX) <= 1 && abs(yb - bestY) <= 1) {
+          angleSum += offset;
+          sumX += probe.x[i];
+          sumY += probe.y[i];
+          sumCount++;
+        }
+      }
+    }
+    if (bestCell == 0) {
+      return 0;
+    }
+  }
+
+  const int rotation = (coarse + angleSum / sumCount) & 0xFF;
+  const int32_t cosT = cosineOf(rotation);
+  const int32_t sinT = sineOf(rotation);
+  int64_t candX = 0;  // Q14, summed over up to every pair
+  int64_t candY = 0;
+  for (uint8_t i = 0; i < probe.count; i++) {
+    const uint8_t t = probe.type[i] - 1;
+    uint64_t agreeing = kernels.angleMatches(typeAngles[t], typeCount[t], probe.angle[i] - coarse, angleTolerance);
+    for (; agreeing; agreeing &= agreeing - 1) {
+      const uint8_t j = byType[t][__builtin_ctzll(agreeing)];
+      int xb = ((((int32_t)probe.x[i] << Q) - turnedX[j]) >> binShift) + TRANSLATION_BINS / 2;
+      int yb = ((((int32_t)probe.y[i] << Q) - turnedY[j]) >> binShift) + TRANSLATION_BINS / 2;
+      if (abs(xb - bestX) <= 1 && abs(yb - bestY) <= 1) {
+        int32_t x = (int32_t)candidate.minutiae[j].x - IMAGE_WIDTH / 2;
+        int32_t y = (int32_t)candidate.minutiae[j].y - IMAGE_HEIGHT / 2;
+        candX += x * cosT - y * sinT;
+        candY += x * sinT + y * cosT;
+      }
+    }
+  }
+  // Translation plus the move back from centred coordinates, in Q14
+  const int32_t dx = (int32_t)((((int64_t)sumX << Q) - candX) / sumCount) + ((IMAGE_WIDTH / 2) << Q);
+  const int32_t dy = (int32_t)((((int64_t)sumY << Q) - candY) / sumCount) + ((IMAGE_HEIGHT / 2) << Q);
+
+  // Offsets in Q8 are checked against the pairing distance before they are
+  // squared, which keeps the squares within 32 bits
+  const int toQ8 = Q - 8;
+  const int32_t axisLimit = (int32_t)(PAIR_DISTANCE * 256);
+  const int32_t pairLimit = axisLimit * axisLimit;
+  const int32_t cellSize = (int32_t)FingerPrintPreparedProbe::GRID_CELL << Q;
+  bool used[FingerPrintFeatures::MAX_MINUTIAE] = {false};
+  uint8_t pairs = 0;
+  for (uint8_t j = 0; j < minutiaCount(candidate); j++) {
+    const FingerPrintMinutia& c = candidate.minutiae[j];
+    if (!knownType(c)) {
+      continue;
+    }
+    int32_t x = (int32_t)c.x - IMAGE_WIDTH / 2;
+    int32_t y = (int32_t)c.y - IMAGE_HEIGHT / 2;
+    int32_t px = x * cosT - y * sinT + dx;
+    int32_t py = x * sinT + y * cosT + dy;
+    int cAngle = (c.angle + rotation) & 0xFF;
+
+    int column = floorDiv(px, cellSize);
+    int row = floorDiv(py, cellSize);
+    int firstColumn = column > 0 ? column - 1 : 0;
+    int lastColumn = column < FingerPrintPreparedProbe::GRID_COLUMNS - 2 ? column + 1 : FingerPrintPreparedProbe::GRID_COLUMNS - 1;
+    int firstRow = row > 0 ? row - 1 : 0;
+    int lastRow = row < FingerPrintPreparedProbe::GRID_ROWS - 2 ? row + 1 : FingerPrintPreparedProbe::GRID_ROWS - 1;
+
+    int bestIndex = -1;
+    int32_t bestDist = pairLimit;
+    for (int r = firstRow; r <= lastRow; r++) {
+      for (int col = firstColumn; col <= lastColumn; col++) {
+        const int cell = r * FingerPrintPreparedProbe::GRID_COLUMNS + col;
+        for (uint8_t k = probe.cellStart[cell]; k < probe.cellStart[cell + 1]; k++) {
+          const uint8_t i = probe.cellItems[k];
+          if (used[i] || angleDiff(probe.angle[i], cAngle) > PAIR_ANGLE) {
+            continue;
+          }
+          int32_t ex = ((((int32_t)probe.x[i] + IMAGE_WIDTH / 2) << Q) - px) >> toQ8;
+          int32_t ey = ((((int32_t)probe.y[i] + IMAGE_HEIGHT / 2) << Q) - py) >> toQ8;
+          if (abs(ex) >= axisLimit || abs(ey) >= axisLimit) {
+            continue;
+          }
+          int32_t d = ex * ex + ey * ey;
+          if (d < bestDist || (d == bestDist && bestIndex > i)) {
+            bestDist = d;
+            bestIndex = i;
+          }
+        }
+      }
+    }
+    if (bestIndex >= 0) {
+      used[bestIndex] = true;
+      pairs++;
+    }
+  }
+  return pairs;
+}
+
+// Similarity on a 0-300 scale: paired minutiae squared over the product of
+// the two counts, so partial overlaps of large templates still score well
+static uint16_t similarity(uint32_t pairs, uint8_t probeCount, uint8_t candidateCount) {
+  return (uint16_t)(300 * pairs * pairs / ((uint32_t)probeCount * candidateCount));
+}
+
+uint16_t FingerPrintMatcher::compare(const FingerPrintPreparedProbe& probe, const FingerPrintFeatures& candidate) {
+#if defined(FINGERPRINT_FIXED_POINT)
+  return compareFixed(probe, candidate);
+#else
+  if (probe.count == 0 || candidate.count == 0) {
+    return 0;
+  }
+  return similarity(_pairCount(probe, candidate), probe.count, candidate.count);
+#endif
+}
+
+uint16_t FingerPrintMatcher::compareFixed(const FingerPrintPreparedProbe& probe, const FingerPrintFeatures& candidate) {
+  if (probe.count == 0 || candidate.count == 0) {
+    return 0;
+  }
+  return similarity(_pairCountFixed(probe, candidate), probe.count, candidate.count);
+}
+
+// One-off comparison. To score one probe against many candidates, prepare
+// it once and call compare().
+uint16_t FingerPrintMatcher::score(const FingerPrintFeatures& probe, const FingerPrintFeatures& candidate) {
+  FingerPrintPreparedProbe prepared;
+  prepareProbe(probe, &prepared);
+  return compare(prepared, candidate);
+}
+
+uint16_t FingerPrintMatcher::scoreFixed(const FingerPrintFeatures& probe, const FingerPrintFeatures& candidate) {
+  FingerPrintPreparedProbe prepared;
+  prepareProbe(probe, &prepared);
+  return compareFixed(prepared, candidate);
+}
+
+// Dissimilarity in [0, 1]: share of minutiae left unpaired. Symmetric and
+// zero on identical templates; it only approximately obeys the triangle
+// inequality, which the index accounts for with its error bound.
+float FingerPrintMatcher::distance(const FingerPrintFeatures& a, const FingerPrintFeatures& b) {
+  uint8_t larger = a.count > b.count ? a.count : b.count;
+  if (larger == 0) {
+    return 0.0f;
+  }
+  FingerPrintPreparedProbe prepared;
+  prepareProbe(a.count >= b.count ? a : b, &prepared);
+#if defined(FINGERPRINT_FIXED_POINT)
+  uint8_t pairs = _pairCountFixed(prepared, a.count >= b.count ? b : a);
+#else
+  uint8_t pairs = _pairCount(prepared, a.count >= b.count ? b : a);
+#endif
+  return 1.0f - (float)pairs / larger;
+}
+
+// Fixed-length summary of a template for vector indexes: a histogram of
+// minutia pairs over (separation, relative direction), which does not change
+// when the finger is shifted or rotated on the glass. Scaled to an L2 norm of
+// 255 so two descriptors are at most 255 * sqrt(2) apart.
+void FingerPrintMatcher::describe(const FingerPrintFeatures& features, uint8_t descriptor[DESCRIPTOR_SIZE]) {
+#if defined(FINGERPRINT_FIXED_POINT)
+  describeFixed(features, descriptor);
+#else
+  uint16_t histogram[DESCRIPTOR_SIZE] = {0};
+  for (uint8_t i = 0; i < features.count; i++) {
+    const FingerPrintMinutia& a = features.minutiae[i];
+    for (uint8_t j = i + 1; j < features.count; j++) {
+      const FingerPrintMinutia& b = features.minutiae[j];
+      int d = (int)hypotf((float)a.x - b.x, (float)a.y - b.y) / DESCRIPTOR_DISTANCE_STEP;
+      if (d >= DESCRIPTOR_DISTANCE_BINS) {
+        d = DESCRIPTOR_DISTANCE_BINS - 1;
+      }
+      int r = angleDiff(a.angle, b.angle) * DESCRIPTOR_ANGLE_BINS / 129;
+      histogram[d * DESCRIPTOR_ANGLE_BINS + r]++;
+    }
+  }
+
+  float norm = 0.0f;
+  for (uint8_t i = 0; i < DESCRIPTOR_SIZE; i++) {
+    norm += (float)histogram[i] * histogram[i];
+  }
+  norm = sqrtf(norm);
+  for (uint8_t i = 0; i < DESCRIPTOR_SIZE; i++) {
+    descriptor[i] = norm > 0.0f ? (uint8_t)(histogram[i] * 255.0f / norm + 0.5f) : 0;
+  }
+#endif
+}
+
+// describe() in integers. The histogram is the same; the scaling divides by
+// an integer square root in Q8, so a byte can come out one higher or lower.
+static uint32_t squareRoot(uint64_t value) {
+  uint64_t root = 0;
+  for (uint64_t bit = (uint64_t)1 << 62; bit; bit >>= 2) {
+    if (value >= root + bit) {
+      value -= root + bit;
+      root = (root >> 1) + bit;
+    } else {
+      root >>= 1;
+    }
+  }
+  return (uint32_t)root;
+}
+
+void FingerPrintMatcher::describeFixed(const FingerPrintFeatures& features, uint8_t descriptor[DESCRIPTOR_SIZE]) {
+  uint16_t histogram[DESCRIPTOR_SIZE] = {0};
+  for (uint8_t i = 0; i < features.count; i++) {
+    const FingerPrintMinutia& a = features.minutiae[i];
+    for (uint8_t j = i + 1; j < features.count; j++) {
+      const FingerPrintMinutia& b = features.minutiae[j];
+      int32_t ex = (int32_t)a.x - b.x;
+      int32_t ey = (int32_t)a.y - b.y;
+      int32_t squared = ex * ex + ey * ey;
+      int d = 0;
+      while (d < DESCRIPTOR_DISTANCE_BINS - 1 && squared >= DISTANCE_BIN_LIMITS[d]) {
+        d++;
+      }
+      int r = angleDiff(a.angle, b.angle) * DESCRIPTOR_ANGLE_BINS / 129;
+      histogram[d * DESCRIPTOR_ANGLE_BINS + r]++;
+    }
+  }
+
+  uint64_t norm = 0;
+  for (uint8_t i = 0; i < DESCRIPTOR_SIZE; i++) {
+    norm += (uint32_t)histogram[i] * histogram[i];
+  }
+  uint32_t root = squareRoot(norm << 16);  // Q8
+  for (uint8_t i = 0; i < DESCRIPTOR_SIZE; i++) {
+    descriptor[i] = root ? (uint8_t)(((uint64_t)histogram[i] * 255 * 512 + root) / (2 * root)) : 0;
+  }
+}
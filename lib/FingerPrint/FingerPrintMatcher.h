@@ -0,0 +1,89 @@
+#ifndef FINGERPRINT_MATCHER_H
+#define FINGERPRINT_MATCHER_H
+#include <cstddef>
+#include <cstdint>
+
+// One ridge ending or bifurcation, in sensor image coordinates
+struct FingerPrintMinutia {
+  uint16_t x;
+  uint16_t y;
+  uint8_t angle;    // 256 units per full turn
+  uint8_t type;     // 1 = ending, 2 = bifurcation
+  uint8_t quality;  // 0-15
+};
+
+// Minutiae decoded from one 512-byte sensor template
+struct FingerPrintFeatures {
+  static const uint8_t MAX_MINUTIAE = 62;
+  uint8_t count;
+  FingerPrintMinutia minutiae[MAX_MINUTIAE];
+};
+
+struct FingerPrintPreparedProbe;
+
+// Targets without a hardware FPU (RISC-V cores built without the F
+// extension) score with the integer matcher unless told otherwise
+#if !defined(FINGERPRINT_FIXED_POINT) && defined(__riscv) && !defined(__riscv_flen)
+#define FINGERPRINT_FIXED_POINT 1
+#endif
+
+// Host-side decoding and comparison of sensor templates, so candidates can
+// be scored without a sensor round trip. Scores follow the sensor's scale
+// closely enough for thresholds to carry over, but are not identical to it.
+//
+// The *Fixed() functions are an integer-only implementation of the same
+// algorithm: Q14 trigonometry from a table the compiler computes, and
+// squared-distance comparisons. Decoding and probe preparation are integer
+// already and shared. A fixed-point score stays within a few points of
+// the floating-point one (README: "Fixed-point matching"). Building with
+// FINGERPRINT_FIXED_POINT defined makes compare(), score(), distance() and
+// describe() use them and leaves the floating-point matcher out.
+class FingerPrintMatcher {
+  public:
+    static const uint16_t TEMPLATE_SIZE = 512;
+    static const uint16_t IMAGE_WIDTH = 256;
+    static const uint16_t IMAGE_HEIGHT = 288;
+    static const uint8_t DESCRIPTOR_SIZE = 64;
+
+    static bool decode(const uint8_t data[TEMPLATE_SIZE], FingerPrintFeatures* features);
+    static void encode(const FingerPrintFeatures& features, uint8_t data[TEMPLATE_SIZE]);
+    static uint16_t score(const FingerPrintFeatures& probe, const FingerPrintFeatures& candidate);
+    static bool prepareProbe(const uint8_t data[TEMPLATE_SIZE], FingerPrintPreparedProbe* prepared);
+    static bool prepareProbe(const FingerPrintFeatures& probe, FingerPrintPreparedProbe* prepared);
+    static uint16_t compare(const FingerPrintPreparedProbe& probe, const FingerPrintFeatures& candidate);
+    static float distance(const FingerPrintFeatures& a, const FingerPrintFeatures& b);
+    static void describe(const FingerPrintFeatures& features, uint8_t descriptor[DESCRIPTOR_SIZE]);
+
+    static uint16_t compareFixed(const FingerPrintPreparedProbe& probe, const FingerPrintFeatures& candidate);
+    static uint16_t scoreFixed(const FingerPrintFeatures& probe, const FingerPrintFeatures& candidate);
+    static void describeFixed(const FingerPrintFeatures& features, uint8_t descriptor[DESCRIPTOR_SIZE]);
+  private:
+    static uint8_t _pairCount(const FingerPrintPreparedProbe& probe, const FingerPrintFeatures& candidate);
+    static uint8_t _pairCountFixed(const FingerPrintPreparedProbe& probe, const FingerPrintFeatures& candidate);
+};
+
+// A probe laid out once for comparison with many candidates: coordinates
+// about the frame centre, per-type angle counts that turn the rotation vote
+// into table lookups, and a bucket grid so pairing only looks at nearby
+// minutiae. Read-only after prepareProbe(), so one instance can be shared by
+// any number of threads. About 1.5 KB.
+struct alignas(64) FingerPrintPreparedProbe {
+  static const uint8_t GRID_CELL = 12;  // pixels, at least the pairing distance
+  static const uint8_t GRID_COLUMNS = (FingerPrintMatcher::IMAGE_WIDTH + GRID_CELL - 1) / GRID_CELL;
+  static const uint8_t GRID_ROWS = (FingerPrintMatcher::IMAGE_HEIGHT + GRID_CELL - 1) / GRID_CELL;
+  static const uint16_t ANGLE_TABLE_SIZE = 256 + 8;  // a full turn plus one rotation bin
+
+  // Touched for every candidate pair
+  uint8_t count;
+  uint8_t angle[FingerPrintFeatures::MAX_MINUTIAE];
+  uint8_t type[FingerPrintFeatures::MAX_MINUTIAE];
+  int16_t x[FingerPrintFeatures::MAX_MINUTIAE];  // about the frame centre
+  int16_t y[FingerPrintFeatures::MAX_MINUTIAE];
+  // anglesBelow[type - 1][a]: minutiae of that type with angle < a, counting
+  // each angle again one turn up so ranges can wrap
+  uint8_t anglesBelow[2][ANGLE_TABLE_SIZE];
+  // Minutiae bucketed by grid cell, row-major, in index order within a cell
+  uint8_t cellStart[GRID_COLUMNS * GRID_ROWS + 1];
+  uint8_t cellItems[FingerPrintFeatures::MAX_MINUTIAE];
+};
+#endif // FINGERPRINT_MATCHER_H
@@ -0,0 +1,393 @@
+#include "FingerPrintRemote.h"
+
+#if defined(__linux__) || defined(ESP_PLATFORM)
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#if defined(ESP_PLATFORM)
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// Shard wire format, FingerPrintShard.cpp
+static const uint8_t REQUEST_MAGIC[4] = {'F', 'P', 'Q', '1'};
+static const uint8_t RESPONSE_MAGIC[4] = {'F', 'P', 'R', '1'};
+static const size_t HEADER_SIZE = 12;
+static const size_t REQUEST_SIZE = HEADER_SIZE + FingerPrintGallery::TEMPLATE_SIZE;
+static const size_t HIT_SIZE = 12 + FingerPrintGallery::TEMPLATE_SIZE;  // with the template flag
+static const uint16_t FLAG_TEMPLATES = 0x0001;
+
+static const uint32_t IDLE_INTERVAL_MS = 10;  // worker sleep while the queue is empty
+
+static void put16(uint8_t* p, uint16_t v) {
+  p[0] = v & 0xFF;
+  p[1] = v >> 8;
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = v >> 24;
+}
+
+static uint16_t get16(const uint8_t* p) {
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t nowMs() {
+#if defined(ESP_PLATFORM)
+  return (uint32_t)(esp_timer_get_time() / 1000);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+#endif
+}
+
+static void sleepMs(uint32_t ms) {
+#if defined(ESP_PLATFORM)
+  vTaskDelay(pdMS_TO_TICKS(ms));
+#else
+  struct timespec pause = {0, (long)ms * 1000000};
+  nanosleep(&pause, nullptr);
+#endif
+}
+
+// Wait until fd is readable (or writable) or the deadline passes
+static bool waitFor(int fd, bool writable, uint32_t deadline) {
+  while (true) {
+    int32_t left = (int32_t)(deadline - nowMs());
+    if (left <= 0) {
+      return false;
+    }
+    fd_set set;
+    FD_ZERO(&set);
+    FD_SET(fd, &set);
+    struct timeval tv = {left / 1000, (left % 1000) * 1000};
+    int ready = select(fd + 1, writable ? nullptr : &set, writable ? &set : nullptr, nullptr, &tv);
+    if (ready > 0) {
+      return true;
+    }
+    if (ready < 0 && errno != EINTR) {
+      return false;
+    }
+  }
+}
+
+// Sockets stay non-blocking, so a server that stops reading costs at most
+// the time left to the deadline
+static bool sendAll(int fd, const uint8_t* data, size_t size, uint32_t deadline) {
+  while (size > 0) {
+    ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (!waitFor(fd, true, deadline)) {
+        return false;
+      }
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Read until buffer holds size bytes; false on close, error or deadline
+static bool receiveUntil(int fd, std::vector<uint8_t>* buffer, size_t size, uint32_t deadline) {
+  uint8_t chunk[512];
+  while (buffer->size() < size) {
+    if (!waitFor(fd, false, deadline)) {
+      return false;
+    }
+    ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    buffer->insert(buffer->end(), chunk, chunk + n);
+  }
+  return true;
+}
+
+FingerPrintRemote::FingerPrintRemote(const char* host, uint16_t port, uint8_t queueDepth) {
+  strncpy(_host, host, sizeof(_host) - 1);
+  _host[sizeof(_host) - 1] = '\0';
+  _port = port;
+  _queueDepth = queueDepth ? queueDepth : 1;
+  _timeoutMs = 2000;
+  _minScore = 40;
+  _fd = -1;
+  _nextTicket = 1;
+  _nextId = 1;
+  _inFlight = 0;
+  _running.store(false);
+  _task.store(nullptr);
+}
+
+FingerPrintRemote::~FingerPrintRemote() {
+  stop();
+  _disconnect();
+}
+
+void FingerPrintRemote::setTimeout(uint32_t timeoutMs) {
+  _timeoutMs = timeoutMs;
+}
+
+void FingerPrintRemote::setMinScore(uint16_t score) {
+  _minScore = score;
+}
+
+// Non-blocking connect bounded by the request deadline, so an unreachable
+// matcher costs the worker one timeout and never the caller. The socket is
+// left non-blocking for sendAll() and receiveUntil().
+bool FingerPrintRemote::_connect(uint32_t deadline) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* found = nullptr;
+  if (getaddrinfo(_host, nullptr, &hints, &found) != 0 || !found) {
+    return false;
+  }
+  struct sockaddr_in addr;
+  memcpy(&addr, found->ai_addr, sizeof(addr));
+  freeaddrinfo(found);
+  addr.sin_port = htons(_port);
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return false;
+  }
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  int result = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+  if (result != 0 && errno == EINPROGRESS) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (waitFor(fd, true, deadline) && getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 &&
+        error == 0) {
+      result = 0;
+    }
+  }
+  if (result != 0) {
+    close(fd);
+    return false;
+  }
+
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  _fd = fd;
+  return true;
+}
+
+void FingerPrintRemote::_disconnect() {
+  if (_fd >= 0) {
+    close(_fd);
+    _fd = -1;
+  }
+}
+
+// Ask the matcher for its best hit. The connection is kept between calls and
+// dropped after any failure, so a late answer is never mistaken for the next
+// one.
+FingerPrintRemoteResult::Status FingerPrintRemote::lookup(const uint8_t probe[FingerPrintGallery::TEMPLATE_SIZE],
+                                                          FingerPrintRemoteResult* result) {
+  result->status = FingerPrintRemoteResult::UNREACHABLE;
+  result->userId = 0;
+  result->finger = 0;
+  result->score = 0;
+  const uint32_t deadline = nowMs() + _timeoutMs;
+  const uint32_t id = _nextId++;
+
+  std::vector<uint8_t> buffer(REQUEST_SIZE);
+  memcpy(&buffer[0], REQUEST_MAGIC, sizeof(REQUEST_MAGIC));
+  put32(&buffer[4], id);
+  put16(&buffer[8], 1);
+  put16(&buffer[10], FLAG_TEMPLATES);
+  memcpy(&buffer[HEADER_SIZE], probe, FingerPrintGallery::TEMPLATE_SIZE);
+
+  // A kept connection may have been closed by the server meanwhile: retry once
+  bool sent = _fd >= 0 && sendAll(_fd, &buffer[0], buffer.size(), deadline);
+  if (!sent) {
+    _disconnect();
+    sent = _connect(deadline) && sendAll(_fd, &buffer[0], buffer.size(), deadline);
+  }
+  if (!sent) {
+    _disconnect();
+    return result->status;
+  }
+
+  buffer.clear();
+  if (!receiveUntil(_fd, &buffer, HEADER_SIZE, deadline) ||
+      memcmp(&buffer[0], RESPONSE_MAGIC, sizeof(RESPONSE_MAGIC)) != 0 || get32(&buffer[4]) != id ||
+      !(get16(&buffer[10]) & FLAG_TEMPLATES)) {
+    _disconnect();
+    return result->status;
+  }
+  // One hit was asked for; a larger count is a confused or hostile server,
+  // and reading count * HIT_SIZE bytes from it would be unbounded
+  uint16_t count = get16(&buffer[8]);
+  if (count > 1 || !receiveUntil(_fd, &buffer, HEADER_SIZE + count * HIT_SIZE, deadline)) {
+    _disconnect();
+    return result->status;
+  }
+
+  // Hits arrive strongest first
+  if (count == 0 || get16(&buffer[HEADER_SIZE + 8]) < _minScore) {
+    result->status = FingerPrintRemoteResult::NOT_FOUND;
+    return result->status;
+  }
+  const uint8_t* hit = &buffer[HEADER_SIZE];
+  result->status = FingerPrintRemoteResult::FOUND;
+  result->userId = get32(hit);
+  result->score = get16(hit + 8);
+  result->finger = hit[10];
+  memcpy(result->templateData, hit + 12, FingerPrintGallery::TEMPLATE_SIZE);
+  return result->status;
+}
+
+// Queue a probe for the matcher. Returns its ticket, or 0 when the worker is
+// not running or queueDepth requests are already waiting to be polled.
+uint32_t FingerPrintRemote::submit(const uint8_t probe[FingerPrintGallery::TEMPLATE_SIZE]) {
+  std::lock_guard<std::mutex> guard(_lock);
+  if (!_running.load() || _requests.size() + _inFlight + _results.size() >= _queueDepth) {
+    return 0;
+  }
+  Request request;
+  request.ticket = _nextTicket++;
+  if (_nextTicket == 0) {
+    _nextTicket = 1;
+  }
+  request.submittedMs = nowMs();
+  memcpy(request.probe, probe, FingerPrintGallery::TEMPLATE_SIZE);
+  _requests.push_back(request);
+  return request.ticket;
+}
+
+bool FingerPrintRemote::poll(FingerPrintRemoteResult* result) {
+  std::lock_guard<std::mutex> guard(_lock);
+  if (_results.empty()) {
+    return false;
+  }
+  *result = _results.front();
+  _results.pop_front();
+  return true;
+}
+
+size_t FingerPrintRemote::pending() const {
+  std::lock_guard<std::mutex> guard(_lock);
+  return _requests.size() + _inFlight + _results.size();
+}
+
+void FingerPrintRemote::_run(void* self) {
+  FingerPrintRemote* remote = (FingerPrintRemote*)self;
+  Request request;
+  FingerPrintRemoteResult result;
+  while (remote->_running.load()) {
+    {
+      std::lock_guard<std::mutex> guard(remote->_lock);
+      if (!remote->_requests.empty()) {
+        request = remote->_requests.front();
+        remote->_requests.pop_front();
+        remote->_inFlight = 1;
+      }
+    }
+    if (!remote->_inFlight) {
+      sleepMs(IDLE_INTERVAL_MS);
+      continue;
+    }
+
+    remote->lookup(request.probe, &result);
+    result.ticket = request.ticket;
+    result.elapsedMs = nowMs() - request.submittedMs;
+    std::lock_guard<std::mutex> guard(remote->_lock);
+    remote->_results.push_back(result);
+    remote->_inFlight = 0;
+  }
+}
+
+// Run the requests in the background: a FreeRTOS task at the given priority
+// on ESP32 (below the sensor loop's), a thread on Linux
+bool FingerPrintRemote::start(uint8_t priority, uint32_t stackBytes) {
+  if (_running.load()) {
+    return true;
+  }
+  _running.store(true);
+#if defined(ESP_PLATFORM)
+  TaskHandle_t handle = nullptr;
+  _task.store((void*)1);  // cleared by the task as it exits
+  if (xTaskCreate([](void* self) {
+        _run(self);
+        ((FingerPrintRemote*)self)->_task.store(nullptr);
+        vTaskDelete(nullptr);
+      }, "fp_remote", stackBytes, this, priority, &handle) != pdPASS) {
+    _task.store(nullptr);
+    _running.store(false);
+    return false;
+  }
+  return true;
+#else
+  (void)priority;
+  (void)stackBytes;
+  pthread_t* thread = new pthread_t;
+  if (pthread_create(thread, nullptr, [](void* self) -> void* {
+        _run(self);
+        return nullptr;
+      }, this) != 0) {
+    delete thread;
+    _running.store(false);
+    return false;
+  }
+  _task.store(thread);
+  return true;
+#endif
+}
+
+// Requests still queued stay queued for the next start(); one in flight
+// finishes first, so stop() can take up to the timeout
+void FingerPrintRemote::stop() {
+  if (!_running.load()) {
+    return;
+  }
+  _running.store(false);
+#if defined(ESP_PLATFORM)
+  while (_task.load()) {
+    vTaskDelay(1);
+  }
+#else
+  pthread_t* thread = (pthread_t*)_task.load();
+  pthread_join(*thread, nullptr);
+  delete thread;
+  _task.store(nullptr);
+#endif
+}
+#endif // __linux__ || ESP_PLATFORM
@@ -0,0 +1,79 @@
+#ifndef FINGERPRINT_REMOTE_H
+#define FINGERPRINT_REMOTE_H
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include "FingerPrintGallery.h"
+
+#if defined(__linux__) || defined(ESP_PLATFORM)
+// Asynchronous client for a site or global matcher: a FingerPrintShardServer
+// holding more of the organisation's gallery than one reader can. submit()
+// queues a probe and returns at once; a background worker sends it and the
+// answer is collected later with poll(). The matched template comes back
+// with the answer so the reader can keep its own copy.
+//
+// Speaks the shard wire format (see FingerPrintShard.h) with the template
+// flag set, so a shard server on localhost stands in for the real one in
+// tests.
+struct FingerPrintRemoteResult {
+  enum Status : uint8_t {
+    FOUND = 0,
+    NOT_FOUND = 1,     // no template reached the minimum score
+    UNREACHABLE = 2,   // no connection or no answer within the timeout
+  };
+  uint32_t ticket;     // as returned by submit()
+  Status status;
+  uint32_t userId;
+  uint8_t finger;
+  uint16_t score;      // FingerPrintMatcher::score(), not a sensor score
+  uint32_t elapsedMs;  // from submit() to the answer
+  uint8_t templateData[FingerPrintGallery::TEMPLATE_SIZE];  // when FOUND
+};
+
+class FingerPrintRemote {
+  public:
+    FingerPrintRemote(const char* host, uint16_t port, uint8_t queueDepth = 4);
+    ~FingerPrintRemote();
+
+    void setTimeout(uint32_t timeoutMs);  // per request, connection included (default 2000)
+    void setMinScore(uint16_t score);     // weaker hits count as NOT_FOUND (default 40)
+    bool start(uint8_t priority = 1, uint32_t stackBytes = 4096);
+    void stop();
+
+    uint32_t submit(const uint8_t probe[FingerPrintGallery::TEMPLATE_SIZE]);  // 0 when full or stopped
+    bool poll(FingerPrintRemoteResult* result);  // next finished request, oldest first
+    size_t pending() const;                      // submitted and not yet polled
+
+    // One blocking round trip on the caller's thread; used by the worker
+    FingerPrintRemoteResult::Status lookup(const uint8_t probe[FingerPrintGallery::TEMPLATE_SIZE],
+                                           FingerPrintRemoteResult* result);
+  private:
+    struct Request {
+      uint32_t ticket;
+      uint32_t submittedMs;
+      uint8_t probe[FingerPrintGallery::TEMPLATE_SIZE];
+    };
+
+    char _host[64];
+    uint16_t _port;
+    uint8_t _queueDepth;
+    uint32_t _timeoutMs;
+    uint16_t _minScore;
+    int _fd;               // worker side only
+    uint32_t _nextTicket;
+    uint32_t _nextId;      // wire request id, worker side only
+    mutable std::mutex _lock;
+    std::deque<Request> _requests;
+    std::deque<FingerPrintRemoteResult> _results;
+    size_t _inFlight;
+    std::atomic<bool> _running;
+    std::atomic<void*> _task;        // FreeRTOS task or pthread while started
+
+    bool _connect(uint32_t deadline);
+    void _disconnect();
+    static void _run(void* self);
+};
+#endif // __linux__ || ESP_PLATFORM
+#endif // FINGERPRINT_REMOTE_H
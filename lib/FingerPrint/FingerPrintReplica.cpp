@@ -0,0 +1,383 @@
+#include "FingerPrintReplica.h"
+
+#if defined(__linux__)
+#include <cerrno>
+#include <cstring>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+static const uint8_t HELLO_MAGIC[4] = {'F', 'P', 'S', '2'};
+static const size_t HELLO_SIZE = 20;
+static const size_t RESET_SIZE = 1 + 8;
+static const size_t ADD_SIZE = 1 + 8 + 8 + 4 + 1 + FingerPrintGallery::TEMPLATE_SIZE;
+static const size_t REMOVE_SIZE = 1 + 8 + 8;
+static const size_t HEARTBEAT_SIZE = 1 + 8;
+static const uint32_t HEARTBEAT_MS = 1000;
+static const size_t OUT_HIGH_WATER = 256 * 1024;  // stop queueing while a standby lags this far
+
+static void put32(uint8_t* p, uint32_t v) {
+  for (int i = 0; i < 4; i++) p[i] = (v >> (8 * i)) & 0xFF;
+}
+
+static void put64(uint8_t* p, uint64_t v) {
+  for (int i = 0; i < 8; i++) p[i] = (v >> (8 * i)) & 0xFF;
+}
+
+static uint32_t get32(const uint8_t* p) {
+  uint32_t v = 0;
+  for (int i = 3; i >= 0; i--) v = (v << 8) | p[i];
+  return v;
+}
+
+static uint64_t get64(const uint8_t* p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+  return v;
+}
+
+static uint32_t monotonicMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+// Append whatever the socket has ready; false once the peer is gone
+static bool receiveSome(int fd, std::vector<uint8_t>* in) {
+  uint8_t chunk[4096];
+  ssize_t n = recv(fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+  if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return true;
+  }
+  if (n <= 0) {
+    return false;
+  }
+  in->insert(in->end(), chunk, chunk + n);
+  return true;
+}
+
+// Send as much of the queue as the socket takes without blocking
+static bool flushSome(int fd, std::vector<uint8_t>* out) {
+  if (out->empty()) {
+    return true;
+  }
+  ssize_t n = send(fd, &(*out)[0], out->size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (n < 0) {
+    return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK;
+  }
+  out->erase(out->begin(), out->begin() + n);
+  return true;
+}
+
+// Epochs only need to differ between primaries of one deployment
+static uint64_t newEpoch() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  uint64_t epoch = ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec) ^ ((uint64_t)getpid() << 40);
+  return epoch ? epoch : 1;
+}
+
+FingerPrintReplicaPrimary::FingerPrintReplicaPrimary(const FingerPrintGallery& gallery)
+  : _gallery(gallery) {
+  _epoch = newEpoch();
+  _listenFd = -1;
+}
+
+FingerPrintReplicaPrimary::~FingerPrintReplicaPrimary() {
+  stop();
+}
+
+bool FingerPrintReplicaPrimary::listen(uint16_t port) {
+  _listenFd = socket(AF_INET, SOCK_STREAM, 0);
+  if (_listenFd < 0) {
+    return false;
+  }
+  int on = 1;
+  setsockopt(_listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(_listenFd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(_listenFd, 4) != 0) {
+    close(_listenFd);
+    _listenFd = -1;
+    return false;
+  }
+  return true;
+}
+
+void FingerPrintReplicaPrimary::stop() {
+  for (size_t i = 0; i < _standbys.size(); i++) {
+    close(_standbys[i].fd);
+  }
+  _standbys.clear();
+  if (_listenFd >= 0) {
+    close(_listenFd);
+    _listenFd = -1;
+  }
+}
+
+size_t FingerPrintReplicaPrimary::standbyCount() const {
+  return _standbys.size();
+}
+
+uint64_t FingerPrintReplicaPrimary::epoch() const {
+  return _epoch;
+}
+
+// Accept standbys and ship them whatever the log gained since the last call.
+// Call it from the primary's main loop; changes are picked up on the next
+// call after they are made.
+bool FingerPrintReplicaPrimary::poll(int timeoutMs) {
+  if (_listenFd < 0) {
+    return false;
+  }
+  std::vector<struct pollfd> fds(1 + _standbys.size());
+  fds[0].fd = _listenFd;
+  fds[0].events = POLLIN;
+  for (size_t i = 0; i < _standbys.size(); i++) {
+    fds[1 + i].fd = _standbys[i].fd;
+    fds[1 + i].events = POLLIN | (_standbys[i].out.empty() ? 0 : POLLOUT);
+  }
+  if (::poll(&fds[0], fds.size(), timeoutMs) < 0 && errno != EINTR) {
+    return false;
+  }
+
+  const uint32_t now = monotonicMs();
+  for (size_t i = _standbys.size(); i-- > 0;) {
+    bool alive = true;
+    if (fds[1 + i].revents & (POLLIN | POLLHUP | POLLERR)) {
+      alive = receiveSome(_standbys[i].fd, &_standbys[i].in);
+    }
+    if (!alive || !_service(&_standbys[i], now)) {
+      close(_standbys[i].fd);
+      _standbys.erase(_standbys.begin() + i);
+    }
+  }
+
+  if (fds[0].revents & POLLIN) {
+    int fd = accept(_listenFd, nullptr, nullptr);
+    if (fd >= 0) {
+      int on = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      Standby standby;
+      standby.fd = fd;
+      standby.greeted = false;
+      standby.next = 0;
+      standby.lastHeartbeatMs = now;
+      _standbys.push_back(standby);
+    }
+  }
+  return true;
+}
+
+bool FingerPrintReplicaPrimary::_service(Standby* standby, uint32_t nowMs) {
+  if (!standby->greeted) {
+    if (standby->in.size() < HELLO_SIZE) {
+      return true;
+    }
+    if (memcmp(&standby->in[0], HELLO_MAGIC, sizeof(HELLO_MAGIC)) != 0) {
+      return false;
+    }
+    uint64_t epoch = get64(&standby->in[4]);
+    standby->next = get64(&standby->in[12]);
+    standby->in.erase(standby->in.begin(), standby->in.begin() + HELLO_SIZE);
+    if (epoch != _epoch || standby->next > _gallery.sequence()) {
+      // Another history, or ahead of this one: start it over from our log
+      standby->out.resize(RESET_SIZE);
+      standby->out[0] = 'S';
+      put64(&standby->out[1], _epoch);
+      standby->next = 0;
+    }
+    standby->greeted = true;
+  }
+
+  // Queue log entries while the standby keeps up
+  FingerPrintGallery::Change change;
+  while (standby->out.size() < OUT_HIGH_WATER && _gallery.change(standby->next, &change)) {
+    size_t at = standby->out.size();
+    if (change.type == FingerPrintGallery::CHANGE_ADD) {
+      const FingerPrintGallery::Record& record = _gallery.at(change.index);
+      standby->out.resize(at + ADD_SIZE);
+      uint8_t* p = &standby->out[at];
+      p[0] = FingerPrintGallery::CHANGE_ADD;
+      put64(p + 1, standby->next);
+      put64(p + 9, change.index);
+      put32(p + 17, record.userId);
+      p[21] = record.finger;
+      memcpy(p + 22, record.data, FingerPrintGallery::TEMPLATE_SIZE);
+    } else {
+      standby->out.resize(at + REMOVE_SIZE);
+      uint8_t* p = &standby->out[at];
+      p[0] = FingerPrintGallery::CHANGE_REMOVE;
+      put64(p + 1, standby->next);
+      put64(p + 9, change.index);
+    }
+    standby->next++;
+  }
+
+  if (standby->out.empty() && (uint32_t)(nowMs - standby->lastHeartbeatMs) >= HEARTBEAT_MS) {
+    standby->out.resize(HEARTBEAT_SIZE);
+    standby->out[0] = 'H';
+    put64(&standby->out[1], _gallery.sequence());
+    standby->lastHeartbeatMs = nowMs;
+  }
+  return flushSome(standby->fd, &standby->out);
+}
+
+FingerPrintReplicaStandby::FingerPrintReplicaStandby(FingerPrintGallery& gallery, FingerPrintGraphIndex* index)
+  : _gallery(gallery) {
+  _index = index;
+  _fd = -1;
+  _epoch = 0;
+  _primarySequence = 0;
+}
+
+FingerPrintReplicaStandby::~FingerPrintReplicaStandby() {
+  _disconnect();
+}
+
+// Connect and ask for the log from the first change not yet applied here.
+// A primary of another epoch resets the gallery and sends its whole log.
+bool FingerPrintReplicaStandby::connect(const char* host, uint16_t port) {
+  _disconnect();
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* found = nullptr;
+  if (getaddrinfo(host, nullptr, &hints, &found) != 0 || !found) {
+    return false;
+  }
+  struct sockaddr_in addr = *(struct sockaddr_in*)found->ai_addr;
+  freeaddrinfo(found);
+  addr.sin_port = htons(port);
+
+  _fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (_fd < 0 || ::connect(_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    _disconnect();
+    return false;
+  }
+  int on = 1;
+  setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+  uint8_t hello[HELLO_SIZE];
+  memcpy(hello, HELLO_MAGIC, sizeof(HELLO_MAGIC));
+  put64(hello + 4, _epoch);
+  put64(hello + 12, _gallery.sequence());
+  if (send(_fd, hello, sizeof(hello), MSG_NOSIGNAL) != (ssize_t)sizeof(hello)) {
+    _disconnect();
+    return false;
+  }
+  return true;
+}
+
+void FingerPrintReplicaStandby::_disconnect() {
+  if (_fd >= 0) {
+    close(_fd);
+    _fd = -1;
+  }
+  _in.clear();
+}
+
+// Stop following the primary. The gallery and index are already current, so
+// the caller can start serving (or become a primary itself) right away.
+void FingerPrintReplicaStandby::promote() {
+  _disconnect();
+  if (_index) {
+    _index->sync(_gallery);
+  }
+}
+
+uint64_t FingerPrintReplicaStandby::primarySequence() const {
+  return _primarySequence > _gallery.sequence() ? _primarySequence : _gallery.sequence();
+}
+
+uint64_t FingerPrintReplicaStandby::lag() const {
+  return primarySequence() - _gallery.sequence();
+}
+
+// Receive and replay log entries. Returns false when the link is down or the
+// stream no longer lines up with the local gallery; reconnect to resync.
+bool FingerPrintReplicaStandby::poll(int timeoutMs) {
+  if (_fd < 0) {
+    return false;
+  }
+  struct pollfd pfd = {_fd, POLLIN, 0};
+  int ready = ::poll(&pfd, 1, timeoutMs);
+  if (ready < 0 && errno != EINTR) {
+    _disconnect();
+    return false;
+  }
+  if (ready > 0 && (!receiveSome(_fd, &_in) || !_apply())) {
+    _disconnect();
+    return false;
+  }
+  return true;
+}
+
+bool FingerPrintReplicaStandby::_apply() {
+  size_t consumed = 0;
+  bool changed = false;
+  while (consumed < _in.size()) {
+    const uint8_t* p = &_in[consumed];
+    size_t left = _in.size() - consumed;
+    size_t size = p[0] == FingerPrintGallery::CHANGE_ADD ? ADD_SIZE
+                : p[0] == FingerPrintGallery::CHANGE_REMOVE ? REMOVE_SIZE
+                : p[0] == 'H' ? HEARTBEAT_SIZE
+                : p[0] == 'S' ? RESET_SIZE : 0;
+    if (size == 0) {
+      return false;
+    }
+    if (left < size) {
+      break;
+    }
+
+    uint64_t sequence = get64(p + 1);
+    if (p[0] == 'H') {
+      _primarySequence = sequence;
+    } else if (p[0] == 'S') {
+      // Full resync: the gallery is rebuilt from the primary's log
+      _gallery = FingerPrintGallery();
+      if (_index) {
+        _index->clear();
+      }
+      _epoch = sequence;
+      _primarySequence = 0;
+    } else {
+      if (sequence != _gallery.sequence()) {
+        return false;
+      }
+      uint64_t index = get64(p + 9);
+      if (p[0] == FingerPrintGallery::CHANGE_ADD) {
+        if (index != _gallery.size()) {
+          return false;
+        }
+        _gallery.add(get32(p + 17), p[21], p + 22);
+      } else if (!_gallery.remove(index)) {
+        return false;
+      }
+      if (sequence + 1 > _primarySequence) {
+        _primarySequence = sequence + 1;
+      }
+      changed = true;
+    }
+    consumed += size;
+  }
+  _in.erase(_in.begin(), _in.begin() + consumed);
+
+  // Keep the index warm alongside the gallery
+  if (changed && _index) {
+    _index->sync(_gallery);
+  }
+  return true;
+}
+#endif // __linux__
@@ -0,0 +1,77 @@
+#ifndef FINGERPRINT_REPLICA_H
+#define FINGERPRINT_REPLICA_H
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "FingerPrintGallery.h"
+#include "FingerPrintGraphIndex.h"
+
+#if defined(__linux__)
+// Warm-standby replication of a gallery by shipping its change log. The
+// primary streams every add and removal to connected standbys; a standby
+// replays them into its own gallery as they arrive and keeps its graph index
+// in step, so after promote() it serves at full speed immediately.
+//
+// The log lives in memory and starts again from 0 when the primary
+// restarts, so sequence numbers are only comparable within one epoch, drawn
+// at random by each primary. A standby that replayed another epoch, or none,
+// is told to reset and receives the whole log from 0.
+//
+// Wire format, little endian:
+//   standby hello: "FPS2" | epoch u64 | next sequence u64
+//   reset:         'S' | epoch u64 (log follows from sequence 0)
+//   add:           'A' | sequence u64 | index u64 | userId u32 | finger u8 | data[512]
+//   remove:        'R' | sequence u64 | index u64
+//   heartbeat:     'H' | primary sequence u64
+
+class FingerPrintReplicaPrimary {
+  public:
+    FingerPrintReplicaPrimary(const FingerPrintGallery& gallery);
+    ~FingerPrintReplicaPrimary();
+
+    bool listen(uint16_t port);
+    bool poll(int timeoutMs);
+    void stop();
+    size_t standbyCount() const;
+    uint64_t epoch() const;
+  private:
+    struct Standby {
+      int fd;
+      bool greeted;           // hello received, shipping from next
+      uint64_t next;          // next sequence to ship
+      std::vector<uint8_t> in;
+      std::vector<uint8_t> out;
+      uint32_t lastHeartbeatMs;
+    };
+
+    const FingerPrintGallery& _gallery;
+    uint64_t _epoch;
+    int _listenFd;
+    std::vector<Standby> _standbys;
+
+    bool _service(Standby* standby, uint32_t nowMs);
+};
+
+class FingerPrintReplicaStandby {
+  public:
+    FingerPrintReplicaStandby(FingerPrintGallery& gallery, FingerPrintGraphIndex* index = nullptr);
+    ~FingerPrintReplicaStandby();
+
+    bool connect(const char* host, uint16_t port);
+    bool poll(int timeoutMs);
+    void promote();
+    uint64_t primarySequence() const;  // latest sequence the primary reported
+    uint64_t lag() const;              // changes known on the primary but not applied here
+  private:
+    FingerPrintGallery& _gallery;
+    FingerPrintGraphIndex* _index;
+    int _fd;
+    std::vector<uint8_t> _in;
+    uint64_t _epoch;           // primary history replayed here, 0 for none yet
+    uint64_t _primarySequence;
+
+    bool _apply();
+    void _disconnect();
+};
+#endif // __linux__
+#endif // FINGERPRINT_REPLICA_H
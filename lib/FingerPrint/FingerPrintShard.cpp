@@ -0,0 +1,504 @@
+#include "FingerPrintShard.h"
+
+#if defined(__linux__)
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+static const uint8_t REQUEST_MAGIC[4] = {'F', 'P', 'Q', '1'};
+static const uint8_t RESPONSE_MAGIC[4] = {'F', 'P', 'R', '1'};
+static const size_t HEADER_SIZE = 12;
+static const size_t REQUEST_SIZE = HEADER_SIZE + FingerPrintGallery::TEMPLATE_SIZE;
+static const size_t HIT_SIZE = 12;
+static const uint16_t MAX_HITS = 1024;
+
+static void put16(uint8_t* p, uint16_t v) {
+  p[0] = v & 0xFF;
+  p[1] = v >> 8;
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = v >> 24;
+}
+
+static uint16_t get16(const uint8_t* p) {
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool sendAll(int fd, const uint8_t* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Append whatever the socket has ready; false once the peer is gone
+static bool receiveSome(int fd, std::vector<uint8_t>* pending) {
+  uint8_t chunk[4096];
+  ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+  if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+    return true;
+  }
+  if (n <= 0) {
+    return false;
+  }
+  pending->insert(pending->end(), chunk, chunk + n);
+  return true;
+}
+
+static int64_t nowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// sendAll() for non-blocking sockets: waits for room until the deadline
+static bool sendBefore(int fd, const uint8_t* data, size_t size, int64_t deadline) {
+  while (size > 0) {
+    ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && errno == EAGAIN) {
+      int64_t left = deadline - nowMs();
+      struct pollfd pfd = {fd, POLLOUT, 0};
+      if (left <= 0 || ::poll(&pfd, 1, (int)left) <= 0) {
+        return false;
+      }
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool strongerHit(const FingerPrintShardHit& a, const FingerPrintShardHit& b) {
+  return a.score > b.score;
+}
+
+FingerPrintShardServer::FingerPrintShardServer(const FingerPrintGallery& gallery, const FingerPrintIndex* index,
+                                               size_t shortlist)
+  : _gallery(gallery) {
+  _index = index;
+  _shortlist = shortlist ? shortlist : 1;
+  _listenFd = -1;
+  _running = false;
+}
+
+FingerPrintShardServer::~FingerPrintShardServer() {
+  stop();
+}
+
+// Stable user-to-shard assignment, so each process can load its partition
+// independently and all of a user's fingers land on the same shard
+bool FingerPrintShardServer::ownsUser(uint32_t userId, uint16_t shard, uint16_t shardCount) {
+  uint32_t h = userId * 2654435761u;
+  return shardCount == 0 || (h >> 16) % shardCount == shard;
+}
+
+bool FingerPrintShardServer::listen(uint16_t port) {
+  _listenFd = socket(AF_INET, SOCK_STREAM, 0);
+  if (_listenFd < 0) {
+    return false;
+  }
+  int on = 1;
+  setsockopt(_listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(_listenFd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(_listenFd, 16) != 0) {
+    close(_listenFd);
+    _listenFd = -1;
+    return false;
+  }
+  _running = true;
+  return true;
+}
+
+void FingerPrintShardServer::stop() {
+  _running = false;
+  for (size_t i = 0; i < _clients.size(); i++) {
+    close(_clients[i].fd);
+  }
+  _clients.clear();
+  if (_listenFd >= 0) {
+    close(_listenFd);
+    _listenFd = -1;
+  }
+}
+
+void FingerPrintShardServer::serve() {
+  while (_running && poll(1000)) {
+  }
+}
+
+// Wait for traffic and answer every complete request. Returns false once
+// the server is stopped or its socket fails.
+bool FingerPrintShardServer::poll(int timeoutMs) {
+  if (_listenFd < 0) {
+    return false;
+  }
+  std::vector<struct pollfd> fds(1 + _clients.size());
+  fds[0].fd = _listenFd;
+  fds[0].events = POLLIN;
+  for (size_t i = 0; i < _clients.size(); i++) {
+    fds[1 + i].fd = _clients[i].fd;
+    fds[1 + i].events = POLLIN;
+  }
+
+  int ready = ::poll(&fds[0], fds.size(), timeoutMs);
+  if (ready < 0) {
+    return errno == EINTR;
+  }
+
+  // Walk clients backwards so closing one does not shift the rest
+  for (size_t i = _clients.size(); i-- > 0;) {
+    if (!(fds[1 + i].revents & (POLLIN | POLLHUP | POLLERR))) {
+      continue;
+    }
+    if (!receiveSome(_clients[i].fd, &_clients[i].pending) || !_handle(&_clients[i])) {
+      close(_clients[i].fd);
+      _clients.erase(_clients.begin() + i);
+    }
+  }
+
+  if (fds[0].revents & POLLIN) {
+    int fd = accept(_listenFd, nullptr, nullptr);
+    if (fd >= 0) {
+      int on = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      Client client;
+      client.fd = fd;
+      _clients.push_back(client);
+    }
+  }
+  return _running;
+}
+
+bool FingerPrintShardServer::_handle(Client* client) {
+  size_t consumed = 0;
+  std::vector<FingerPrintShardHit> hits;
+  std::vector<uint8_t> response;
+
+  while (client->pending.size() - consumed >= REQUEST_SIZE) {
+    const uint8_t* request = &client->pending[consumed];
+    if (memcmp(request, REQUEST_MAGIC, sizeof(REQUEST_MAGIC)) != 0) {
+      return false; // Out of sync, drop the connection
+    }
+    uint32_t id = get32(request + 4);
+    uint16_t k = get16(request + 8);
+    uint16_t flags = get16(request + 10) & FLAG_TEMPLATES;
+    search(request + HEADER_SIZE, k > MAX_HITS ? MAX_HITS : k, &hits);
+
+    const size_t hitSize = HIT_SIZE + (flags & FLAG_TEMPLATES ? FingerPrintGallery::TEMPLATE_SIZE : 0);
+    response.assign(HEADER_SIZE + hits.size() * hitSize, 0);
+    memcpy(&response[0], RESPONSE_MAGIC, sizeof(RESPONSE_MAGIC));
+    put32(&response[4], id);
+    put16(&response[8], hits.size());
+    put16(&response[10], flags);
+    for (size_t h = 0; h < hits.size(); h++) {
+      uint8_t* p = &response[HEADER_SIZE + h * hitSize];
+      put32(p, hits[h].userId);
+      put32(p + 4, hits[h].record);
+      put16(p + 8, hits[h].score);
+      p[10] = hits[h].finger;
+      if (flags & FLAG_TEMPLATES) {
+        memcpy(p + HIT_SIZE, _gallery.at(hits[h].record).data, FingerPrintGallery::TEMPLATE_SIZE);
+      }
+    }
+    if (!sendAll(client->fd, &response[0], response.size())) {
+      return false;
+    }
+    consumed += REQUEST_SIZE;
+  }
+  client->pending.erase(client->pending.begin(), client->pending.begin() + consumed);
+  return true;
+}
+
+// Best k records of this shard's partition for one probe, scored on the host.
+// With an index attached only its shortlist is scored.
+size_t FingerPrintShardServer::search(const uint8_t probe[FingerPrintGallery::TEMPLATE_SIZE], size_t k,
+                                      std::vector<FingerPrintShardHit>* hits) const {
+  hits->clear();
+  FingerPrintFeatures probeFeatures;
+  if (k == 0 || !FingerPrintMatcher::decode(probe, &probeFeatures)) {
+    return 0;
+  }
+  FingerPrintPreparedProbe prepared;
+  FingerPrintMatcher::prepareProbe(probeFeatures, &prepared);
+
+  std::vector<size_t> candidates;
+  if (_index && _index->size() > 0) {
+    std::vector<FingerPrintIndex::Result> results;
+    _index->search(probeFeatures, _shortlist > k ? _shortlist : k, 1.0f, &results);
+    for (size_t i = 0; i < results.size(); i++) {
+      candidates.push_back(results[i].index);
+    }
+    for (size_t i = _index->coveredRecords(); i < _gallery.size(); i++) {
+      candidates.push_back(i);
+    }
+  } else {
+    for (size_t i = 0; i < _gallery.size(); i++) {
+      candidates.push_back(i);
+    }
+  }
+
+  // Records never change once added, so each is decoded only once
+  for (size_t i = _features.size(); i < _gallery.size(); i++) {
+    _features.push_back(FingerPrintFeatures());
+    _decoded.push_back(FingerPrintMatcher::decode(_gallery.at(i).data, &_features.back()));
+  }
+
+  for (size_t c = 0; c < candidates.size(); c++) {
+    const FingerPrintGallery::Record& record = _gallery.at(candidates[c]);
+    if (!record.active || !_decoded[candidates[c]]) {
+      continue;
+    }
+    FingerPrintShardHit hit;
+    hit.score = FingerPrintMatcher::compare(prepared, _features[candidates[c]]);
+    if (hit.score == 0 || (hits->size() == k && hit.score <= hits->back().score)) {
+      continue;
+    }
+    hit.userId = record.userId;
+    hit.record = candidates[c];
+    hit.finger = record.finger;
+    hit.shard = 0;
+    hits->insert(std::upper_bound(hits->begin(), hits->end(), hit, strongerHit), hit);
+    if (hits->size() > k) {
+      hits->pop_back();
+    }
+  }
+  return hits->size();
+}
+
+FingerPrintShardCoordinator::FingerPrintShardCoordinator() {
+  _nextId = 1;
+  _lastTimeouts = 0;
+}
+
+FingerPrintShardCoordinator::~FingerPrintShardCoordinator() {
+  for (size_t i = 0; i < _shards.size(); i++) {
+    _disconnect(&_shards[i]);
+  }
+}
+
+// False, with no shard added, when host does not resolve to an IPv4 address
+bool FingerPrintShardCoordinator::addShard(const char* host, uint16_t port) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* found = nullptr;
+  if (getaddrinfo(host, nullptr, &hints, &found) != 0 || !found) {
+    return false;
+  }
+
+  Shard shard;
+  shard.address = ((struct sockaddr_in*)found->ai_addr)->sin_addr.s_addr;
+  shard.port = port;
+  shard.fd = -1;
+  freeaddrinfo(found);
+  _shards.push_back(shard);
+  return true;
+}
+
+size_t FingerPrintShardCoordinator::lastTimeouts() const {
+  return _lastTimeouts;
+}
+
+// Non-blocking connect bounded by the request deadline, so a dead host costs
+// at most one timeout. The socket stays non-blocking so sends are bounded too.
+bool FingerPrintShardCoordinator::_connect(Shard* shard, int timeoutMs) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return false;
+  }
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = shard->address;
+  addr.sin_port = htons(shard->port);
+  int result = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+  if (result != 0 && errno == EINPROGRESS) {
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (::poll(&pfd, 1, timeoutMs) == 1 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0) {
+      result = 0;
+    }
+  }
+  if (result != 0) {
+    close(fd);
+    return false;
+  }
+
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  shard->fd = fd;
+  shard->pending.clear();
+  return true;
+}
+
+void FingerPrintShardCoordinator::_disconnect(Shard* shard) {
+  if (shard->fd >= 0) {
+    close(shard->fd);
+    shard->fd = -1;
+  }
+  shard->pending.clear();
+}
+
+// Broadcast a probe to every shard and merge the top-k answers that arrive
+// within timeoutMs. Shards that miss the deadline are left out of this
+// result; their late answers are discarded on the next call.
+size_t FingerPrintShardCoordinator::identify(const uint8_t probe[FingerPrintGallery::TEMPLATE_SIZE], size_t k,
+                                             int timeoutMs, std::vector<FingerPrintShardHit>* hits) {
+  hits->clear();
+  _lastTimeouts = 0;
+  const int64_t deadline = nowMs() + timeoutMs;
+  const uint32_t id = _nextId++;
+
+  uint8_t request[REQUEST_SIZE];
+  memcpy(request, REQUEST_MAGIC, sizeof(REQUEST_MAGIC));
+  put32(request + 4, id);
+  put16(request + 8, k > MAX_HITS ? MAX_HITS : k);
+  put16(request + 10, 0);
+  memcpy(request + HEADER_SIZE, probe, FingerPrintGallery::TEMPLATE_SIZE);
+
+  std::vector<bool> waiting(_shards.size(), false);
+  size_t outstanding = 0;
+  for (size_t s = 0; s < _shards.size(); s++) {
+    // A shard with a full send buffer is given up at the deadline; a partly
+    // sent request leaves the stream unusable, so it is reconnected next time
+    Shard& shard = _shards[s];
+    int64_t left = std::max<int64_t>(deadline - nowMs(), 0);
+    if (shard.fd < 0 && !_connect(&shard, (int)left)) {
+      continue;
+    }
+    if (!sendBefore(shard.fd, request, sizeof(request), deadline)) {
+      _disconnect(&shard);
+      left = std::max<int64_t>(deadline - nowMs(), 0);
+      if (!_connect(&shard, (int)left) || !sendBefore(shard.fd, request, sizeof(request), deadline)) {
+        _disconnect(&shard);
+        continue;
+      }
+    }
+    waiting[s] = true;
+    outstanding++;
+  }
+
+  std::vector<struct pollfd> fds;
+  std::vector<size_t> owners;
+  while (outstanding > 0) {
+    int64_t left = deadline - nowMs();
+    if (left <= 0) {
+      break;
+    }
+    fds.clear();
+    owners.clear();
+    for (size_t s = 0; s < _shards.size(); s++) {
+      if (waiting[s]) {
+        struct pollfd pfd = {_shards[s].fd, POLLIN, 0};
+        fds.push_back(pfd);
+        owners.push_back(s);
+      }
+    }
+    if (::poll(&fds[0], fds.size(), (int)left) <= 0) {
+      continue;
+    }
+
+    for (size_t f = 0; f < fds.size(); f++) {
+      if (!fds[f].revents) {
+        continue;
+      }
+      Shard& shard = _shards[owners[f]];
+      if (!receiveSome(shard.fd, &shard.pending)) {
+        _disconnect(&shard);
+        waiting[owners[f]] = false;
+        outstanding--;
+        continue;
+      }
+
+      // Consume complete responses; stale ones from earlier timeouts are skipped
+      while (shard.pending.size() >= HEADER_SIZE) {
+        if (memcmp(&shard.pending[0], RESPONSE_MAGIC, sizeof(RESPONSE_MAGIC)) != 0) {
+          _disconnect(&shard);
+          waiting[owners[f]] = false;
+          outstanding--;
+          break;
+        }
+        uint16_t count = get16(&shard.pending[8]);
+        size_t hitSize = HIT_SIZE;
+        if (get16(&shard.pending[10]) & FingerPrintShardServer::FLAG_TEMPLATES) {
+          hitSize += FingerPrintGallery::TEMPLATE_SIZE;
+        }
+        size_t size = HEADER_SIZE + count * hitSize;
+        if (shard.pending.size() < size) {
+          break;
+        }
+        if (get32(&shard.pending[4]) == id) {
+          for (uint16_t h = 0; h < count; h++) {
+            const uint8_t* p = &shard.pending[HEADER_SIZE + h * hitSize];
+            FingerPrintShardHit hit;
+            hit.userId = get32(p);
+            hit.record = get32(p + 4);
+            hit.score = get16(p + 8);
+            hit.finger = p[10];
+            hit.shard = owners[f];
+            hits->push_back(hit);
+          }
+          waiting[owners[f]] = false;
+          outstanding--;
+        }
+        shard.pending.erase(shard.pending.begin(), shard.pending.begin() + size);
+      }
+    }
+  }
+
+  _lastTimeouts = _shards.size();
+  for (size_t s = 0; s < _shards.size(); s++) {
+    if (_shards[s].fd >= 0 && !waiting[s]) {
+      _lastTimeouts--;
+    }
+  }
+
+  std::stable_sort(hits->begin(), hits->end(), strongerHit);
+  if (hits->size() > k) {
+    hits->resize(k);
+  }
+  return hits->size();
+}
+#endif // __linux__
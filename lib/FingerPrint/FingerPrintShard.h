@@ -0,0 +1,88 @@
+#ifndef FINGERPRINT_SHARD_H
+#define FINGERPRINT_SHARD_H
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "FingerPrintGallery.h"
+#include "FingerPrintIndex.h"
+
+#if defined(__linux__)
+// Scatter-gather identification for Linux gateways. Each matcher process
+// runs a FingerPrintShardServer over its own partition of the gallery; a
+// FingerPrintShardCoordinator sends every probe to all shards at once,
+// waits up to a deadline and merges their top-K lists.
+//
+// Wire format, little endian, over persistent TCP connections:
+//   request:  "FPQ1" | id u32 | k u16 | flags u16 | template[512]
+//   response: "FPR1" | id u32 | count u16 | flags u16 | count * hit
+//   hit:      userId u32 | record u32 | score u16 | finger u8 | 0 u8 [| template[512]]
+// Flag bit 0 asks for each hit's template after it, so a reader can keep a
+// copy; the response echoes the flags it honoured.
+
+struct FingerPrintShardHit {
+  uint32_t userId;
+  uint32_t record;   // gallery index on the shard that reported it
+  uint16_t score;    // FingerPrintMatcher::score()
+  uint8_t finger;
+  uint16_t shard;    // position of the shard in the coordinator's list
+};
+
+class FingerPrintShardServer {
+  public:
+    static const uint16_t FLAG_TEMPLATES = 0x0001;
+
+    FingerPrintShardServer(const FingerPrintGallery& gallery, const FingerPrintIndex* index = nullptr,
+                           size_t shortlist = 64);
+    ~FingerPrintShardServer();
+    static bool ownsUser(uint32_t userId, uint16_t shard, uint16_t shardCount);
+
+    bool listen(uint16_t port);
+    bool poll(int timeoutMs);
+    void serve();
+    void stop();
+    size_t search(const uint8_t probe[FingerPrintGallery::TEMPLATE_SIZE], size_t k,
+                  std::vector<FingerPrintShardHit>* hits) const;
+  private:
+    struct Client {
+      int fd;
+      std::vector<uint8_t> pending;
+    };
+
+    const FingerPrintGallery& _gallery;
+    const FingerPrintIndex* _index;
+    size_t _shortlist;
+    int _listenFd;
+    bool _running;
+    std::vector<Client> _clients;
+    mutable std::vector<FingerPrintFeatures> _features;  // decoded gallery, filled as it grows
+    mutable std::vector<bool> _decoded;
+
+    bool _handle(Client* client);
+};
+
+class FingerPrintShardCoordinator {
+  public:
+    FingerPrintShardCoordinator();
+    ~FingerPrintShardCoordinator();
+
+    bool addShard(const char* host, uint16_t port);  // false when host does not resolve
+    size_t identify(const uint8_t probe[FingerPrintGallery::TEMPLATE_SIZE], size_t k, int timeoutMs,
+                    std::vector<FingerPrintShardHit>* hits);
+    size_t lastTimeouts() const;  // shards that missed the deadline in the last identify()
+  private:
+    struct Shard {
+      uint32_t address;   // IPv4, network order
+      uint16_t port;
+      int fd;
+      std::vector<uint8_t> pending;
+    };
+
+    std::vector<Shard> _shards;
+    uint32_t _nextId;
+    size_t _lastTimeouts;
+
+    bool _connect(Shard* shard, int timeoutMs);
+    void _disconnect(Shard* shard);
+};
+#endif // __linux__
+#endif // FINGERPRINT_SHARD_H
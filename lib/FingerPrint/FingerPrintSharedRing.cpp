@@ -0,0 +1,325 @@
+#include "FingerPrintSharedRing.h"
+
+#if defined(__linux__)
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+static const uint32_t RING_MAGIC = 0x31524650;  // "PFR1"
+static const int SPIN_ROUNDS = 2000;            // polls before sleeping on the futex, multi-core only
+
+enum SlotState : uint32_t {
+  SLOT_FREE = 0,
+  SLOT_CLAIMED = 1,
+  SLOT_SUBMITTED = 2,
+  SLOT_SERVING = 3,
+  SLOT_DONE = 4,
+};
+
+struct FingerPrintSharedRing::Header {
+  uint32_t magic;
+  uint32_t slotCount;
+  uint32_t submitted;      // bumped on every submit; the daemon sleeps on it
+  uint32_t daemonWaiting;
+  uint32_t reserved[12];   // keep the slots off the header's cache line
+};
+
+static uint32_t load(const uint32_t* word) {
+  return __atomic_load_n(word, __ATOMIC_ACQUIRE);
+}
+
+static void store(uint32_t* word, uint32_t value) {
+  __atomic_store_n(word, value, __ATOMIC_RELEASE);
+}
+
+static bool swap(uint32_t* word, uint32_t expected, uint32_t desired) {
+  return __atomic_compare_exchange_n(word, &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+// Shared (not private) futex ops: the word lives in a mapping two processes share
+static void futexWait(uint32_t* word, uint32_t value, int timeoutMs) {
+  struct timespec ts;
+  ts.tv_sec = timeoutMs / 1000;
+  ts.tv_nsec = (long)(timeoutMs % 1000) * 1000000;
+  syscall(SYS_futex, word, FUTEX_WAIT, value, timeoutMs < 0 ? nullptr : &ts, nullptr, 0);
+}
+
+static void futexWake(uint32_t* word) {
+  syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+// Spinning only pays when the other side can run at the same time
+static int spinRounds() {
+  static const int rounds = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_ROUNDS : 0;
+  return rounds;
+}
+
+static uint32_t nowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+FingerPrintSharedRing::FingerPrintSharedRing() {
+  _header = nullptr;
+  _slots = nullptr;
+  _mappedSize = 0;
+  _name[0] = '\0';
+  _owner = false;
+  _scanFrom = 0;
+}
+
+FingerPrintSharedRing::~FingerPrintSharedRing() {
+  close();
+}
+
+bool FingerPrintSharedRing::_map(int fd, size_t size) {
+  void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (base == MAP_FAILED) {
+    return false;
+  }
+  _header = (Header*)base;
+  _slots = (Slot*)((uint8_t*)base + sizeof(Header));
+  _mappedSize = size;
+  return true;
+}
+
+// Create the segment (name like "/fingerprint"), replacing a stale one left
+// by a daemon that crashed
+bool FingerPrintSharedRing::create(const char* name, uint16_t slots) {
+  close();
+  if (slots == 0 || strlen(name) >= sizeof(_name)) {
+    return false;
+  }
+  shm_unlink(name);
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0660);
+  size_t size = sizeof(Header) + (size_t)slots * sizeof(Slot);
+  if (fd < 0) {
+    return false;
+  }
+  if (ftruncate(fd, size) != 0 || !_map(fd, size)) {
+    shm_unlink(name);
+    return false;
+  }
+  // ftruncate zero-fills: every slot starts FREE
+  _header->slotCount = slots;
+  strcpy(_name, name);
+  _owner = true;
+  store(&_header->magic, RING_MAGIC);
+  return true;
+}
+
+bool FingerPrintSharedRing::attach(const char* name) {
+  close();
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header) || !_map(fd, st.st_size)) {
+    if (!_header) ::close(fd);
+    return false;
+  }
+  if (load(&_header->magic) != RING_MAGIC ||
+      sizeof(Header) + (size_t)_header->slotCount * sizeof(Slot) > _mappedSize) {
+    close();
+    return false;
+  }
+  // Spread clients over the ring so they do not all race for slot 0
+  _scanFrom = (uint32_t)getpid() % _header->slotCount;
+  return true;
+}
+
+void FingerPrintSharedRing::close() {
+  if (_header) {
+    munmap(_header, _mappedSize);
+  }
+  if (_owner) {
+    shm_unlink(_name);
+  }
+  _header = nullptr;
+  _slots = nullptr;
+  _mappedSize = 0;
+  _owner = false;
+}
+
+// Take a free slot, or nullptr when all are in use. The owner word is the
+// claim itself: setting it from 0 to our pid in one CAS means reclaim()
+// never sees a claimed slot without its owner.
+FingerPrintSharedRing::Slot* FingerPrintSharedRing::claim() {
+  if (!_header) {
+    return nullptr;
+  }
+  const uint32_t count = _header->slotCount;
+  const int32_t pid = getpid();
+  for (uint32_t n = 0; n < count; n++) {
+    Slot* slot = &_slots[(_scanFrom + n) % count];
+    int32_t none = 0;
+    if (load(&slot->state) == SLOT_FREE &&
+        __atomic_compare_exchange_n(&slot->owner, &none, pid, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      store(&slot->state, SLOT_CLAIMED);
+      slot->count = 0;
+      _scanFrom = (_scanFrom + n + 1) % count;
+      return slot;
+    }
+  }
+  return nullptr;
+}
+
+// Hand the probe written into slot->probe to the daemon
+void FingerPrintSharedRing::submit(Slot* slot, uint16_t k) {
+  slot->k = k < MAX_HITS ? k : MAX_HITS;
+  store(&slot->state, SLOT_SUBMITTED);
+  __atomic_fetch_add(&_header->submitted, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&_header->daemonWaiting, __ATOMIC_SEQ_CST)) {
+    futexWake(&_header->submitted);
+  }
+}
+
+// Wait until the daemon has filled in the hits. On timeout the slot still
+// belongs to the request: wait again, or release() it once it is done.
+bool FingerPrintSharedRing::wait(Slot* slot, int timeoutMs) {
+  for (int i = 0; i < spinRounds(); i++) {
+    if (load(&slot->state) == SLOT_DONE) {
+      return true;
+    }
+    cpuRelax();
+  }
+  uint32_t start = nowMs();
+  while (true) {
+    uint32_t state = load(&slot->state);
+    if (state == SLOT_DONE) {
+      return true;
+    }
+    int left = timeoutMs - (int)(nowMs() - start);
+    if (timeoutMs >= 0 && left <= 0) {
+      return false;
+    }
+    __atomic_store_n(&slot->waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&slot->state, __ATOMIC_SEQ_CST) == state) {
+      futexWait(&slot->state, state, timeoutMs < 0 ? -1 : left);
+    }
+    __atomic_store_n(&slot->waiting, 0, __ATOMIC_SEQ_CST);
+  }
+}
+
+// FREE first, then the owner: a new claim() can only start once both are clear
+void FingerPrintSharedRing::release(Slot* slot) {
+  store(&slot->state, SLOT_FREE);
+  __atomic_store_n(&slot->owner, 0, __ATOMIC_RELEASE);
+}
+
+// Daemon: take the next submitted request, waiting up to timeoutMs
+FingerPrintSharedRing::Slot* FingerPrintSharedRing::next(int timeoutMs) {
+  if (!_header) {
+    return nullptr;
+  }
+  const uint32_t count = _header->slotCount;
+  uint32_t start = nowMs();
+  int spins = 0;
+  while (true) {
+    uint32_t seen = __atomic_load_n(&_header->submitted, __ATOMIC_SEQ_CST);
+    for (uint32_t n = 0; n < count; n++) {
+      Slot* slot = &_slots[(_scanFrom + n) % count];
+      if (load(&slot->state) == SLOT_SUBMITTED && swap(&slot->state, SLOT_SUBMITTED, SLOT_SERVING)) {
+        _scanFrom = (_scanFrom + n + 1) % count;
+        return slot;
+      }
+    }
+    if (timeoutMs != 0 && spins++ < spinRounds()) {
+      cpuRelax();
+      continue;
+    }
+    int left = timeoutMs - (int)(nowMs() - start);
+    if (timeoutMs >= 0 && left <= 0) {
+      return nullptr;
+    }
+    __atomic_store_n(&_header->daemonWaiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&_header->submitted, __ATOMIC_SEQ_CST) == seen) {
+      futexWait(&_header->submitted, seen, timeoutMs < 0 ? -1 : left);
+    }
+    __atomic_store_n(&_header->daemonWaiting, 0, __ATOMIC_SEQ_CST);
+  }
+}
+
+void FingerPrintSharedRing::complete(Slot* slot) {
+  __atomic_store_n(&slot->state, SLOT_DONE, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&slot->waiting, __ATOMIC_SEQ_CST)) {
+    futexWake(&slot->state);
+  }
+}
+
+// Daemon loop body: answer every pending request with the shard server's
+// host search. Returns the number answered; waits up to timeoutMs for the first.
+size_t FingerPrintSharedRing::serve(const FingerPrintShardServer& server, int timeoutMs) {
+  std::vector<FingerPrintShardHit> hits;
+  size_t served = 0;
+  Slot* slot = next(timeoutMs);
+  while (slot) {
+    // k is client-written: read it once and keep it within hits[]
+    uint16_t k = __atomic_load_n(&slot->k, __ATOMIC_RELAXED);
+    if (k > MAX_HITS) {
+      k = MAX_HITS;
+    }
+    server.search(slot->probe, k, &hits);
+    uint16_t count = 0;
+    for (size_t i = 0; i < hits.size() && count < k; i++, count++) {
+      slot->hits[count].userId = hits[i].userId;
+      slot->hits[count].record = hits[i].record;
+      slot->hits[count].score = hits[i].score;
+      slot->hits[count].finger = hits[i].finger;
+      slot->hits[count].reserved = 0;
+    }
+    slot->count = count;
+    complete(slot);
+    served++;
+    slot = next(0);
+  }
+  return served;
+}
+
+// Daemon: free slots held by clients that exited without releasing them.
+// Returns the number freed. While the owner word holds a dead pid no client
+// can claim the slot, so only requests still with the daemon need waiting
+// out; they are freed on a later call, once complete.
+size_t FingerPrintSharedRing::reclaim() {
+  if (!_header) {
+    return 0;
+  }
+  size_t freed = 0;
+  for (uint32_t i = 0; i < _header->slotCount; i++) {
+    Slot* slot = &_slots[i];
+    int32_t owner = __atomic_load_n(&slot->owner, __ATOMIC_ACQUIRE);
+    if (owner <= 0 || kill(owner, 0) == 0 || errno != ESRCH) {
+      continue;
+    }
+    uint32_t state = load(&slot->state);
+    if (state == SLOT_SUBMITTED || state == SLOT_SERVING) {
+      continue;
+    }
+    store(&slot->state, SLOT_FREE);
+    if (__atomic_compare_exchange_n(&slot->owner, &owner, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      freed++;
+    }
+  }
+  return freed;
+}
+#endif // __linux__
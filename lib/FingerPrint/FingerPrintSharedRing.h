@@ -0,0 +1,74 @@
+#ifndef FINGERPRINT_SHARED_RING_H
+#define FINGERPRINT_SHARED_RING_H
+#include <cstddef>
+#include <cstdint>
+#include "FingerPrintGallery.h"
+#include "FingerPrintShard.h"
+
+#if defined(__linux__)
+// Shared-memory request slots between the identification daemon and local
+// clients (access control, reader bridges, enrollment UI). A client claims a
+// slot, writes the probe straight into it, submits, and reads the hits from
+// the same slot: no sockets and no copies. Slots change hands with atomic
+// compare-and-swap on their state word. Each side spins briefly, then sleeps
+// on a futex, and the other side only makes the wake syscall when someone
+// is asleep.
+//
+// Slot states: FREE -> CLAIMED (client) -> SUBMITTED -> SERVING (daemon)
+//              -> DONE -> FREE (client)
+// A slot belongs to the client whose pid is in owner, set by CAS from 0 in
+// claim() and cleared after FREE in release().
+class FingerPrintSharedRing {
+  public:
+    static const uint16_t MAX_HITS = 16;
+
+    struct Hit {
+      uint32_t userId;
+      uint32_t record;
+      uint16_t score;
+      uint8_t finger;
+      uint8_t reserved;
+    };
+
+    struct Slot {
+      uint32_t state;
+      uint32_t waiting;      // client asleep on state
+      int32_t owner;         // pid of the claiming client, 0 when free
+      uint16_t k;            // hits wanted
+      uint16_t count;        // hits returned
+      uint8_t probe[FingerPrintGallery::TEMPLATE_SIZE];
+      Hit hits[MAX_HITS];
+    };
+
+    FingerPrintSharedRing();
+    ~FingerPrintSharedRing();
+
+    // Daemon side
+    bool create(const char* name, uint16_t slots = 64);
+    Slot* next(int timeoutMs);
+    void complete(Slot* slot);
+    size_t serve(const FingerPrintShardServer& server, int timeoutMs);
+    size_t reclaim();
+
+    // Client side
+    bool attach(const char* name);
+    Slot* claim();
+    void submit(Slot* slot, uint16_t k);
+    bool wait(Slot* slot, int timeoutMs);
+    void release(Slot* slot);
+
+    void close();
+  private:
+    struct Header;
+
+    Header* _header;
+    Slot* _slots;
+    size_t _mappedSize;
+    char _name[64];
+    bool _owner;         // created the segment and unlinks it
+    uint32_t _scanFrom;  // where the next claim() or next() starts looking
+
+    bool _map(int fd, size_t size);
+};
+#endif // __linux__
+#endif // FINGERPRINT_SHARED_RING_H
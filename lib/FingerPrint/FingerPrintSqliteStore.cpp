@@ -0,0 +1,397 @@
+#include "FingerPrintSqliteStore.h"
+
+#if defined(FINGERPRINT_HAS_SQLITE)
+#include <cstring>
+#include <utility>
+
+static void putCrc(uint8_t* p, uint32_t crc) {
+  for (int i = 0; i < 4; i++) p[i] = (crc >> (8 * i)) & 0xFF;
+}
+
+static uint32_t getCrc(const uint8_t* p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+FingerPrintSqliteStore::FingerPrintSqliteStore() {
+  _db = nullptr;
+  _select = nullptr;
+  _insert = nullptr;
+  _delete = nullptr;
+  _blob = nullptr;
+  _batchSize = 256;
+  _corrupt = 0;
+}
+
+FingerPrintSqliteStore::~FingerPrintSqliteStore() {
+  close();
+}
+
+bool FingerPrintSqliteStore::open(const char* path, size_t batchSize) {
+  close();
+  _batchSize = batchSize > 0 ? batchSize : 1;
+  if (sqlite3_open_v2(path, &_db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr) != SQLITE_OK) {
+    close();
+    return false;
+  }
+  const char* schema =
+    "PRAGMA journal_mode=WAL;"
+    "PRAGMA synchronous=NORMAL;"
+    "CREATE TABLE IF NOT EXISTS templates("
+    "id INTEGER PRIMARY KEY, user_id INTEGER NOT NULL, finger INTEGER NOT NULL, data BLOB NOT NULL,"
+    " digest BLOB);";
+  if (sqlite3_exec(_db, schema, nullptr, nullptr, nullptr) != SQLITE_OK) {
+    close();
+    return false;
+  }
+  // Tables created before the digest column: fails harmlessly once it exists
+  sqlite3_exec(_db, "ALTER TABLE templates ADD COLUMN digest BLOB", nullptr, nullptr, nullptr);
+  if (
+      sqlite3_prepare_v2(_db, "SELECT id, user_id, finger, digest FROM templates ORDER BY id", -1, &_select, nullptr) != SQLITE_OK ||
+      sqlite3_prepare_v2(_db, "INSERT INTO templates(user_id, finger, data, digest) VALUES(?, ?, ?, ?)", -1, &_insert, nullptr) != SQLITE_OK ||
+      sqlite3_prepare_v2(_db, "DELETE FROM templates WHERE id = ?", -1, &_delete, nullptr) != SQLITE_OK) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+void FingerPrintSqliteStore::close() {
+  if (_db && !_batch.empty()) {
+    flush();
+  }
+  _closeBlob();
+  sqlite3_finalize(_select);
+  sqlite3_finalize(_insert);
+  sqlite3_finalize(_delete);
+  if (_db) sqlite3_close(_db);
+  _db = nullptr;
+  _select = nullptr;
+  _insert = nullptr;
+  _delete = nullptr;
+  _batch.clear();
+  _rowIds.clear();
+}
+
+// Read one template straight into out and check its CRC. Within load() the
+// blob handle is moved to the next row with sqlite3_blob_reopen, which
+// skips statement setup; it has to be reopened after writes to the table.
+// An open handle holds a read transaction, which keeps WAL checkpoints from
+// completing, so callers close it with _closeBlob() when they are done.
+bool FingerPrintSqliteStore::_readBlob(int64_t rowId, uint8_t* out) {
+  int rc;
+  if (_blob) {
+    rc = sqlite3_blob_reopen(_blob, rowId);
+    if (rc == SQLITE_ABORT) {
+      sqlite3_blob_close(_blob);
+      _blob = nullptr;
+    }
+  }
+  if (!_blob) {
+    rc = sqlite3_blob_open(_db, "main", "templates", "data", rowId, 0, &_blob);
+    if (rc != SQLITE_OK) {
+      sqlite3_blob_close(_blob);
+      _blob = nullptr;
+      return false;
+    }
+  }
+  if (rc != SQLITE_OK) {
+    return false;
+  }
+  int bytes = sqlite3_blob_bytes(_blob);
+  if (bytes == FingerPrintGallery::TEMPLATE_SIZE) {
+    return sqlite3_blob_read(_blob, out, FingerPrintGallery::TEMPLATE_SIZE, 0) == SQLITE_OK;
+  }
+  uint8_t crc[4];
+  if (bytes != (int)STORED_SIZE ||
+      sqlite3_blob_read(_blob, out, FingerPrintGallery::TEMPLATE_SIZE, 0) != SQLITE_OK ||
+      sqlite3_blob_read(_blob, crc, sizeof(crc), FingerPrintGallery::TEMPLATE_SIZE) != SQLITE_OK) {
+    _corrupt++;
+    return false;
+  }
+  if (FingerPrintDigest::crc32c(out, FingerPrintGallery::TEMPLATE_SIZE) != getCrc(crc)) {
+    _corrupt++;
+    return false;
+  }
+  return true;
+}
+
+void FingerPrintSqliteStore::_closeBlob() {
+  if (_blob) {
+    sqlite3_blob_close(_blob);
+    _blob = nullptr;
+  }
+}
+
+// Append every stored template to the gallery. Returns the number loaded;
+// rows that fail the CRC are skipped and counted in corruptCount().
+size_t FingerPrintSqliteStore::load(FingerPrintGallery& gallery) {
+  if (!_db) {
+    return 0;
+  }
+  // One read transaction for the whole scan instead of one per row
+  bool ownTransaction = sqlite3_get_autocommit(_db);
+  if (ownTransaction) {
+    sqlite3_exec(_db, "BEGIN", nullptr, nullptr, nullptr);
+  }
+
+  size_t loaded = 0;
+  uint8_t data[FingerPrintGallery::TEMPLATE_SIZE];
+  sqlite3_reset(_select);
+  while (sqlite3_step(_select) == SQLITE_ROW) {
+    int64_t rowId = sqlite3_column_int64(_select, 0);
+    if (!_readBlob(rowId, data)) {
+      continue;
+    }
+    // Hashing every row would cost more than the read. The stored digest
+    // goes to the gallery as its dedup key, which compares bytes before
+    // sharing them and checks the digest on lookup; audit() checks them all.
+    const uint8_t* digest = nullptr;
+    if (sqlite3_column_bytes(_select, 3) == FingerPrintDigest::SHA256_SIZE) {
+      digest = (const uint8_t*)sqlite3_column_blob(_select, 3);
+    }
+    size_t index = gallery.add((uint32_t)sqlite3_column_int64(_select, 1),
+                               (uint8_t)sqlite3_column_int(_select, 2), data, digest);
+    if (_rowIds.size() <= index) {
+      _rowIds.resize(index + 1, 0);
+    }
+    _rowIds[index] = rowId;
+    loaded++;
+  }
+  sqlite3_reset(_select);
+  _closeBlob();
+
+  if (ownTransaction) {
+    sqlite3_exec(_db, "COMMIT", nullptr, nullptr, nullptr);
+  }
+  return loaded;
+}
+
+// Open the batch transaction unless it is already open. A batch whose
+// commit failed is written again first.
+bool FingerPrintSqliteStore::_begin() {
+  if (!sqlite3_get_autocommit(_db)) {
+    return true;
+  }
+  if (sqlite3_exec(_db, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr) != SQLITE_OK) {
+    return false;
+  }
+  if (!_batch.empty() && !_replay()) {
+    sqlite3_exec(_db, "ROLLBACK", nullptr, nullptr, nullptr);
+    return false;
+  }
+  return true;
+}
+
+// Redo the rolled-back batch in the transaction _begin() opened. Inserts
+// get new row ids, which later deletes in the batch and _rowIds follow.
+bool FingerPrintSqliteStore::_replay() {
+  std::vector<std::pair<int64_t, int64_t> > moved;  // row id in the lost batch, then now
+  for (size_t i = 0; i < _batch.size(); i++) {
+    Write& write = _batch[i];
+    if (write.remove) {
+      for (size_t m = 0; m < moved.size(); m++) {
+        if (moved[m].first == write.rowId) write.rowId = moved[m].second;
+      }
+      if (!_deleteRow(write.rowId)) {
+        return false;
+      }
+      continue;
+    }
+    int64_t rowId = _insertRow(write);
+    if (rowId == 0) {
+      return false;
+    }
+    moved.push_back(std::make_pair(write.rowId, rowId));
+    if (_rowIds[write.index] == write.rowId) {
+      _rowIds[write.index] = rowId;
+    }
+    write.rowId = rowId;
+  }
+  return true;
+}
+
+// New row id, 0 when the INSERT failed
+int64_t FingerPrintSqliteStore::_insertRow(const Write& write) {
+  sqlite3_reset(_insert);
+  sqlite3_bind_int64(_insert, 1, write.userId);
+  sqlite3_bind_int(_insert, 2, write.finger);
+  sqlite3_bind_blob(_insert, 3, write.stored, sizeof(write.stored), SQLITE_STATIC);
+  sqlite3_bind_blob(_insert, 4, write.digest, sizeof(write.digest), SQLITE_STATIC);
+  bool ok = sqlite3_step(_insert) == SQLITE_DONE;
+  sqlite3_clear_bindings(_insert);
+  return ok ? sqlite3_last_insert_rowid(_db) : 0;
+}
+
+bool FingerPrintSqliteStore::_deleteRow(int64_t rowId) {
+  sqlite3_reset(_delete);
+  sqlite3_bind_int64(_delete, 1, rowId);
+  return sqlite3_step(_delete) == SQLITE_DONE;
+}
+
+// Add to the gallery and queue the row in the current batch. The batch is
+// committed once it reaches batchSize, or by flush(). Returns the gallery
+// index, or FingerPrintGallery::NOT_FOUND if the row could not be written.
+size_t FingerPrintSqliteStore::enroll(FingerPrintGallery& gallery, uint32_t userId, uint8_t finger,
+                                      const uint8_t data[FingerPrintGallery::TEMPLATE_SIZE]) {
+  if (!_db || !_begin()) {
+    return FingerPrintGallery::NOT_FOUND;
+  }
+  Write write;
+  write.remove = false;
+  write.userId = userId;
+  write.finger = finger;
+  memcpy(write.stored, data, FingerPrintGallery::TEMPLATE_SIZE);
+  putCrc(write.stored + FingerPrintGallery::TEMPLATE_SIZE, FingerPrintDigest::crc32c(data, FingerPrintGallery::TEMPLATE_SIZE));
+  FingerPrintDigest::sha256(data, FingerPrintGallery::TEMPLATE_SIZE, write.digest);
+  write.rowId = _insertRow(write);
+  if (write.rowId == 0) {
+    return FingerPrintGallery::NOT_FOUND;
+  }
+
+  write.index = gallery.add(userId, finger, data, write.digest);
+  if (_rowIds.size() <= write.index) {
+    _rowIds.resize(write.index + 1, 0);
+  }
+  _rowIds[write.index] = write.rowId;
+  _batch.push_back(write);
+  if (_batch.size() >= _batchSize) {
+    flush();
+  }
+  return write.index;
+}
+
+// Delete the row, then drop the record from the gallery. Nothing changes in
+// memory when the DELETE fails.
+bool FingerPrintSqliteStore::remove(FingerPrintGallery& gallery, size_t index) {
+  int64_t rowId = rowIdOf(index);
+  if (!_db || rowId == 0 || index >= gallery.size() || !gallery.at(index).active || !_begin()) {
+    return false;
+  }
+  if (!_deleteRow(rowId)) {
+    return false;
+  }
+  Write write;
+  write.remove = true;
+  write.index = index;
+  write.rowId = rowId;
+  _batch.push_back(write);
+  gallery.remove(index);
+  _rowIds[index] = 0;
+  if (_batch.size() >= _batchSize) {
+    flush();
+  }
+  return true;
+}
+
+// Commit queued writes. When the commit fails the transaction is rolled
+// back but the writes stay queued, already applied to the gallery; the next
+// write or flush() replays them.
+bool FingerPrintSqliteStore::flush() {
+  if (!_db) {
+    return true;
+  }
+  if (sqlite3_get_autocommit(_db) && (_batch.empty() || !_begin())) {
+    return _batch.empty();
+  }
+  if (sqlite3_exec(_db, "COMMIT", nullptr, nullptr, nullptr) != SQLITE_OK) {
+    if (!sqlite3_get_autocommit(_db)) {
+      sqlite3_exec(_db, "ROLLBACK", nullptr, nullptr, nullptr);
+    }
+    return false;
+  }
+  _batch.clear();
+  return true;
+}
+
+int64_t FingerPrintSqliteStore::rowIdOf(size_t index) const {
+  return index < _rowIds.size() ? _rowIds[index] : 0;
+}
+
+// Fetch one template by row id without going through the gallery
+bool FingerPrintSqliteStore::readTemplate(int64_t rowId, uint8_t out[FingerPrintGallery::TEMPLATE_SIZE]) {
+  if (!_db) {
+    return false;
+  }
+  bool ok = _readBlob(rowId, out);
+  _closeBlob();
+  return ok;
+}
+
+size_t FingerPrintSqliteStore::corruptCount() const {
+  return _corrupt;
+}
+
+// Full check for background use: every row's CRC and SHA-256. Rows without
+// a CRC or digest are upgraded in place. Returns the number of rows checked;
+// ids of rows that fail either check go to corrupt.
+size_t FingerPrintSqliteStore::audit(std::vector<int64_t>* corrupt) {
+  if (!_db) {
+    return 0;
+  }
+  flush();
+  sqlite3_stmt* scan = nullptr;
+  sqlite3_stmt* upgrade = nullptr;
+  if (sqlite3_prepare_v2(_db, "SELECT id, data, digest FROM templates ORDER BY id", -1, &scan, nullptr) != SQLITE_OK ||
+      sqlite3_prepare_v2(_db, "UPDATE templates SET data = ?, digest = ? WHERE id = ?", -1, &upgrade, nullptr) != SQLITE_OK) {
+    sqlite3_finalize(scan);
+    sqlite3_finalize(upgrade);
+    return 0;
+  }
+
+  sqlite3_exec(_db, "BEGIN", nullptr, nullptr, nullptr);
+  size_t checked = 0;
+  std::vector<int64_t> upgrades;
+  std::vector<uint8_t> upgradeData;  // stored bytes then digest, per upgrade
+  while (sqlite3_step(scan) == SQLITE_ROW) {
+    int64_t rowId = sqlite3_column_int64(scan, 0);
+    const uint8_t* data = (const uint8_t*)sqlite3_column_blob(scan, 1);
+    int bytes = sqlite3_column_bytes(scan, 1);
+    const uint8_t* stored = (const uint8_t*)sqlite3_column_blob(scan, 2);
+    bool hasDigest = sqlite3_column_bytes(scan, 2) == FingerPrintDigest::SHA256_SIZE;
+    checked++;
+
+    bool bad = bytes != FingerPrintGallery::TEMPLATE_SIZE && bytes != (int)STORED_SIZE;
+    bool hasCrc = bytes == (int)STORED_SIZE;
+    uint8_t digest[FingerPrintDigest::SHA256_SIZE];
+    if (!bad) {
+      FingerPrintDigest::sha256(data, FingerPrintGallery::TEMPLATE_SIZE, digest);
+      bad = (hasCrc && FingerPrintDigest::crc32c(data, FingerPrintGallery::TEMPLATE_SIZE) !=
+                       getCrc(data + FingerPrintGallery::TEMPLATE_SIZE)) ||
+            (hasDigest && memcmp(digest, stored, sizeof(digest)) != 0);
+    }
+    if (bad) {
+      if (corrupt) corrupt->push_back(rowId);
+      continue;
+    }
+    if (!hasCrc || !hasDigest) {
+      upgrades.push_back(rowId);
+      size_t at = upgradeData.size();
+      upgradeData.resize(at + STORED_SIZE + sizeof(digest));
+      memcpy(&upgradeData[at], data, FingerPrintGallery::TEMPLATE_SIZE);
+      putCrc(&upgradeData[at + FingerPrintGallery::TEMPLATE_SIZE], FingerPrintDigest::crc32c(data, FingerPrintGallery::TEMPLATE_SIZE));
+      memcpy(&upgradeData[at + STORED_SIZE], digest, sizeof(digest));
+    }
+  }
+  sqlite3_reset(scan);
+  sqlite3_exec(_db, "COMMIT", nullptr, nullptr, nullptr);
+
+  // Upgrade in a short write transaction after the scan, not under it
+  if (!upgrades.empty()) {
+    sqlite3_exec(_db, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr);
+  }
+  for (size_t i = 0; i < upgrades.size(); i++) {
+    const uint8_t* row = &upgradeData[i * (STORED_SIZE + FingerPrintDigest::SHA256_SIZE)];
+    sqlite3_reset(upgrade);
+    sqlite3_bind_blob(upgrade, 1, row, STORED_SIZE, SQLITE_STATIC);
+    sqlite3_bind_blob(upgrade, 2, row + STORED_SIZE, FingerPrintDigest::SHA256_SIZE, SQLITE_STATIC);
+    sqlite3_bind_int64(upgrade, 3, upgrades[i]);
+    sqlite3_step(upgrade);
+  }
+  if (!upgrades.empty()) {
+    sqlite3_exec(_db, "COMMIT", nullptr, nullptr, nullptr);
+  }
+  sqlite3_finalize(scan);
+  sqlite3_finalize(upgrade);
+  return checked;
+}
+#endif // FINGERPRINT_HAS_SQLITE
@@ -0,0 +1,78 @@
+#ifndef FINGERPRINT_SQLITE_STORE_H
+#define FINGERPRINT_SQLITE_STORE_H
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "FingerPrintDigest.h"
+#include "FingerPrintGallery.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sqlite3.h>)
+#define FINGERPRINT_HAS_SQLITE 1
+#endif
+#endif
+
+#if defined(FINGERPRINT_HAS_SQLITE)
+#include <sqlite3.h>
+
+// Keeps a FingerPrintGallery backed by an SQLite table on Linux gateways:
+//   templates(id INTEGER PRIMARY KEY, user_id INTEGER, finger INTEGER, data BLOB, digest BLOB)
+// Statements are prepared once in open(). Template bytes are read with
+// incremental BLOB I/O into the caller's buffer (e.g. the upload frame), and
+// enrollments are grouped into one transaction per batch.
+//
+// data holds the template followed by its CRC32C (little endian), checked
+// on every read; digest is its SHA-256, checked only by audit(). Rows
+// written before the CRC was added (512-byte data) are read unchecked until
+// audit() upgrades them.
+class FingerPrintSqliteStore {
+  public:
+    FingerPrintSqliteStore();
+    ~FingerPrintSqliteStore();
+
+    bool open(const char* path, size_t batchSize = 256);
+    void close();
+
+    size_t load(FingerPrintGallery& gallery);
+    size_t enroll(FingerPrintGallery& gallery, uint32_t userId, uint8_t finger,
+                  const uint8_t data[FingerPrintGallery::TEMPLATE_SIZE]);
+    bool remove(FingerPrintGallery& gallery, size_t index);
+    bool flush();
+
+    int64_t rowIdOf(size_t index) const;
+    bool readTemplate(int64_t rowId, uint8_t out[FingerPrintGallery::TEMPLATE_SIZE]);
+    size_t corruptCount() const;   // reads rejected by the CRC so far
+
+    size_t audit(std::vector<int64_t>* corrupt = nullptr);
+  private:
+    static const size_t STORED_SIZE = FingerPrintGallery::TEMPLATE_SIZE + 4;
+    // One write of the open batch, kept until it commits so a batch SQLite
+    // rolled back can be written again
+    struct Write {
+      bool remove;
+      size_t index;          // gallery record
+      int64_t rowId;         // row inserted or deleted
+      uint32_t userId;
+      uint8_t finger;
+      uint8_t stored[STORED_SIZE];  // inserts only
+      uint8_t digest[FingerPrintDigest::SHA256_SIZE];
+    };
+    sqlite3* _db;
+    sqlite3_stmt* _select;
+    sqlite3_stmt* _insert;
+    sqlite3_stmt* _delete;
+    sqlite3_blob* _blob;       // open only while load() moves it between rows
+    size_t _batchSize;
+    std::vector<Write> _batch; // writes not yet committed
+    size_t _corrupt;
+    std::vector<int64_t> _rowIds;  // by gallery index, 0 when not stored
+
+    bool _begin();
+    bool _replay();
+    int64_t _insertRow(const Write& write);
+    bool _deleteRow(int64_t rowId);
+    bool _readBlob(int64_t rowId, uint8_t* out);
+    void _closeBlob();
+};
+#endif // FINGERPRINT_HAS_SQLITE
+#endif // FINGERPRINT_SQLITE_STORE_H
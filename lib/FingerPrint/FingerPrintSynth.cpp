@@ -0,0 +1,315 @@
+#include "FingerPrintSynth.h"
+#include <cmath>
+#include <cstring>
+
+static const float PI = 3.14159265f;
+static const uint8_t ANGLE_BINS = 16;
+static const int KERNEL_RADIUS = 6;
+static const int KERNEL_SIZE = 2 * KERNEL_RADIUS + 1;
+static const uint8_t GROW_ITERATIONS = 10;
+static const float CENTER_X = FingerPrintSynth::WIDTH / 2.0f;
+static const float CENTER_Y = FingerPrintSynth::HEIGHT / 2.0f + 8;
+static const float RADIUS_X = 108;
+static const float RADIUS_Y = 132;
+
+// xorshift32; seeds are mixed first so neighbouring seeds diverge
+static uint32_t nextRandom(uint32_t* state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+static uint32_t mixSeed(uint32_t seed) {
+  seed = (seed ^ 61) ^ (seed >> 16);
+  seed *= 9;
+  seed ^= seed >> 4;
+  seed *= 0x27d4eb2d;
+  seed ^= seed >> 15;
+  return seed ? seed : 1;
+}
+
+static float uniform(uint32_t* state) {
+  return (nextRandom(state) >> 8) * (1.0f / 16777216.0f);
+}
+
+static float gaussian(uint32_t* state) {
+  float u = uniform(state) + 1e-7f;
+  float v = uniform(state);
+  return sqrtf(-2.0f * logf(u)) * cosf(2 * PI * v);
+}
+
+// 0 outside the fingertip ellipse, 1 well inside, soft near the edge
+static float fingerMask(float x, float y) {
+  float dx = (x - CENTER_X) / RADIUS_X;
+  float dy = (y - CENTER_Y) / RADIUS_Y;
+  float r = sqrtf(dx * dx + dy * dy);
+  if (r >= 1) return 0;
+  if (r < 0.9f) return 1;
+  return (1 - r) * 10;
+}
+
+FingerPrintSynth::FingerPrintSynth(uint32_t seed, PatternClass pattern) {
+  _seed = mixSeed(seed);
+  _pattern = pattern;
+  _place();
+}
+
+FingerPrintSynth::FingerPrintSynth(uint32_t seed) {
+  _seed = mixSeed(seed);
+  // Roughly the natural mix: loops most common, then whorls, then arches
+  uint32_t pick = _seed % 100;
+  _pattern = pick < 32 ? PATTERN_LEFT_LOOP : pick < 64 ? PATTERN_RIGHT_LOOP
+           : pick < 90 ? PATTERN_WHORL : pick < 95 ? PATTERN_TENTED_ARCH : PATTERN_ARCH;
+  _place();
+}
+
+FingerPrintSynth::PatternClass FingerPrintSynth::pattern() const {
+  return _pattern;
+}
+
+// Place the singular points for the pattern class, jittered by the seed
+void FingerPrintSynth::_place() {
+  uint32_t state = _seed;
+  float jx = (uniform(&state) - 0.5f) * 24;
+  float jy = (uniform(&state) - 0.5f) * 24;
+  _period = 8.5f + uniform(&state) * 2;
+  _archHeight = 25 + uniform(&state) * 25;
+  _coreCount = 0;
+  _deltaCount = 0;
+
+  float cx = CENTER_X + jx;
+  float cy = CENTER_Y - 20 + jy;
+  switch (_pattern) {
+    case PATTERN_ARCH:
+      break;
+    case PATTERN_TENTED_ARCH:
+      _cores[_coreCount][0] = cx;      _cores[_coreCount++][1] = cy;
+      _deltas[_deltaCount][0] = cx;    _deltas[_deltaCount++][1] = cy + 40 + uniform(&state) * 20;
+      break;
+    case PATTERN_LEFT_LOOP:
+    case PATTERN_RIGHT_LOOP: {
+      float side = _pattern == PATTERN_LEFT_LOOP ? 1.0f : -1.0f;
+      _cores[_coreCount][0] = cx - side * 10;   _cores[_coreCount++][1] = cy;
+      _deltas[_deltaCount][0] = cx + side * (50 + uniform(&state) * 20);
+      _deltas[_deltaCount++][1] = cy + 70 + uniform(&state) * 20;
+      break;
+    }
+    case PATTERN_WHORL: {
+      float spread = 12 + uniform(&state) * 10;
+      _cores[_coreCount][0] = cx - 4;  _cores[_coreCount++][1] = cy - spread;
+      _cores[_coreCount][0] = cx + 4;  _cores[_coreCount++][1] = cy + spread;
+      _deltas[_deltaCount][0] = cx - 70 - uniform(&state) * 15;
+      _deltas[_deltaCount++][1] = cy + 75 + uniform(&state) * 15;
+      _deltas[_deltaCount][0] = cx + 70 + uniform(&state) * 15;
+      _deltas[_deltaCount++][1] = cy + 75 + uniform(&state) * 15;
+      break;
+    }
+  }
+}
+
+// Ridge direction at (x, y), radians modulo pi. Sherlock-Monro: each core
+// turns the field by half its argument, each delta by minus half.
+float FingerPrintSynth::_orientation(float x, float y) const {
+  if (_coreCount == 0) {
+    // Plain arch: ridges across the finger, bowed up over the centre
+    float sigma = 60;
+    float u = (x - CENTER_X) / sigma;
+    float fade = 0.3f + 0.7f * (y / HEIGHT);
+    float slope = _archHeight * fade * u / sigma * expf(-0.5f * u * u);
+    return atanf(slope);
+  }
+  float theta = 0;
+  for (uint8_t i = 0; i < _coreCount; i++) {
+    theta += 0.5f * atan2f(y - _cores[i][1], x - _cores[i][0]);
+  }
+  for (uint8_t i = 0; i < _deltaCount; i++) {
+    theta -= 0.5f * atan2f(y - _deltas[i][1], x - _deltas[i][0]);
+  }
+  return theta;
+}
+
+// Grow ridges from sparse random seeds by filtering, again and again, with
+// a Gabor kernel tuned to the local orientation and ridge period, then
+// saturating. Ridge endings and bifurcations appear where growth fronts meet.
+void FingerPrintSynth::_grow() {
+  const size_t pixels = (size_t)WIDTH * HEIGHT;
+  _angles.resize(pixels);
+  std::vector<float> mask(pixels);
+  for (uint16_t y = 0; y < HEIGHT; y++) {
+    for (uint16_t x = 0; x < WIDTH; x++) {
+      float theta = _orientation(x, y);
+      float turns = theta / PI;
+      turns -= floorf(turns);
+      _angles[(size_t)y * WIDTH + x] = (uint8_t)(turns * ANGLE_BINS + 0.5f) % ANGLE_BINS;
+      mask[(size_t)y * WIDTH + x] = fingerMask(x, y);
+    }
+  }
+
+  // One zero-mean kernel per orientation bin, cosine across the ridges
+  std::vector<float> kernels((size_t)ANGLE_BINS * KERNEL_SIZE * KERNEL_SIZE);
+  float sigma = _period * 0.45f;
+  for (uint8_t a = 0; a < ANGLE_BINS; a++) {
+    float theta = a * PI / ANGLE_BINS;
+    float* k = &kernels[(size_t)a * KERNEL_SIZE * KERNEL_SIZE];
+    float sum = 0;
+    float weight = 0;
+    for (int dy = -KERNEL_RADIUS; dy <= KERNEL_RADIUS; dy++) {
+      for (int dx = -KERNEL_RADIUS; dx <= KERNEL_RADIUS; dx++) {
+        float across = -dx * sinf(theta) + dy * cosf(theta);
+        float envelope = expf(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+        float v = envelope * cosf(2 * PI * across / _period);
+        k[(dy + KERNEL_RADIUS) * KERNEL_SIZE + dx + KERNEL_RADIUS] = v;
+        sum += v;
+        weight += envelope;
+      }
+    }
+    for (int i = 0; i < KERNEL_SIZE * KERNEL_SIZE; i++) {
+      int dy = i / KERNEL_SIZE - KERNEL_RADIUS;
+      int dx = i % KERNEL_SIZE - KERNEL_RADIUS;
+      k[i] -= sum / weight * expf(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+    }
+  }
+
+  uint32_t state = _seed ^ 0xA5A5A5A5;
+  std::vector<float> current(pixels, 0.0f);
+  std::vector<float> next(pixels, 0.0f);
+  for (size_t i = 0; i < pixels; i++) {
+    if (mask[i] > 0 && nextRandom(&state) % 150 == 0) {
+      current[i] = (nextRandom(&state) & 1) ? 1.0f : -1.0f;
+    }
+  }
+
+  for (uint8_t iteration = 0; iteration < GROW_ITERATIONS; iteration++) {
+    for (int y = 0; y < HEIGHT; y++) {
+      for (int x = 0; x < WIDTH; x++) {
+        size_t at = (size_t)y * WIDTH + x;
+        if (mask[at] <= 0) {
+          next[at] = 0;
+          continue;
+        }
+        const float* k = &kernels[(size_t)_angles[at] * KERNEL_SIZE * KERNEL_SIZE];
+        float v = 0;
+        for (int dy = -KERNEL_RADIUS; dy <= KERNEL_RADIUS; dy++) {
+          int yy = y + dy;
+          if (yy < 0 || yy >= HEIGHT) continue;
+          const float* row = &current[(size_t)yy * WIDTH];
+          const float* kr = k + (dy + KERNEL_RADIUS) * KERNEL_SIZE + KERNEL_RADIUS;
+          int lo = x - KERNEL_RADIUS < 0 ? -x : -KERNEL_RADIUS;
+          int hi = x + KERNEL_RADIUS >= WIDTH ? WIDTH - 1 - x : KERNEL_RADIUS;
+          for (int dx = lo; dx <= hi; dx++) {
+            v += kr[dx] * row[x + dx];
+          }
+        }
+        v *= 2;
+        next[at] = v > 1 ? 1 : v < -1 ? -1 : v;
+      }
+    }
+    current.swap(next);
+  }
+
+  for (size_t i = 0; i < pixels; i++) {
+    current[i] *= mask[i];
+  }
+  _ridges.swap(current);
+}
+
+// Bilinear read of the master pattern, 0 off the image
+float FingerPrintSynth::_sample(float x, float y) const {
+  if (x < 0 || y < 0 || x >= WIDTH - 1 || y >= HEIGHT - 1) {
+    return 0;
+  }
+  int x0 = (int)x;
+  int y0 = (int)y;
+  float fx = x - x0;
+  float fy = y - y0;
+  const float* p = &_ridges[(size_t)y0 * WIDTH + x0];
+  return (p[0] * (1 - fx) + p[1] * fx) * (1 - fy) + (p[WIDTH] * (1 - fx) + p[WIDTH + 1] * fx) * fy;
+}
+
+// The ideal print, centred, full contact and noise free
+void FingerPrintSynth::master(std::vector<uint8_t>* image) {
+  Impression clean;
+  memset(&clean, 0, sizeof(clean));
+  impression(0, clean, image);
+}
+
+FingerPrintSynth::Impression FingerPrintSynth::defaultImpression() {
+  Impression params;
+  params.noise = 0.3f;
+  params.partiality = 0.15f;
+  params.dryness = 0.2f;
+  params.rotation = 15;
+  params.shift = 20;
+  params.distortion = 0.3f;
+  return params;
+}
+
+// One capture of this finger. The same impressionSeed and params always give
+// the same image; different seeds give different placements of one finger.
+void FingerPrintSynth::impression(uint32_t impressionSeed, const Impression& params, std::vector<uint8_t>* image) {
+  if (_ridges.empty()) {
+    _grow();
+  }
+  uint32_t state = mixSeed(impressionSeed ^ _seed);
+  float angle = (uniform(&state) * 2 - 1) * params.rotation * PI / 180;
+  float shiftX = (uniform(&state) * 2 - 1) * params.shift;
+  float shiftY = (uniform(&state) * 2 - 1) * params.shift;
+  float cosA = cosf(angle);
+  float sinA = sinf(angle);
+
+  // Smooth displacement field for skin stretch and a low-frequency field
+  // for where the skin is too dry to print
+  float warp[4];
+  float dry[6];
+  for (int i = 0; i < 4; i++) warp[i] = uniform(&state) * 2 * PI;
+  for (int i = 0; i < 6; i++) dry[i] = uniform(&state) * 2 * PI;
+  float warpAmount = params.distortion * 5;
+
+  // Partial contact: cut away one side of the print along a random line
+  float cutAngle = uniform(&state) * 2 * PI;
+  float cutX = cosf(cutAngle);
+  float cutY = sinf(cutAngle);
+  float cutAt = (1 - 2 * params.partiality) * RADIUS_X;
+
+  image->resize((size_t)WIDTH * HEIGHT);
+  for (uint16_t v = 0; v < HEIGHT; v++) {
+    for (uint16_t u = 0; u < WIDTH; u++) {
+      float ux = u - CENTER_X;
+      float vy = v - CENTER_Y;
+      float dx = warpAmount * sinf(vy * 0.021f + warp[0]) * sinf(ux * 0.017f + warp[1]);
+      float dy = warpAmount * sinf(ux * 0.019f + warp[2]) * sinf(vy * 0.023f + warp[3]);
+      float mx = cosA * (ux - shiftX) + sinA * (vy - shiftY) + CENTER_X + dx;
+      float my = -sinA * (ux - shiftX) + cosA * (vy - shiftY) + CENTER_Y + dy;
+      float ridge = _sample(mx, my);
+
+      if (params.partiality > 0 && ux * cutX + vy * cutY > cutAt) {
+        ridge = 0;
+      }
+      if (params.dryness > 0 && ridge > 0) {
+        float patch = 0.5f + 0.25f * sinf(ux * 0.05f + dry[0]) * sinf(vy * 0.043f + dry[1])
+                    + 0.25f * sinf(ux * 0.11f + vy * 0.07f + dry[2]);
+        ridge -= params.dryness * 0.6f;
+        if (patch < params.dryness * 0.7f) {
+          ridge *= 0.2f;
+        }
+      }
+
+      float level = 232 - 190 * (ridge > 0 ? ridge : 0);
+      if (params.noise > 0) {
+        level += gaussian(&state) * 40 * params.noise;
+      }
+      (*image)[(size_t)v * WIDTH + u] = level < 0 ? 0 : level > 255 ? 255 : (uint8_t)level;
+    }
+  }
+}
+
+// The UpImage (0x0A) wire format: 4 bits per pixel, two pixels per byte,
+// left pixel in the high nibble, rows top to bottom
+void FingerPrintSynth::packUpImage(const std::vector<uint8_t>& image, std::vector<uint8_t>* packed) {
+  packed->resize(image.size() / 2);
+  for (size_t i = 0; i < packed->size(); i++) {
+    (*packed)[i] = (image[2 * i] & 0xF0) | (image[2 * i + 1] >> 4);
+  }
+}
@@ -0,0 +1,62 @@
+#ifndef FINGERPRINT_SYNTH_H
+#define FINGERPRINT_SYNTH_H
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Synthetic fingerprint images at the sensor's resolution, for benchmarking
+// image handling on the host without real biometric data. Each generator is
+// one synthetic finger: a master ridge pattern grown from its seed by
+// iterated Gabor filtering along a Sherlock-Monro orientation field. Its
+// impressions add placement, distortion, partial contact, dryness and noise.
+// Images are 8-bit grayscale, dark ridges on a light background.
+class FingerPrintSynth {
+  public:
+    static const uint16_t WIDTH = 256;
+    static const uint16_t HEIGHT = 288;
+    static const size_t UPIMAGE_SIZE = (size_t)WIDTH * HEIGHT / 2;
+
+    enum PatternClass : uint8_t {
+      PATTERN_ARCH = 0,
+      PATTERN_TENTED_ARCH = 1,
+      PATTERN_LEFT_LOOP = 2,
+      PATTERN_RIGHT_LOOP = 3,
+      PATTERN_WHORL = 4,
+    };
+
+    // How one impression differs from the master, each 0-1 unless noted
+    struct Impression {
+      float noise;        // sensor noise
+      float partiality;   // share of the print missing from the contact area
+      float dryness;      // broken, thinner ridges
+      float rotation;     // maximum rotation, degrees
+      float shift;        // maximum displacement, pixels
+      float distortion;   // elastic skin distortion
+    };
+
+    FingerPrintSynth(uint32_t seed, PatternClass pattern);
+    FingerPrintSynth(uint32_t seed);  // pattern class picked from the seed
+    PatternClass pattern() const;
+
+    void master(std::vector<uint8_t>* image);
+    void impression(uint32_t impressionSeed, const Impression& params, std::vector<uint8_t>* image);
+    static Impression defaultImpression();
+    static void packUpImage(const std::vector<uint8_t>& image, std::vector<uint8_t>* packed);
+  private:
+    uint32_t _seed;
+    PatternClass _pattern;
+    float _period;                // ridge period in pixels
+    uint8_t _coreCount;
+    uint8_t _deltaCount;
+    float _cores[2][2];           // x, y of each singular point
+    float _deltas[2][2];
+    float _archHeight;            // ridge bump for arches, pixels
+    std::vector<float> _ridges;   // master pattern, -1 valley to 1 ridge, 0 outside
+    std::vector<uint8_t> _angles; // ridge orientation per pixel, 0-15
+
+    void _place();
+    void _grow();
+    float _orientation(float x, float y) const;
+    float _sample(float x, float y) const;
+};
+#endif // FINGERPRINT_SYNTH_H
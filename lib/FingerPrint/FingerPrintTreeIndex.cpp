@@ -0,0 +1,151 @@
+#include "FingerPrintTreeIndex.h"
+#include <algorithm>
+#include <utility>
+
+static bool closer(const FingerPrintIndex::Result& a, const FingerPrintIndex::Result& b) {
+  return a.distance < b.distance;
+}
+
+FingerPrintTreeIndex::FingerPrintTreeIndex() {
+  _root = -1;
+  _covered = 0;
+  _epsilon = 0.0f;
+  _distanceCount = 0;
+}
+
+// Error bound for search(): subtrees are pruned against tau / (1 + epsilon),
+// so results may be up to (1 + epsilon) times farther than the true nearest.
+// 0 keeps the search exact with respect to the metric.
+void FingerPrintTreeIndex::setErrorBound(float epsilon) {
+  _epsilon = epsilon < 0.0f ? 0.0f : epsilon;
+}
+
+size_t FingerPrintTreeIndex::size() const {
+  return _features.size();
+}
+
+size_t FingerPrintTreeIndex::coveredRecords() const {
+  return _covered;
+}
+
+size_t FingerPrintTreeIndex::lastDistanceCount() const {
+  return _distanceCount;
+}
+
+// (Re)build the tree over every active record that decodes. Records added to
+// the gallery afterwards are not covered until the next build.
+size_t FingerPrintTreeIndex::build(const FingerPrintGallery& gallery) {
+  _features.clear();
+  _records.clear();
+  _nodes.clear();
+  _root = -1;
+  _covered = gallery.size();
+
+  FingerPrintFeatures features;
+  for (size_t i = 0; i < gallery.size(); i++) {
+    const FingerPrintGallery::Record& record = gallery.at(i);
+    if (record.active && FingerPrintMatcher::decode(record.data, &features)) {
+      _features.push_back(features);
+      _records.push_back(i);
+    }
+  }
+
+  std::vector<uint32_t> items(_features.size());
+  for (size_t i = 0; i < items.size(); i++) {
+    items[i] = i;
+  }
+  _nodes.reserve(items.size());
+  uint32_t seed = 0x9E3779B9;
+  _root = _build(items, 0, items.size(), &seed);
+  return _features.size();
+}
+
+int32_t FingerPrintTreeIndex::_build(std::vector<uint32_t>& items, size_t lo, size_t hi, uint32_t* seed) {
+  if (lo >= hi) {
+    return -1;
+  }
+
+  // Random vantage point keeps the tree balanced on ordered galleries
+  *seed = *seed * 1664525 + 1013904223;
+  std::swap(items[lo], items[lo + (*seed >> 8) % (hi - lo)]);
+
+  int32_t id = _nodes.size();
+  Node node;
+  node.item = items[lo];
+  node.radius = 0.0f;
+  node.inside = -1;
+  node.outside = -1;
+  _nodes.push_back(node);
+  if (hi - lo == 1) {
+    return id;
+  }
+
+  const FingerPrintFeatures& vantage = _features[items[lo]];
+  std::vector<std::pair<float, uint32_t> > byDistance;
+  byDistance.reserve(hi - lo - 1);
+  for (size_t i = lo + 1; i < hi; i++) {
+    byDistance.push_back(std::make_pair(FingerPrintMatcher::distance(vantage, _features[items[i]]), items[i]));
+  }
+  size_t median = byDistance.size() / 2;
+  std::nth_element(byDistance.begin(), byDistance.begin() + median, byDistance.end());
+  for (size_t i = 0; i < byDistance.size(); i++) {
+    items[lo + 1 + i] = byDistance[i].second;
+  }
+
+  float radius = byDistance[median].first;
+  size_t mid = lo + 1 + median;
+  int32_t inside = _build(items, lo + 1, mid, seed);
+  int32_t outside = _build(items, mid, hi, seed);
+  _nodes[id].radius = radius;
+  _nodes[id].inside = inside;
+  _nodes[id].outside = outside;
+  return id;
+}
+
+// k nearest records within maxDistance, closest first
+size_t FingerPrintTreeIndex::search(const FingerPrintFeatures& probe, size_t k, float maxDistance,
+                                std::vector<Result>* results) const {
+  results->clear();
+  _distanceCount = 0;
+  if (_root < 0 || k == 0) {
+    return 0;
+  }
+  float tau = maxDistance;
+  _search(_root, probe, k, &tau, results);
+  std::sort_heap(results->begin(), results->end(), closer);
+  return results->size();
+}
+
+void FingerPrintTreeIndex::_search(int32_t node, const FingerPrintFeatures& probe, size_t k, float* tau,
+                               std::vector<Result>* heap) const {
+  if (node < 0) {
+    return;
+  }
+  const Node& n = _nodes[node];
+  float d = FingerPrintMatcher::distance(probe, _features[n.item]);
+  _distanceCount++;
+
+  if (d <= *tau) {
+    Result result;
+    result.index = _records[n.item];
+    result.distance = d;
+    heap->push_back(result);
+    std::push_heap(heap->begin(), heap->end(), closer);
+    if (heap->size() > k) {
+      std::pop_heap(heap->begin(), heap->end(), closer);
+      heap->pop_back();
+    }
+    if (heap->size() == k) {
+      *tau = heap->front().distance;
+    }
+  }
+
+  // Visit the side the probe falls on first; the bound shrinks as it fills
+  if (d < n.radius) {
+    if (d - *tau / (1.0f + _epsilon) <= n.radius) _search(n.inside, probe, k, tau, heap);
+    if (d + *tau / (1.0f + _epsilon) >= n.radius) _search(n.outside, probe, k, tau, heap);
+  } else {
+    if (d + *tau / (1.0f + _epsilon) >= n.radius) _search(n.outside, probe, k, tau, heap);
+    if (d - *tau / (1.0f + _epsilon) <= n.radius) _search(n.inside, probe, k, tau, heap);
+  }
+}
@@ -0,0 +1,42 @@
+#ifndef FINGERPRINT_TREE_INDEX_H
+#define FINGERPRINT_TREE_INDEX_H
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "FingerPrintIndex.h"
+
+// Vantage-point tree over the gallery, using FingerPrintMatcher::distance()
+// as the metric. Each node splits its subtree at the median distance to its
+// vantage template, so a search can skip subtrees whose distance bounds rule
+// out anything closer than the current k-th best.
+class FingerPrintTreeIndex : public FingerPrintIndex {
+  public:
+    FingerPrintTreeIndex();
+    size_t build(const FingerPrintGallery& gallery);
+    size_t search(const FingerPrintFeatures& probe, size_t k, float maxDistance,
+                  std::vector<Result>* results) const;
+    void setErrorBound(float epsilon);
+    size_t size() const;
+    size_t coveredRecords() const;     // gallery size when build() ran
+    size_t lastDistanceCount() const;
+  private:
+    struct Node {
+      uint32_t item;     // position in _features / _records
+      float radius;      // median distance to the vantage template
+      int32_t inside;    // subtree within radius, -1 if none
+      int32_t outside;   // subtree beyond radius, -1 if none
+    };
+
+    std::vector<FingerPrintFeatures> _features;
+    std::vector<size_t> _records;
+    std::vector<Node> _nodes;
+    int32_t _root;
+    size_t _covered;
+    float _epsilon;
+    mutable size_t _distanceCount;
+
+    int32_t _build(std::vector<uint32_t>& items, size_t lo, size_t hi, uint32_t* seed);
+    void _search(int32_t node, const FingerPrintFeatures& probe, size_t k, float* tau,
+                 std::vector<Result>* heap) const;
+};
+#endif // FINGERPRINT_TREE_INDEX_H
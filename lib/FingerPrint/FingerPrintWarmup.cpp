@@ -0,0 +1,92 @@
+#include "FingerPrintWarmup.h"
+#include <algorithm>
+
+// A bucket's weights are halved when one of them reaches this, so old habits
+// fade as new ones build up
+static const uint16_t DECAY_AT = 64;
+static const uint16_t ARRIVAL_WEIGHT = 4;
+
+static bool heavierFirst(const std::pair<uint32_t, uint32_t>& a, const std::pair<uint32_t, uint32_t>& b) {
+  return a.second > b.second;
+}
+
+FingerPrintWarmup::FingerPrintWarmup() {
+}
+
+// weekday 0 = Sunday, as in struct tm
+uint16_t FingerPrintWarmup::minuteOfWeek(uint8_t weekday, uint8_t hour, uint8_t minute) {
+  return ((weekday % 7) * 24 + hour % 24) * 60 + minute % 60;
+}
+
+void FingerPrintWarmup::recordArrival(uint32_t userId, uint16_t minuteOfWeek) {
+  _add(userId, minuteOfWeek, ARRIVAL_WEIGHT);
+}
+
+void FingerPrintWarmup::addRosterEntry(uint32_t userId, uint16_t minuteOfWeek, uint16_t weight) {
+  _add(userId, minuteOfWeek, weight);
+}
+
+void FingerPrintWarmup::clear() {
+  for (uint16_t b = 0; b < BUCKETS; b++) {
+    _buckets[b].clear();
+  }
+}
+
+void FingerPrintWarmup::_add(uint32_t userId, uint16_t minuteOfWeek, uint16_t weight) {
+  std::vector<Entry>& bucket = _buckets[(minuteOfWeek % MINUTES_PER_WEEK) / BUCKET_MINUTES];
+  size_t i = 0;
+  while (i < bucket.size() && bucket[i].userId != userId) i++;
+  if (i == bucket.size()) {
+    Entry entry = {userId, 0};
+    bucket.push_back(entry);
+  }
+  bucket[i].weight += weight;
+
+  if (bucket[i].weight >= DECAY_AT) {
+    size_t kept = 0;
+    for (size_t j = 0; j < bucket.size(); j++) {
+      bucket[j].weight /= 2;
+      if (bucket[j].weight > 0) {
+        bucket[kept++] = bucket[j];
+      }
+    }
+    bucket.resize(kept);
+  }
+}
+
+// Users expected between minuteOfWeek and minuteOfWeek + leadMinutes, most
+// likely first
+size_t FingerPrintWarmup::predict(uint16_t minuteOfWeek, uint16_t leadMinutes, size_t maxUsers,
+                                  std::vector<uint32_t>* users) const {
+  users->clear();
+  std::vector<std::pair<uint32_t, uint32_t> > totals;
+  uint16_t first = (minuteOfWeek % MINUTES_PER_WEEK) / BUCKET_MINUTES;
+  uint16_t span = (leadMinutes + BUCKET_MINUTES - 1) / BUCKET_MINUTES + 1;
+  if (span > BUCKETS) {
+    span = BUCKETS;
+  }
+
+  std::vector<std::pair<uint32_t, uint32_t> > entries;
+  for (uint16_t s = 0; s < span; s++) {
+    const std::vector<Entry>& bucket = _buckets[(first + s) % BUCKETS];
+    for (size_t i = 0; i < bucket.size(); i++) {
+      entries.push_back(std::make_pair(bucket[i].userId, (uint32_t)bucket[i].weight));
+    }
+  }
+
+  // Sum each user's weight across the window
+  std::sort(entries.begin(), entries.end());
+  for (size_t i = 0; i < entries.size(); i++) {
+    if (!totals.empty() && totals.back().first == entries[i].first) {
+      totals.back().second += entries[i].second;
+    } else {
+      totals.push_back(entries[i]);
+    }
+  }
+
+  std::sort(totals.begin(), totals.end(), heavierFirst);
+  for (size_t i = 0; i < totals.size() && users->size() < maxUsers; i++) {
+    users->push_back(totals[i].first);
+  }
+  return users->size();
+}
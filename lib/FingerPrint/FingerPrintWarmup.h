@@ -0,0 +1,33 @@
+#ifndef FINGERPRINT_WARMUP_H
+#define FINGERPRINT_WARMUP_H
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Learns when each user tends to arrive at a reader, per half hour of the
+// week, and predicts who is due shortly so their templates can be cached
+// before the rush. Rosters can seed the schedule before any history exists.
+class FingerPrintWarmup {
+  public:
+    static const uint16_t MINUTES_PER_WEEK = 7 * 24 * 60;
+    static const uint16_t BUCKET_MINUTES = 30;
+    static const uint16_t BUCKETS = MINUTES_PER_WEEK / BUCKET_MINUTES;
+
+    FingerPrintWarmup();
+    static uint16_t minuteOfWeek(uint8_t weekday, uint8_t hour, uint8_t minute);
+
+    void recordArrival(uint32_t userId, uint16_t minuteOfWeek);
+    void addRosterEntry(uint32_t userId, uint16_t minuteOfWeek, uint16_t weight = 8);
+    size_t predict(uint16_t minuteOfWeek, uint16_t leadMinutes, size_t maxUsers,
+                   std::vector<uint32_t>* users) const;
+    void clear();
+  private:
+    struct Entry {
+      uint32_t userId;
+      uint16_t weight;
+    };
+
+    std::vector<Entry> _buckets[BUCKETS];
+    void _add(uint32_t userId, uint16_t minuteOfWeek, uint16_t weight);
+};
+#endif // FINGERPRINT_WARMUP_H